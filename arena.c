@@ -0,0 +1,129 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Bump allocator for per-cycle scratch buffers, see arena.h.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_SIZE (4*1024*1024)
+
+struct arena_chunk
+{
+	arena_chunk_t* next;
+	size_t size;   // Usable bytes after the header
+	size_t used;
+	size_t dirty;  // Bytes handed out at least once since the chunk was allocated; the rest is still zero.
+};
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+#define CHUNK_HDR ALIGN_UP(sizeof(arena_chunk_t))
+#define CHUNK_DATA(c) ((uint8_t*)(c) + CHUNK_HDR)
+
+static __thread arena_t tls_arena;
+
+arena_t* thread_arena()
+{
+	return &tls_arena;
+}
+
+static void* arena_alloc_internal(arena_t* a, size_t size, int zero)
+{
+	size = size ? ALIGN_UP(size) : ARENA_ALIGN;
+
+	arena_chunk_t* c = a->cur;
+	while(c && c->used + size > c->size)
+		c = c->next;
+
+	if(!c)
+	{
+		size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+		// calloc: fresh chunks are zero, so arena_calloc() doesn't need to touch them.
+		c = calloc(1, CHUNK_HDR + chunk_size);
+		if(!c)
+		{
+			printf("ERROR: arena: out of memory allocating a %d KB chunk\n", (int)(chunk_size/1024));
+			return NULL;
+		}
+		c->size = chunk_size;
+
+		if(!a->first)
+			a->first = c;
+		else
+		{
+			arena_chunk_t* last = a->first;
+			while(last->next) last = last->next;
+			last->next = c;
+		}
+	}
+
+	void* ret = CHUNK_DATA(c) + c->used;
+
+	if(zero && c->used < c->dirty)
+	{
+		size_t n_dirty = c->dirty - c->used;
+		memset(ret, 0, (size < n_dirty) ? size : n_dirty);
+	}
+
+	c->used += size;
+	if(c->used > c->dirty)
+		c->dirty = c->used;
+	a->cur = c;
+
+	a->in_use += size;
+	if(a->in_use > a->high_water)
+		a->high_water = a->in_use;
+
+	return ret;
+}
+
+void* arena_alloc(arena_t* a, size_t size)
+{
+	return arena_alloc_internal(a, size, 0);
+}
+
+void* arena_calloc(arena_t* a, size_t nmemb, size_t size)
+{
+	return arena_alloc_internal(a, nmemb*size, 1);
+}
+
+void arena_reset(arena_t* a)
+{
+	if(a->high_water > a->reported)
+	{
+		size_t reserved = 0;
+		for(arena_chunk_t* c = a->first; c; c = c->next)
+			reserved += c->size;
+
+		printf("Info: scratch arena high-water mark %d KB (%d KB reserved)\n", (int)(a->high_water/1024), (int)(reserved/1024));
+		a->reported = a->high_water;
+	}
+
+	for(arena_chunk_t* c = a->first; c; c = c->next)
+		c->used = 0;
+	a->cur = a->first;
+	a->in_use = 0;
+}
@@ -0,0 +1,58 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+	Scratch memory for one mapping / routing cycle. Allocation is a pointer bump; nothing is freed individually,
+	arena_reset() releases everything at once. The memory is kept and reused by the next cycle, so the heap
+	and the page fault handler aren't hit once the arena has grown to its working size.
+
+	Each thread has its own arena (thread_arena()), so no locking is needed. Reset it only at the start of
+	a top-level operation (map_lidars(), map_3dtof(), one route search), when no scratch buffer is live.
+*/
+
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct
+{
+	arena_chunk_t* first;
+	arena_chunk_t* cur;
+	size_t in_use;
+	size_t high_water;   // Peak in_use, over all cycles
+	size_t reported;     // high_water at the last report
+} arena_t;
+
+arena_t* thread_arena();
+
+// Returns NULL (and prints an error) if out of memory. Aligned to 16 bytes.
+void* arena_alloc(arena_t* a, size_t size);
+
+// Like calloc; only the parts of the arena that have been handed out before get memset.
+void* arena_calloc(arena_t* a, size_t nmemb, size_t size);
+
+// Releases all allocations. Prints the high-water mark when it has grown.
+void arena_reset(arena_t* a);
+
+#endif
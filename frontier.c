@@ -0,0 +1,318 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Exploration frontier extraction.
+
+	Each map page has a frontier page of FRONTIER_CELL_W*FRONTIER_CELL_W unit cells, flagged known / blocked /
+	frontier. Mapping marks the tiles it touches dirty (invalidate_frontiers()); only those are recalculated,
+	at the next query.
+
+	A query works on a window of cells around the robot: a breadth-first search over the known, free cells
+	gives the route distance to every reachable cell, then the 8-connected frontier cells are clustered.
+	Each cluster gets a goal point (its reachable cell closest to the centroid) and a score that grows with
+	the cluster size and shrinks with the route distance to the goal.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "datatypes.h"
+#include "mapping.h"
+#include "frontier.h"
+#include "arena.h"
+
+#define FRONTIER_CELL_MM (FRONTIER_CELL_W*MAP_UNIT_W)
+#define FRONTIER_WIN (2*FRONTIER_SEARCH_RANGE/FRONTIER_CELL_MM) // Query window width, in cells
+#define FRONTIER_WORLD_CELLS (MAP_W*FRONTIER_CELLS)
+
+#define FRONTIER_MIN_CLUSTER 5     // in cells; smaller ones are mostly holes in the lidar coverage
+#define FRONTIER_MIN_ROUTE 4       // in cells; the robot already sees the frontiers right next to it
+#define FRONTIER_LENGTH_WEIGHT 2   // 1 mm of frontier is worth this many mm of driving
+
+#define FRONTIER_OBSTACLES (UNIT_ITEM | UNIT_WALL | UNIT_INVISIBLE_WALL | UNIT_3D_WALL | UNIT_DROP)
+
+#define FRONTIER_CELL_VISITED (1<<7) // Query-time only, in the window copy
+
+#define sq(x) ((x)*(x))
+
+void invalidate_frontiers(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1)
+{
+	// Frontier status of a unit depends on its 4 neighbors.
+	unit_x0 -= 1; unit_y0 -= 1;
+	unit_x1 += 1; unit_y1 += 1;
+	if(unit_x0 < 0) unit_x0 = 0;
+	if(unit_y0 < 0) unit_y0 = 0;
+	if(unit_x1 > MAP_W*MAP_PAGE_W-1) unit_x1 = MAP_W*MAP_PAGE_W-1;
+	if(unit_y1 > MAP_W*MAP_PAGE_W-1) unit_y1 = MAP_W*MAP_PAGE_W-1;
+
+	for(int tx = unit_x0/FRONTIER_TILE_W; tx <= unit_x1/FRONTIER_TILE_W; tx++)
+	{
+		for(int ty = unit_y0/FRONTIER_TILE_W; ty <= unit_y1/FRONTIER_TILE_W; ty++)
+		{
+			frontier_page_t* fp = w->fpages[tx/FRONTIER_TILES][ty/FRONTIER_TILES];
+			if(fp)
+				fp->dirty[tx%FRONTIER_TILES][ty%FRONTIER_TILES] = 1;
+		}
+	}
+}
+
+// Unmapped units of pages not in memory are not known to be unmapped, so they don't make frontiers.
+static int unit_unmapped(world_t* w, int px, int py, int ox, int oy)
+{
+	if(ox < 0) { ox += MAP_PAGE_W; px--; }
+	else if(ox >= MAP_PAGE_W) { ox -= MAP_PAGE_W; px++; }
+	if(oy < 0) { oy += MAP_PAGE_W; py--; }
+	else if(oy >= MAP_PAGE_W) { oy -= MAP_PAGE_W; py++; }
+
+	if(px < 0 || px >= MAP_W || py < 0 || py >= MAP_W || !w->pages[px][py])
+		return 0;
+
+	return !(MU(MAP_UNIT(w->pages[px][py], ox, oy), result) & UNIT_MAPPED);
+}
+
+static void update_frontier_tile(world_t* w, int px, int py, int tx, int ty)
+{
+	map_page_t* p = w->pages[px][py];
+	frontier_page_t* fp = w->fpages[px][py];
+
+	for(int cx = tx*FRONTIER_TILE_W/FRONTIER_CELL_W; cx < (tx+1)*FRONTIER_TILE_W/FRONTIER_CELL_W; cx++)
+	{
+		for(int cy = ty*FRONTIER_TILE_W/FRONTIER_CELL_W; cy < (ty+1)*FRONTIER_TILE_W/FRONTIER_CELL_W; cy++)
+		{
+			uint8_t c = 0;
+			for(int ox = cx*FRONTIER_CELL_W; ox < (cx+1)*FRONTIER_CELL_W; ox++)
+			{
+				for(int oy = cy*FRONTIER_CELL_W; oy < (cy+1)*FRONTIER_CELL_W; oy++)
+				{
+					uint8_t result = MU(MAP_UNIT(p, ox, oy), result);
+					if(result & FRONTIER_OBSTACLES)
+						c |= FRONTIER_CELL_BLOCKED;
+
+					if(!(result & UNIT_MAPPED))
+						continue;
+
+					c |= FRONTIER_CELL_KNOWN;
+
+					if(!(result & FRONTIER_OBSTACLES) && !(c & FRONTIER_CELL_FRONTIER) &&
+					   (unit_unmapped(w, px, py, ox-1, oy) || unit_unmapped(w, px, py, ox+1, oy) ||
+					    unit_unmapped(w, px, py, ox, oy-1) || unit_unmapped(w, px, py, ox, oy+1)))
+					{
+						c |= FRONTIER_CELL_FRONTIER;
+					}
+				}
+			}
+			fp->cell[cx][cy] = c;
+		}
+	}
+	fp->dirty[tx][ty] = 0;
+}
+
+static void update_frontier_page(world_t* w, int px, int py)
+{
+	if(!w->fpages[px][py])
+	{
+		w->fpages[px][py] = malloc(sizeof(frontier_page_t));
+		if(!w->fpages[px][py])
+		{
+			printf("ERROR: Out of memory allocating frontier page\n");
+			return;
+		}
+		memset(w->fpages[px][py]->dirty, 1, sizeof(w->fpages[px][py]->dirty));
+	}
+
+	for(int tx = 0; tx < FRONTIER_TILES; tx++)
+	{
+		for(int ty = 0; ty < FRONTIER_TILES; ty++)
+		{
+			if(w->fpages[px][py]->dirty[tx][ty])
+				update_frontier_tile(w, px, py, tx, ty);
+		}
+	}
+}
+
+static const int neigh8[8][2] = {{1,0},{-1,0},{0,1},{0,-1},{1,1},{-1,1},{1,-1},{-1,-1}};
+
+int find_frontier_goal(world_t* w, int32_t x, int32_t y, int (*excluded)(int32_t x, int32_t y), frontier_goal_t* goal)
+{
+	arena_t* arena = thread_arena();
+	arena_reset(arena);
+
+	uint8_t* cells = arena_alloc(arena, FRONTIER_WIN*FRONTIER_WIN*sizeof(uint8_t)); // [y*FRONTIER_WIN+x]
+	int16_t* dist  = arena_alloc(arena, FRONTIER_WIN*FRONTIER_WIN*sizeof(int16_t));
+	int32_t* queue = arena_alloc(arena, FRONTIER_WIN*FRONTIER_WIN*sizeof(int32_t));
+
+	if(!cells || !dist || !queue)
+	{
+		printf("ERROR: Out of memory in find_frontier_goal\n");
+		return 0;
+	}
+
+	int ux, uy;
+	unit_coords(x, y, &ux, &uy);
+	int robot_cx = ux/FRONTIER_CELL_W, robot_cy = uy/FRONTIER_CELL_W;
+
+	int win_cx = robot_cx - FRONTIER_WIN/2;
+	int win_cy = robot_cy - FRONTIER_WIN/2;
+	if(win_cx < 0) win_cx = 0;
+	if(win_cy < 0) win_cy = 0;
+	if(win_cx > FRONTIER_WORLD_CELLS-FRONTIER_WIN) win_cx = FRONTIER_WORLD_CELLS-FRONTIER_WIN;
+	if(win_cy > FRONTIER_WORLD_CELLS-FRONTIER_WIN) win_cy = FRONTIER_WORLD_CELLS-FRONTIER_WIN;
+
+	// Bring the frontier pages up to date and copy the window.
+	memset(cells, 0, FRONTIER_WIN*FRONTIER_WIN*sizeof(uint8_t));
+	for(int px = win_cx/FRONTIER_CELLS; px <= (win_cx+FRONTIER_WIN-1)/FRONTIER_CELLS; px++)
+	{
+		for(int py = win_cy/FRONTIER_CELLS; py <= (win_cy+FRONTIER_WIN-1)/FRONTIER_CELLS; py++)
+		{
+			if(!w->pages[px][py])
+				continue;
+
+			update_frontier_page(w, px, py);
+			frontier_page_t* fp = w->fpages[px][py];
+			if(!fp)
+				continue;
+
+			for(int cx = 0; cx < FRONTIER_CELLS; cx++)
+			{
+				int wx = px*FRONTIER_CELLS + cx - win_cx;
+				if(wx < 0 || wx >= FRONTIER_WIN)
+					continue;
+
+				for(int cy = 0; cy < FRONTIER_CELLS; cy++)
+				{
+					int wy = py*FRONTIER_CELLS + cy - win_cy;
+					if(wy < 0 || wy >= FRONTIER_WIN)
+						continue;
+
+					cells[wy*FRONTIER_WIN+wx] = fp->cell[cx][cy];
+				}
+			}
+		}
+	}
+
+	// Route distances, in cells, over known free cells. The robot's own cell is always a start.
+	for(int i = 0; i < FRONTIER_WIN*FRONTIER_WIN; i++)
+		dist[i] = -1;
+
+	int q_rd = 0, q_wr = 0;
+	int start = (robot_cy-win_cy)*FRONTIER_WIN + (robot_cx-win_cx);
+	dist[start] = 0;
+	queue[q_wr++] = start;
+
+	while(q_rd < q_wr)
+	{
+		int idx = queue[q_rd++];
+		int cx = idx%FRONTIER_WIN, cy = idx/FRONTIER_WIN;
+		for(int n = 0; n < 8; n++)
+		{
+			int nx = cx+neigh8[n][0], ny = cy+neigh8[n][1];
+			if(nx < 0 || nx >= FRONTIER_WIN || ny < 0 || ny >= FRONTIER_WIN)
+				continue;
+
+			int nidx = ny*FRONTIER_WIN+nx;
+			if(dist[nidx] >= 0 || (cells[nidx] & (FRONTIER_CELL_KNOWN|FRONTIER_CELL_BLOCKED)) != FRONTIER_CELL_KNOWN)
+				continue;
+
+			dist[nidx] = dist[idx]+1;
+			queue[q_wr++] = nidx;
+		}
+	}
+
+	// Cluster the frontier cells, rank the clusters.
+	int found = 0;
+	goal->n_clusters = 0;
+	for(int i = 0; i < FRONTIER_WIN*FRONTIER_WIN; i++)
+	{
+		if(!(cells[i] & FRONTIER_CELL_FRONTIER) || (cells[i] & FRONTIER_CELL_VISITED))
+			continue;
+
+		int n = 0;
+		int64_t sum_x = 0, sum_y = 0;
+		cells[i] |= FRONTIER_CELL_VISITED;
+		queue[n++] = i;
+		for(int m = 0; m < n; m++)
+		{
+			int cx = queue[m]%FRONTIER_WIN, cy = queue[m]/FRONTIER_WIN;
+			sum_x += cx; sum_y += cy;
+			for(int k = 0; k < 8; k++)
+			{
+				int nx = cx+neigh8[k][0], ny = cy+neigh8[k][1];
+				if(nx < 0 || nx >= FRONTIER_WIN || ny < 0 || ny >= FRONTIER_WIN)
+					continue;
+
+				int nidx = ny*FRONTIER_WIN+nx;
+				if((cells[nidx] & (FRONTIER_CELL_FRONTIER|FRONTIER_CELL_VISITED)) == FRONTIER_CELL_FRONTIER)
+				{
+					cells[nidx] |= FRONTIER_CELL_VISITED;
+					queue[n++] = nidx;
+				}
+			}
+		}
+
+		if(n < FRONTIER_MIN_CLUSTER)
+			continue;
+
+		int mid_x = sum_x/n, mid_y = sum_y/n;
+		int best_m = -1, best_d2 = 0;
+		int32_t best_x_mm = 0, best_y_mm = 0;
+		for(int m = 0; m < n; m++)
+		{
+			int d = dist[queue[m]];
+			if(d < FRONTIER_MIN_ROUTE)
+				continue;
+
+			int cx = queue[m]%FRONTIER_WIN, cy = queue[m]/FRONTIER_WIN;
+			int d2 = sq(cx-mid_x) + sq(cy-mid_y);
+			if(best_m >= 0 && d2 >= best_d2)
+				continue;
+
+			int32_t x_mm, y_mm;
+			mm_from_unit_coords((win_cx+cx)*FRONTIER_CELL_W + FRONTIER_CELL_W/2, (win_cy+cy)*FRONTIER_CELL_W + FRONTIER_CELL_W/2, &x_mm, &y_mm);
+			if(excluded && excluded(x_mm, y_mm))
+				continue;
+
+			best_m = m;
+			best_d2 = d2;
+			best_x_mm = x_mm;
+			best_y_mm = y_mm;
+		}
+
+		if(best_m < 0)
+			continue;
+
+		goal->n_clusters++;
+		int length = n*FRONTIER_CELL_MM;
+		int route_len = dist[queue[best_m]]*FRONTIER_CELL_MM;
+		int score = FRONTIER_LENGTH_WEIGHT*length - route_len;
+		if(!found || score > goal->score)
+		{
+			found = 1;
+			goal->x = best_x_mm;
+			goal->y = best_y_mm;
+			goal->length = length;
+			goal->route_len = route_len;
+			goal->score = score;
+		}
+	}
+
+	return found;
+}
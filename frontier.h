@@ -0,0 +1,55 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#ifndef FRONTIER_H
+#define FRONTIER_H
+
+#include <stdint.h>
+#include "mapping.h"
+
+/*
+	Exploration frontiers: mapped, free units next to unmapped ones. The frontier pages (world_t.fpages)
+	are kept up to date tile by tile as the map changes, so finding a goal only needs to look at cells.
+*/
+
+typedef struct
+{
+	int32_t x;     // Goal point on the frontier, in mm
+	int32_t y;
+	int length;    // Frontier cluster size, in mm
+	int route_len; // Distance from the robot along known free cells, in mm
+	int score;
+	int n_clusters; // Number of reachable frontier clusters considered
+} frontier_goal_t;
+
+#define FRONTIER_SEARCH_RANGE 10240 // in mm, from the robot along x and y
+
+// Marks the frontier tiles depending on the given unit rectangle (absolute unit coords, inclusive) dirty.
+void invalidate_frontiers(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1);
+
+/*
+	Finds the best frontier cluster within FRONTIER_SEARCH_RANGE of (x, y), ranking clusters by their size
+	and route distance. Goal points for which excluded() returns nonzero are skipped (excluded may be NULL).
+	Returns 1 and fills goal if one was found, 0 otherwise.
+*/
+int find_frontier_goal(world_t* w, int32_t x, int32_t y, int (*excluded)(int32_t x, int32_t y), frontier_goal_t* goal);
+
+#endif
@@ -36,6 +36,7 @@
 #include "datatypes.h"
 #include "uart.h"
 #include "hwdata.h"
+#include "pose_graph.h"
 
 #include "../rn1-brain/comm.h" // For the convenient 7-bit data handling macros.
 #define I14x2_I16(msb,lsb) ((int16_t)( ( ((uint16_t)(msb)<<9) | ((uint16_t)(lsb)<<2) ) ))
@@ -205,6 +206,58 @@ dbg_teleportation_extra_t bugextra;
 
 chafind_results_t chafind_results;
 
+/*
+	The lidar points arrive in world coordinates calculated with the robot pose at the start of the scan.
+	The scan takes a while, so when the robot moves, the later points are off. Assuming constant speed
+	over the scan, point i was taken at pose start + i/n*(end - start); move it by the difference:
+	rotate by the partial angle change around the start position, then add the partial translation.
+
+	Integer math, with the small-angle series for sin/cos (accurate to well below 1 mm at the
+	LIDAR_DESKEW_MAX_ANG limit and lidar range), so the loop has no calls or branches.
+*/
+
+#define LIDAR_DESKEW_MAX_ANG  (30*ANG_1_DEG)
+#define LIDAR_DESKEW_MAX_DIST 600 // mm; larger moves during one scan are treated as corrupt poses
+
+static void deskew_lidar(lidar_scan_t* lid, int32_t end_ang, int32_t end_x, int32_t end_y)
+{
+	int n = lid->n_points;
+	int32_t da = end_ang - lid->robot_pos.ang;
+	int32_t dx = end_x - lid->robot_pos.x;
+	int32_t dy = end_y - lid->robot_pos.y;
+
+	if(n < 2 || (da == 0 && dx == 0 && dy == 0))
+		return;
+
+	if(da > LIDAR_DESKEW_MAX_ANG || da < -LIDAR_DESKEW_MAX_ANG || sq(dx)+sq(dy) > sq(LIDAR_DESKEW_MAX_DIST))
+	{
+		printf("WARN: lidar scan start and end poses too far apart (a=%.1fdeg, x=%d, y=%d), not deskewing\n", (double)da/(double)ANG_1_DEG, dx, dy);
+		return;
+	}
+
+	// Per-point steps: angle in 2^-24 rad, translation in 2^-16 mm.
+	int64_t a_step = (int64_t)((double)da * (16777216.0*M_PI/2147483648.0)) / (n-1);
+	int64_t x_step = ((int64_t)dx<<16) / (n-1);
+	int64_t y_step = ((int64_t)dy<<16) / (n-1);
+	int64_t sx = lid->robot_pos.x, sy = lid->robot_pos.y;
+
+	for(int i = 0; i < n; i++)
+	{
+		int64_t a = a_step*i;
+		int64_t a2 = (a*a)>>24;
+		int64_t a4 = (a2*a2)>>24;
+		int64_t c = (1LL<<24) - (a2>>1) + a4/24 - ((a4*a2)>>24)/720;
+		int64_t s = a - ((a2*a)>>24)/6 + ((a4*a)>>24)/120;
+
+		int64_t px = lid->scan[i].x - sx;
+		int64_t py = lid->scan[i].y - sy;
+
+		// Rotation and translation summed at full precision and rounded once (+0.5 mm).
+		lid->scan[i].x = sx + ((c*px - s*py + ((x_step*i)<<8) + (1<<23))>>24);
+		lid->scan[i].y = sy + ((s*px + c*py + ((y_step*i)<<8) + (1<<23))>>24);
+	}
+}
+
 int parse_uart_msg(uint8_t* buf, int msgid, int len)
 {
 	switch(msgid)
@@ -226,6 +279,9 @@ int parse_uart_msg(uint8_t* buf, int msgid, int len)
 			int32_t start_ang = I32FROMBUFLE(buf, 4);
 			int32_t start_x   = I32FROMBUFLE(buf, 8);
 			int32_t start_y   = I32FROMBUFLE(buf, 12);
+			int32_t end_ang   = I32FROMBUFLE(buf, 16);
+			int32_t end_x     = I32FROMBUFLE(buf, 20);
+			int32_t end_y     = I32FROMBUFLE(buf, 24);
 
 			static int32_t prev_start_ang, prev_start_x, prev_start_y;
 
@@ -298,6 +354,9 @@ int parse_uart_msg(uint8_t* buf, int msgid, int len)
 				lid->scan[i].valid = 1;
 			}
 
+			if(!lid->is_invalid)
+				deskew_lidar(lid, end_ang, end_x, end_y);
+
 			if(verbose_mode) printf("INFO: Got lidar scan, n_points=%d, robot_pos=%d,%d\n", lid->n_points, lid->robot_pos.x, lid->robot_pos.y);
 
 
@@ -570,6 +629,8 @@ void correct_robot_pos(int32_t da, int32_t dx, int32_t dy, int id)
 		return;
 	}
 
+	pose_graph_robot_corrected(da, dx>>2, dy>>2);
+
 	da *= -1; // Robot angles are opposite to those of trigonometric funtions.
 
 /*	if(da == 0 && dx == 0 && dy == 0)
@@ -599,6 +660,8 @@ void set_robot_pos(int32_t na, int32_t nx, int32_t ny)
 {
 	printf("Setting robot pos to ang=%d, x=%d, y=%d\n", na>>16, nx, ny);
 
+	pose_graph_reset(); // Odometry doesn't continue over the jump.
+
 	uint8_t buf[14];
 
 	buf[0] = 0x8a;
@@ -0,0 +1,206 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define COUNTERS_HAVE_SSE2
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define COUNTERS_HAVE_NEON
+#endif
+
+#include "mapping.h"
+#include "map_counters.h"
+
+/*
+	The wall vanishing conditions, num_seen > 2*num_obstacles + 3 and num_seen > 5*num_obstacles + 10, are
+	evaluated in saturating u8 arithmetic. A saturated right hand side is >= 255, which num_seen can't
+	exceed, so the result is exact.
+*/
+
+static inline uint8_t qadd_u8(int a, int b)
+{
+	int s = a + b;
+	return (s > 255) ? 255 : s;
+}
+
+static int seen_counters_scalar(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles, int stride,
+	const uint8_t* ops, uint8_t* obst_changed, int n)
+{
+	int cnt = 0;
+	for(int i = 0; i < n; i++)
+	{
+		int op = ops[i];
+		if(!op)
+		{
+			obst_changed[i] = 0;
+			continue;
+		}
+		int old_obst = num_obstacles[i*stride];
+
+		int seen = qadd_u8(num_seen[i*stride], 1);
+		int obst = old_obst - (old_obst > 0);
+		int obst2 = qadd_u8(obst, obst);
+		int lim_sure = qadd_u8(obst2, 3);
+		int lim_few = qadd_u8(qadd_u8(qadd_u8(obst2, obst2), obst), 10);
+
+		int vanish = ((op & MERGE_SEEN_SURE) && seen > lim_sure) || ((op & MERGE_FEW_NEIGH) && seen > lim_few);
+
+		num_seen[i*stride] = seen;
+		num_obstacles[i*stride] = obst;
+		result[i*stride] = (result[i*stride] | UNIT_MAPPED) & ~(-vanish & UNIT_WALL);
+		obst_changed[i] = obst != old_obst && old_obst <= SCORE_SATURATION_OBSTACLES;
+		cnt++;
+	}
+	return cnt;
+}
+
+#ifdef COUNTERS_HAVE_SSE2
+static int seen_counters_sse2(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles,
+	const uint8_t* ops, uint8_t* obst_changed, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(1);
+	const __m128i f_sure = _mm_set1_epi8(MERGE_SEEN_SURE), f_few = _mm_set1_epi8(MERGE_FEW_NEIGH);
+	const __m128i b_mapped = _mm_set1_epi8(UNIT_MAPPED), b_wall = _mm_set1_epi8(UNIT_WALL);
+	const __m128i c3 = _mm_set1_epi8(3), c10 = _mm_set1_epi8(10);
+	const __m128i sat = _mm_set1_epi8(SCORE_SATURATION_OBSTACLES);
+
+	int cnt = 0, i;
+	for(i = 0; i+16 <= n; i += 16)
+	{
+		__m128i op = _mm_loadu_si128((const __m128i*)&ops[i]);
+		__m128i idle = _mm_cmpeq_epi8(op, zero);
+		int idle_bits = _mm_movemask_epi8(idle);
+		if(idle_bits == 0xffff)
+		{
+			_mm_storeu_si128((__m128i*)&obst_changed[i], zero);
+			continue;
+		}
+		cnt += 16 - __builtin_popcount(idle_bits);
+
+		__m128i inc = _mm_andnot_si128(idle, ones);
+		__m128i old_obst = _mm_loadu_si128((const __m128i*)&num_obstacles[i]);
+		__m128i seen = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)&num_seen[i]), inc);
+		__m128i obst = _mm_subs_epu8(old_obst, inc);
+		__m128i obst2 = _mm_adds_epu8(obst, obst);
+		__m128i lim_sure = _mm_adds_epu8(obst2, c3);
+		__m128i lim_few = _mm_adds_epu8(_mm_adds_epu8(_mm_adds_epu8(obst2, obst2), obst), c10);
+
+		// a > b for unsigned bytes: a -sat b != 0
+		__m128i sure = _mm_cmpeq_epi8(_mm_and_si128(op, f_sure), f_sure);
+		__m128i few = _mm_cmpeq_epi8(_mm_and_si128(op, f_few), f_few);
+		__m128i over_sure = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(seen, lim_sure), zero), sure);
+		__m128i over_few = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(seen, lim_few), zero), few);
+		__m128i vanish = _mm_and_si128(_mm_or_si128(over_sure, over_few), b_wall);
+
+		__m128i res = _mm_loadu_si128((const __m128i*)&result[i]);
+		res = _mm_or_si128(res, _mm_andnot_si128(idle, b_mapped));
+		res = _mm_andnot_si128(vanish, res);
+
+		// Changed if the counter moved (old != 0 on an updated unit) and old <= SCORE_SATURATION_OBSTACLES.
+		__m128i moved = _mm_andnot_si128(_mm_cmpeq_epi8(obst, old_obst), ones);
+		__m128i below_sat = _mm_cmpeq_epi8(_mm_subs_epu8(old_obst, sat), zero);
+
+		_mm_storeu_si128((__m128i*)&num_seen[i], seen);
+		_mm_storeu_si128((__m128i*)&num_obstacles[i], obst);
+		_mm_storeu_si128((__m128i*)&result[i], res);
+		_mm_storeu_si128((__m128i*)&obst_changed[i], _mm_and_si128(moved, below_sat));
+	}
+
+	return cnt + seen_counters_scalar(&result[i], &num_seen[i], &num_obstacles[i], 1, &ops[i], &obst_changed[i], n-i);
+}
+#endif
+
+#ifdef COUNTERS_HAVE_NEON
+static int seen_counters_neon(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles,
+	const uint8_t* ops, uint8_t* obst_changed, int n)
+{
+	const uint8x16_t ones = vdupq_n_u8(1);
+	const uint8x16_t f_sure = vdupq_n_u8(MERGE_SEEN_SURE), f_few = vdupq_n_u8(MERGE_FEW_NEIGH);
+	const uint8x16_t b_mapped = vdupq_n_u8(UNIT_MAPPED), b_wall = vdupq_n_u8(UNIT_WALL);
+	const uint8x16_t c3 = vdupq_n_u8(3), c10 = vdupq_n_u8(10);
+	const uint8x16_t sat = vdupq_n_u8(SCORE_SATURATION_OBSTACLES);
+
+	int cnt = 0, i;
+	for(i = 0; i+16 <= n; i += 16)
+	{
+		uint8x16_t op = vld1q_u8(&ops[i]);
+		uint8x16_t active = vtstq_u8(op, op);
+		uint8x16_t inc = vandq_u8(active, ones);
+		uint8x8_t inc_sum = vadd_u8(vget_low_u8(inc), vget_high_u8(inc));
+		inc_sum = vpadd_u8(inc_sum, inc_sum);
+		inc_sum = vpadd_u8(inc_sum, inc_sum);
+		inc_sum = vpadd_u8(inc_sum, inc_sum);
+		int n_active = vget_lane_u8(inc_sum, 0);
+		if(n_active == 0)
+		{
+			vst1q_u8(&obst_changed[i], vdupq_n_u8(0));
+			continue;
+		}
+		cnt += n_active;
+
+		uint8x16_t old_obst = vld1q_u8(&num_obstacles[i]);
+		uint8x16_t seen = vqaddq_u8(vld1q_u8(&num_seen[i]), inc);
+		uint8x16_t obst = vqsubq_u8(old_obst, inc);
+		uint8x16_t obst2 = vqaddq_u8(obst, obst);
+		uint8x16_t lim_sure = vqaddq_u8(obst2, c3);
+		uint8x16_t lim_few = vqaddq_u8(vqaddq_u8(vqaddq_u8(obst2, obst2), obst), c10);
+
+		uint8x16_t over_sure = vandq_u8(vtstq_u8(op, f_sure), vcgtq_u8(seen, lim_sure));
+		uint8x16_t over_few = vandq_u8(vtstq_u8(op, f_few), vcgtq_u8(seen, lim_few));
+		uint8x16_t vanish = vandq_u8(vorrq_u8(over_sure, over_few), b_wall);
+
+		uint8x16_t res = vld1q_u8(&result[i]);
+		res = vorrq_u8(res, vandq_u8(active, b_mapped));
+		res = vbicq_u8(res, vanish);
+
+		uint8x16_t moved = vmvnq_u8(vceqq_u8(obst, old_obst));
+		uint8x16_t below_sat = vcleq_u8(old_obst, sat);
+
+		vst1q_u8(&num_seen[i], seen);
+		vst1q_u8(&num_obstacles[i], obst);
+		vst1q_u8(&result[i], res);
+		vst1q_u8(&obst_changed[i], vandq_u8(vandq_u8(moved, below_sat), ones));
+	}
+
+	return cnt + seen_counters_scalar(&result[i], &num_seen[i], &num_obstacles[i], 1, &ops[i], &obst_changed[i], n-i);
+}
+#endif
+
+int map_seen_counters(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles, int stride,
+	const uint8_t* ops, uint8_t* obst_changed, int n)
+{
+	// The vector versions need the fields of consecutive units next to each other (MAP_PAGE_SOA).
+	if(stride == 1)
+	{
+#if defined(COUNTERS_HAVE_NEON)
+		return seen_counters_neon(result, num_seen, num_obstacles, ops, obst_changed, n);
+#elif defined(COUNTERS_HAVE_SSE2)
+		return seen_counters_sse2(result, num_seen, num_obstacles, ops, obst_changed, n);
+#endif
+	}
+	return seen_counters_scalar(result, num_seen, num_obstacles, stride, ops, obst_changed, n);
+}
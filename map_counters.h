@@ -0,0 +1,51 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#ifndef MAP_COUNTERS_H
+#define MAP_COUNTERS_H
+
+#include <stdint.h>
+
+/*
+	Map unit counter updates for do_mapping, run over a run of units that are consecutive in memory.
+
+	ops holds the do_mapping merge classification of each unit; the flags below.
+*/
+
+#define MERGE_WALL      1 // w_cnt > 3: a wall is very clearly here
+#define MERGE_SEEN      2 // w_cnt == 0 && s_cnt > 3: no wall, but the unit was mapped
+#define MERGE_SEEN_SURE 4 // s_cnt > 5 && no wall hits in the neighbours
+#define MERGE_FEW_NEIGH 8 // less than 2 wall hits in the neighbours
+
+/*
+	For the n units with ops[i] != 0 (MERGE_SEEN units): num_seen++ and num_obstacles-- (saturating),
+	UNIT_MAPPED set, and UNIT_WALL cleared if the counters say the wall has vanished. result, num_seen
+	and num_obstacles point to the fields of the first unit, stride is the distance between units in bytes.
+
+	obst_changed[i] is set to nonzero if num_obstacles changed so that the scoremaps need to be invalidated
+	(see obstacles_changed() in mapping.c), 0 otherwise.
+
+	Returns the number of units updated.
+*/
+int map_seen_counters(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles, int stride,
+	const uint8_t* ops, uint8_t* obst_changed, int n);
+
+#endif
@@ -21,17 +21,61 @@
 
 */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
 
 #include "mapping.h"
 #include "map_memdisk.h"
+#include "map_reloc.h"
 
 extern uint32_t robot_id;
 
+void map_page_to_file_layout(const map_page_t* page, map_unit_t* file)
+{
+	for(int ox = 0; ox < MAP_PAGE_W; ox++)
+	{
+		for(int oy = 0; oy < MAP_PAGE_W; oy++)
+		{
+			map_unit_ref_t u = MAP_UNIT((map_page_t*)page, ox, oy);
+			map_unit_t* f = &file[ox*MAP_PAGE_W+oy];
+			f->result = MU(u, result);
+			f->latest = MU(u, latest);
+			f->timestamp = MU(u, timestamp);
+			f->num_visited = MU(u, num_visited);
+			f->num_seen = MU(u, num_seen);
+			f->num_obstacles = MU(u, num_obstacles);
+			f->constraints = MU(u, constraints);
+			f->num_3d_obstacles = MU(u, num_3d_obstacles);
+		}
+	}
+}
+
+void map_page_from_file_layout(map_page_t* page, const map_unit_t* file)
+{
+	for(int ox = 0; ox < MAP_PAGE_W; ox++)
+	{
+		for(int oy = 0; oy < MAP_PAGE_W; oy++)
+		{
+			map_unit_ref_t u = MAP_UNIT(page, ox, oy);
+			const map_unit_t* f = &file[ox*MAP_PAGE_W+oy];
+			MU(u, result) = f->result;
+			MU(u, latest) = f->latest;
+			MU(u, timestamp) = f->timestamp;
+			MU(u, num_visited) = f->num_visited;
+			MU(u, num_seen) = f->num_seen;
+			MU(u, num_obstacles) = f->num_obstacles;
+			MU(u, constraints) = f->constraints;
+			MU(u, num_3d_obstacles) = f->num_3d_obstacles;
+		}
+	}
+}
+
 int write_map_page(world_t* w, int pagex, int pagey)
 {
 	char fname[1024];
@@ -48,17 +92,41 @@ int write_map_page(world_t* w, int pagex, int pagey)
 		return 1;
 	}
 
+#ifdef MAP_PAGE_SOA
+	map_unit_t* file_page = malloc(MAP_PAGE_W*MAP_PAGE_W*sizeof(map_unit_t));
+	if(!file_page)
+	{
+		printf("ERROR: Out of memory writing map page\n");
+		fclose(f);
+		return 1;
+	}
+	map_page_to_file_layout(w->pages[pagex][pagey], file_page);
+	if(fwrite(file_page, sizeof(map_unit_t), MAP_PAGE_W*MAP_PAGE_W, f) != MAP_PAGE_W*MAP_PAGE_W)
+	{
+		printf("Error: Writing map data failed\n");
+	}
+	free(file_page);
+#else
 	if(fwrite(w->pages[pagex][pagey], sizeof(map_page_t), 1, f) != 1)
 	{
 		printf("Error: Writing map data failed\n");
 	}
+#endif
 	fclose(f);
 	w->changed[pagex][pagey] = 0;
 
+	reloc_page_written(w, pagex, pagey);
+
 	return 0;
 }
 
 int read_map_page(world_t* w, int pagex, int pagey)
+{
+	w->changed[pagex][pagey] = 0;
+	return read_map_page_to(w, pagex, pagey, w->pages[pagex][pagey]);
+}
+
+int read_map_page_to(world_t* w, int pagex, int pagey, map_page_t* dst)
 {
 	char fname[1024];
 	if(snprintf(fname, 1024, MAP_DIR"/%08x_%u_%u_%u.map", robot_id, w->id, pagex, pagey) > 1022)
@@ -66,8 +134,6 @@ int read_map_page(world_t* w, int pagex, int pagey)
 
 	//printf("Info: Attempting to read map page %s\n", fname);
 
-	w->changed[pagex][pagey] = 0;
-
 	FILE *f = fopen(fname, "r");
 	if(!f)
 	{
@@ -77,15 +143,63 @@ int read_map_page(world_t* w, int pagex, int pagey)
 		return 1;
 	}
 
-	if(fread(w->pages[pagex][pagey], sizeof(map_page_t), 1, f) != 1)
+#ifdef MAP_PAGE_SOA
+	map_unit_t* file_page = calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(map_unit_t));
+	if(!file_page)
+	{
+		printf("ERROR: Out of memory reading map page\n");
+		fclose(f);
+		return 1;
+	}
+	if(fread(file_page, sizeof(map_unit_t), MAP_PAGE_W*MAP_PAGE_W, f) != MAP_PAGE_W*MAP_PAGE_W)
 	{
 		printf("Error: Reading map data failed\n");
 	}
+	map_page_from_file_layout(dst, file_page);
+	free(file_page);
+#else
+	if(fread(dst, sizeof(map_page_t), 1, f) != 1)
+	{
+		printf("Error: Reading map data failed\n");
+	}
+#endif
 
 	fclose(f);
 	return 0;
 }
 
+int find_map_pages(world_t* w, uint8_t present[MAP_W][MAP_W])
+{
+	memset(present, 0, MAP_W*MAP_W);
+
+	DIR* d = opendir(MAP_DIR);
+	if(!d)
+	{
+		fprintf(stderr, "Error %d opening map directory %s\n", errno, MAP_DIR);
+		return -1;
+	}
+
+	int n = 0;
+	struct dirent* de;
+	while((de = readdir(d)))
+	{
+		unsigned int f_robot_id, f_world_id, f_pagex, f_pagey;
+		char ext[8];
+		if(sscanf(de->d_name, "%08x_%u_%u_%u.%7s", &f_robot_id, &f_world_id, &f_pagex, &f_pagey, ext) != 5 || strcmp(ext, "map"))
+			continue;
+
+		if(f_robot_id != robot_id || f_world_id != w->id || f_pagex >= MAP_W || f_pagey >= MAP_W)
+			continue;
+
+		if(!present[f_pagex][f_pagey])
+			n++;
+		present[f_pagex][f_pagey] = 1;
+	}
+
+	closedir(d);
+	return n;
+}
+
 int load_map_page(world_t* w, int pagex, int pagey)
 {
 	if(w->pages[pagex][pagey])
@@ -99,6 +213,11 @@ int load_map_page(world_t* w, int pagex, int pagey)
 	}
 
 	int ret = read_map_page(w, pagex, pagey);
+
+	// Cached scoremaps of this page, and the neighboring page borders, were computed from other data.
+	invalidate_scoremaps(w, pagex*MAP_PAGE_W, pagey*MAP_PAGE_W, (pagex+1)*MAP_PAGE_W-1, (pagey+1)*MAP_PAGE_W-1);
+	map_units_changed(w, pagex*MAP_PAGE_W, pagey*MAP_PAGE_W, (pagex+1)*MAP_PAGE_W-1, (pagey+1)*MAP_PAGE_W-1);
+
 	if(ret == 2)
 	{
 //		printf("Info: map page file didn't exist, initializing empty map page\n");
@@ -131,6 +250,18 @@ int unload_map_page(world_t* w, int pagex, int pagey)
 
 		free(w->rpages[pagex][pagey]);
 		w->rpages[pagex][pagey] = 0;
+
+		free(w->spages[pagex][pagey]);
+		w->spages[pagex][pagey] = 0;
+
+		free(w->fpages[pagex][pagey]);
+		w->fpages[pagex][pagey] = 0;
+
+		free(w->stpages[pagex][pagey]);
+		w->stpages[pagex][pagey] = 0;
+
+		free(w->qpages[pagex][pagey]);
+		w->qpages[pagex][pagey] = 0;
 	}
 	else
 	{
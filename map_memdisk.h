@@ -29,6 +29,19 @@
 int write_map_page(world_t* w, int pagex, int pagey);
 int read_map_page(world_t* w, int pagex, int pagey);
 
+// Reads the stored page into dst without touching the world's pages. Returns 2 if the page doesn't exist.
+int read_map_page_to(world_t* w, int pagex, int pagey, map_page_t* dst);
+
+/*
+	Map files hold the page as map_unit_t units[MAP_PAGE_W][MAP_PAGE_W], whatever page layout is compiled in
+	(MAP_PAGE_SOA). These convert between that and the in-memory layout; file is MAP_PAGE_W*MAP_PAGE_W units.
+*/
+void map_page_to_file_layout(const map_page_t* page, map_unit_t* file);
+void map_page_from_file_layout(map_page_t* page, const map_unit_t* file);
+
+// Sets present[x][y] for every page of world w stored on disk. Returns the number of pages, or -1 on error.
+int find_map_pages(world_t* w, uint8_t present[MAP_W][MAP_W]);
+
 // Allocates memory for a page and reads page from disk; if it doesn't exist, the new page is zeroed out
 int load_map_page(world_t* w, int pagex, int pagey);
 
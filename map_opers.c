@@ -1,3 +1,61 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Generic operations on 2D grids of map data.
+
+*/
+
 #include <stdint.h>
 
+#include "map_opers.h"
+
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+/*
+	van Herk / Gil-Werman running max: out[i] = max(in[i .. i+2r]) for 0 <= i < n_in-2r.
+	The input is split into blocks of 2r+1; g is the max from the block start, h the max to the block end,
+	so every window is covered by one h and one g value. Three comparisons per element, regardless of r.
+*/
+static void max_filter_1d(const uint8_t* in, int in_stride, int n_in, int r, uint8_t* out, int out_stride)
+{
+	int wsz = 2*r+1;
+	uint8_t g[n_in], h[n_in];
+
+	for(int i = 0; i < n_in; i++)
+		g[i] = (i % wsz == 0) ? in[i*in_stride] : MAX(g[i-1], in[i*in_stride]);
+
+	for(int i = n_in-1; i >= 0; i--)
+		h[i] = (i == n_in-1 || (i+1) % wsz == 0) ? in[i*in_stride] : MAX(h[i+1], in[i*in_stride]);
+
+	for(int i = 0; i < n_in-2*r; i++)
+		out[i*out_stride] = MAX(h[i], g[i+2*r]);
+}
+
+void max_filter_2d(const uint8_t* in, int in_w, int in_h, int r, uint8_t* tmp, uint8_t* out)
+{
+	int out_w = in_w-2*r;
+
+	// Rows: in_w*in_h -> out_w*in_h
+	for(int y = 0; y < in_h; y++)
+		max_filter_1d(&in[y*in_w], 1, in_w, r, &tmp[y*out_w], 1);
 
+	// Columns: out_w*in_h -> out_w*out_h
+	for(int x = 0; x < out_w; x++)
+		max_filter_1d(&tmp[x], out_w, in_h, r, &out[x], out_w);
+}
@@ -3,4 +3,11 @@
 
 #include <stdint.h>
 
+/*
+	Square (2r+1)*(2r+1) max filter (grayscale dilation) in two separable passes; the cost does not depend on r.
+	in is in_w*in_h, row-major. out gets the (in_w-2r)*(in_h-2r) cells whose full window fits in the input:
+	out[y*(in_w-2r)+x] = max of in[x..x+2r][y..y+2r]. tmp must hold (in_w-2r)*in_h bytes.
+*/
+void max_filter_2d(const uint8_t* in, int in_w, int in_h, int r, uint8_t* tmp, uint8_t* out);
+
 #endif
@@ -0,0 +1,446 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Global relocalization index.
+
+	Every stored map page is reduced to wall / mapped bitmaps. On a regular grid of places within the page,
+	a virtual lidar scan is cast against the wall bitmap: the range to the first wall in RELOC_DIRS
+	directions. The histogram of those ranges doesn't depend on the robot angle, and is used to preselect
+	places; the best rotation for each preselected place is then found by shifting the range profile.
+
+	A lidar batch goes through the same reduction, around its midpoint. The resulting candidates are
+	only guesses: map_lidars() verifies them with the normal scoremap matching.
+
+	The index follows the pages as they are written to disk (reloc_page_written()); place descriptors of
+	changed pages, and their neighbors, are recalculated lazily on the next query.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "datatypes.h"
+#include "mapping.h"
+#include "map_memdisk.h"
+#include "map_reloc.h"
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238
+#endif
+
+#define RELOC_DIRS 180          // Virtual scan directions (2 degrees)
+#define RELOC_MAX_RANGE 150     // Virtual scan range, in map units (6 m)
+#define RELOC_NO_HIT 255
+#define RELOC_BIN_W 10          // Range histogram bin width, in map units
+#define RELOC_N_BINS (RELOC_MAX_RANGE/RELOC_BIN_W + 1) // Last bin: no wall within range
+#define RELOC_MIN_HITS (RELOC_DIRS/4) // Places / batches seeing less walls than this are too featureless to use
+#define RELOC_RANGE_CLAMP 25    // Maximum penalty per direction when comparing range profiles (1 m)
+#define RELOC_N_PRESELECT 200   // Places going from the histogram comparison to the profile comparison
+
+#define RELOC_PLACE_SPACING 16  // in map units
+#define RELOC_PLACES_PER_PAGE ((MAP_PAGE_W/RELOC_PLACE_SPACING)*(MAP_PAGE_W/RELOC_PLACE_SPACING))
+
+extern double subsec_timestamp();
+
+#define RELOC_WALL   1
+#define RELOC_MAPPED 2
+
+typedef struct
+{
+	int32_t x;  // in mm
+	int32_t y;
+	uint8_t hist[RELOC_N_BINS];
+	uint8_t ranges[RELOC_DIRS];
+} reloc_place_t;
+
+typedef struct
+{
+	uint8_t wall[MAP_PAGE_W*MAP_PAGE_W/8];   // Bit index: ox*MAP_PAGE_W + oy, like units[ox][oy]
+	uint8_t mapped[MAP_PAGE_W*MAP_PAGE_W/8];
+	int places_dirty;
+	int n_places;
+	reloc_place_t places[RELOC_PLACES_PER_PAGE];
+} reloc_page_t;
+
+static reloc_page_t* reloc_pages[MAP_W][MAP_W];
+static int reloc_built;
+static pthread_mutex_t reloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static float ray_cos[RELOC_DIRS], ray_sin[RELOC_DIRS];
+
+#define BIT_SET(arr, i) ((arr)[(i)>>3] |= 1<<((i)&7))
+#define BIT_GET(arr, i) ((arr)[(i)>>3] & (1<<((i)&7)))
+
+static int unit_bits(int ux, int uy)
+{
+	if(ux < 0 || uy < 0 || ux >= MAP_W*MAP_PAGE_W || uy >= MAP_W*MAP_PAGE_W)
+		return 0;
+
+	reloc_page_t* rp = reloc_pages[ux/MAP_PAGE_W][uy/MAP_PAGE_W];
+	if(!rp)
+		return 0;
+
+	int i = (ux%MAP_PAGE_W)*MAP_PAGE_W + uy%MAP_PAGE_W;
+	return (BIT_GET(rp->wall, i) ? RELOC_WALL : 0) | (BIT_GET(rp->mapped, i) ? RELOC_MAPPED : 0);
+}
+
+static void set_page_bits(int pagex, int pagey, const map_page_t* page)
+{
+	reloc_page_t* rp = reloc_pages[pagex][pagey];
+	if(!rp)
+	{
+		rp = calloc(1, sizeof(reloc_page_t));
+		if(!rp)
+		{
+			printf("ERROR: Out of memory in relocalization index\n");
+			return;
+		}
+		reloc_pages[pagex][pagey] = rp;
+	}
+
+	memset(rp->wall, 0, sizeof(rp->wall));
+	memset(rp->mapped, 0, sizeof(rp->mapped));
+	for(int ox = 0; ox < MAP_PAGE_W; ox++)
+	{
+		for(int oy = 0; oy < MAP_PAGE_W; oy++)
+		{
+			int i = ox*MAP_PAGE_W + oy;
+			if(MU(MAP_UNIT(page, ox, oy), result) & UNIT_WALL)   BIT_SET(rp->wall, i);
+			if(MU(MAP_UNIT(page, ox, oy), result) & UNIT_MAPPED) BIT_SET(rp->mapped, i);
+		}
+	}
+
+	// Virtual scans reach RELOC_MAX_RANGE < MAP_PAGE_W, so only the neighbors are affected.
+	for(int x = pagex-1; x <= pagex+1; x++)
+	{
+		for(int y = pagey-1; y <= pagey+1; y++)
+		{
+			if(x >= 0 && x < MAP_W && y >= 0 && y < MAP_W && reloc_pages[x][y])
+				reloc_pages[x][y]->places_dirty = 1;
+		}
+	}
+}
+
+static void init_rays()
+{
+	for(int d = 0; d < RELOC_DIRS; d++)
+	{
+		// Direction d covers angles [d, d+1)*360/RELOC_DIRS degrees; cast along the middle.
+		float ang = ((float)d+0.5)*2.0*M_PI/(float)RELOC_DIRS;
+		ray_cos[d] = cos(ang);
+		ray_sin[d] = sin(ang);
+	}
+}
+
+static int virtual_scan(int ux, int uy, uint8_t* ranges)
+{
+	int hits = 0;
+	for(int d = 0; d < RELOC_DIRS; d++)
+	{
+		ranges[d] = RELOC_NO_HIT;
+		for(int r = 1; r <= RELOC_MAX_RANGE; r++)
+		{
+			int x = ux + (int)floorf((float)r*ray_cos[d] + 0.5);
+			int y = uy + (int)floorf((float)r*ray_sin[d] + 0.5);
+			if(unit_bits(x, y) & RELOC_WALL)
+			{
+				ranges[d] = r;
+				hits++;
+				break;
+			}
+		}
+	}
+	return hits;
+}
+
+// Reduces the lidar batch to the same form as virtual_scan(): nearest point in each direction, seen from the midpoint.
+static int batch_scan(int n_lidars, lidar_scan_t** lidar_list, int32_t mid_x, int32_t mid_y, uint8_t* ranges)
+{
+	memset(ranges, RELOC_NO_HIT, RELOC_DIRS);
+
+	for(int l = 0; l < n_lidars; l++)
+	{
+		lidar_scan_t* lid = lidar_list[l];
+		for(int p = 0; p < lid->n_points; p++)
+		{
+			if(!lid->scan[p].valid)
+				continue;
+
+			float dx = lid->scan[p].x - mid_x;
+			float dy = lid->scan[p].y - mid_y;
+			int r = (int)(sqrtf(dx*dx + dy*dy)/(float)MAP_UNIT_W + 0.5);
+			if(r < 1 || r > RELOC_MAX_RANGE)
+				continue;
+
+			float ang = atan2f(dy, dx);
+			if(ang < 0.0) ang += 2.0*M_PI;
+			int d = ang*(float)RELOC_DIRS/(2.0*M_PI);
+			if(d >= RELOC_DIRS) d = 0;
+
+			if(r < ranges[d])
+				ranges[d] = r;
+		}
+	}
+
+	int hits = 0;
+	for(int d = 0; d < RELOC_DIRS; d++)
+		if(ranges[d] != RELOC_NO_HIT) hits++;
+	return hits;
+}
+
+static void range_hist(const uint8_t* ranges, uint8_t* hist)
+{
+	memset(hist, 0, RELOC_N_BINS);
+	for(int d = 0; d < RELOC_DIRS; d++)
+		hist[(ranges[d] == RELOC_NO_HIT) ? (RELOC_N_BINS-1) : ((ranges[d]-1)/RELOC_BIN_W)]++;
+}
+
+static void update_page_places(int pagex, int pagey)
+{
+	reloc_page_t* rp = reloc_pages[pagex][pagey];
+	rp->n_places = 0;
+
+	for(int gx = RELOC_PLACE_SPACING/2; gx < MAP_PAGE_W; gx += RELOC_PLACE_SPACING)
+	{
+		for(int gy = RELOC_PLACE_SPACING/2; gy < MAP_PAGE_W; gy += RELOC_PLACE_SPACING)
+		{
+			int ux = pagex*MAP_PAGE_W + gx;
+			int uy = pagey*MAP_PAGE_W + gy;
+
+			// The robot could stand here
+			if(unit_bits(ux, uy) != RELOC_MAPPED)
+				continue;
+
+			reloc_place_t* pl = &rp->places[rp->n_places];
+			if(virtual_scan(ux, uy, pl->ranges) < RELOC_MIN_HITS)
+				continue;
+
+			range_hist(pl->ranges, pl->hist);
+			mm_from_unit_coords(ux, uy, &pl->x, &pl->y);
+			pl->x += MAP_UNIT_W/2;
+			pl->y += MAP_UNIT_W/2;
+			rp->n_places++;
+		}
+	}
+
+	rp->places_dirty = 0;
+}
+
+static void build_index(world_t* w)
+{
+	double start = subsec_timestamp();
+
+	uint8_t (*present)[MAP_W] = malloc(MAP_W*MAP_W);
+	map_page_t* tmp_page = malloc(sizeof(map_page_t));
+	if(!present || !tmp_page)
+	{
+		printf("ERROR: Out of memory building relocalization index\n");
+		free(present);
+		free(tmp_page);
+		return;
+	}
+
+	int n_stored = find_map_pages(w, present);
+	if(n_stored < 0)
+		memset(present, 0, MAP_W*MAP_W);
+
+	int n_pages = 0;
+	for(int x = 0; x < MAP_W; x++)
+	{
+		for(int y = 0; y < MAP_W; y++)
+		{
+			// Pages in memory are at least as new as the stored ones.
+			if(w->pages[x][y])
+			{
+				set_page_bits(x, y, w->pages[x][y]);
+				n_pages++;
+			}
+			else if(present[x][y] && read_map_page_to(w, x, y, tmp_page) == 0)
+			{
+				set_page_bits(x, y, tmp_page);
+				n_pages++;
+			}
+		}
+	}
+
+	free(present);
+	free(tmp_page);
+
+	reloc_built = 1;
+	printf("Info: relocalization index: read %d map pages in %.0f ms\n", n_pages, (subsec_timestamp()-start)*1000.0);
+}
+
+void reloc_page_written(world_t* w, int pagex, int pagey)
+{
+	pthread_mutex_lock(&reloc_mutex);
+	// Before the first query, there is no index to update; it will be built from the stored pages.
+	if(reloc_built && w->pages[pagex][pagey])
+		set_page_bits(pagex, pagey, w->pages[pagex][pagey]);
+	pthread_mutex_unlock(&reloc_mutex);
+}
+
+// Sum of per-direction range differences, batch direction d compared to place direction d+shift.
+static int profile_dist(const uint8_t* batch, const uint8_t* place, int shift)
+{
+	int dist = 0;
+	for(int d = 0; d < RELOC_DIRS; d++)
+	{
+		if(batch[d] == RELOC_NO_HIT)
+			continue;
+
+		int pd = d + shift;
+		if(pd >= RELOC_DIRS) pd -= RELOC_DIRS;
+
+		int e = (place[pd] == RELOC_NO_HIT) ? RELOC_RANGE_CLAMP : abs((int)batch[d] - (int)place[pd]);
+		dist += (e > RELOC_RANGE_CLAMP) ? RELOC_RANGE_CLAMP : e;
+	}
+	return dist;
+}
+
+typedef struct
+{
+	reloc_place_t* place;
+	int dist;
+	int shift;
+} reloc_match_t;
+
+// Insertion into a sorted, fixed-size array of best matches. Returns the new count.
+static int insert_match(reloc_match_t* arr, int n, int max_n, reloc_match_t m)
+{
+	if(n == max_n && m.dist >= arr[n-1].dist)
+		return n;
+
+	int i = (n < max_n) ? n++ : n-1;
+	while(i > 0 && arr[i-1].dist > m.dist)
+	{
+		arr[i] = arr[i-1];
+		i--;
+	}
+	arr[i] = m;
+	return n;
+}
+
+int reloc_find_candidates(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int32_t mid_x, int32_t mid_y,
+	reloc_candidate_t* cands, int max_cands)
+{
+	uint8_t batch_ranges[RELOC_DIRS];
+	uint8_t batch_hist[RELOC_N_BINS];
+
+	if(batch_scan(n_lidars, lidar_list, mid_x, mid_y, batch_ranges) < RELOC_MIN_HITS)
+	{
+		printf("Relocalization: too few lidar points around the batch midpoint\n");
+		return 0;
+	}
+	range_hist(batch_ranges, batch_hist);
+
+	pthread_mutex_lock(&reloc_mutex);
+
+	double start = subsec_timestamp();
+
+	if(!ray_cos[0])
+		init_rays();
+
+	if(!reloc_built)
+		build_index(w);
+
+	int n_updated = 0, n_places = 0;
+	static reloc_match_t presel[RELOC_N_PRESELECT];
+	int n_presel = 0;
+
+	for(int x = 0; x < MAP_W; x++)
+	{
+		for(int y = 0; y < MAP_W; y++)
+		{
+			reloc_page_t* rp = reloc_pages[x][y];
+			if(!rp)
+				continue;
+
+			if(rp->places_dirty)
+			{
+				update_page_places(x, y);
+				n_updated++;
+			}
+
+			for(int i = 0; i < rp->n_places; i++)
+			{
+				int dist = 0;
+				for(int b = 0; b < RELOC_N_BINS; b++)
+					dist += abs((int)batch_hist[b] - (int)rp->places[i].hist[b]);
+
+				reloc_match_t m = {&rp->places[i], dist, 0};
+				n_presel = insert_match(presel, n_presel, RELOC_N_PRESELECT, m);
+			}
+			n_places += rp->n_places;
+		}
+	}
+
+	// Best rotation for each preselected place, then rank by the profile distance.
+	reloc_match_t best[RELOC_N_PRESELECT];
+	int n_best = 0;
+	for(int i = 0; i < n_presel; i++)
+	{
+		reloc_match_t m = {presel[i].place, 999999, 0};
+		for(int s = 0; s < RELOC_DIRS; s++)
+		{
+			int dist = profile_dist(batch_ranges, m.place->ranges, s);
+			if(dist < m.dist)
+			{
+				m.dist = dist;
+				m.shift = s;
+			}
+		}
+		n_best = insert_match(best, n_best, RELOC_N_PRESELECT, m);
+	}
+
+	// Neighboring places match similarly; only keep the best one of each neighborhood.
+	int n_cands = 0;
+	for(int i = 0; i < n_best && n_cands < max_cands; i++)
+	{
+		int dup = 0;
+		for(int o = 0; o < n_cands; o++)
+		{
+			if(abs(mid_x + cands[o].dx - best[i].place->x) < 2*RELOC_PLACE_SPACING*MAP_UNIT_W &&
+			   abs(mid_y + cands[o].dy - best[i].place->y) < 2*RELOC_PLACE_SPACING*MAP_UNIT_W)
+				dup = 1;
+		}
+		if(dup)
+			continue;
+
+		// The batch points need to turn by +shift directions. Rotation by da turns them by -da (see map_lidars).
+		int shift = best[i].shift;
+		if(shift > RELOC_DIRS/2) shift -= RELOC_DIRS;
+
+		cands[n_cands].da = (int32_t)(uint32_t)((int64_t)-shift*(360/RELOC_DIRS)*(int64_t)ANG_1_DEG);
+		cands[n_cands].dx = best[i].place->x - mid_x;
+		cands[n_cands].dy = best[i].place->y - mid_y;
+		cands[n_cands].dist = best[i].dist;
+		n_cands++;
+	}
+
+	printf("Relocalization: %d places (%d pages updated), %d candidates in %.0f ms\n",
+		n_places, n_updated, n_cands, (subsec_timestamp()-start)*1000.0);
+
+	pthread_mutex_unlock(&reloc_mutex);
+
+	return n_cands;
+}
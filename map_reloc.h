@@ -0,0 +1,57 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#ifndef MAP_RELOC_H
+#define MAP_RELOC_H
+
+#include <stdint.h>
+#include "datatypes.h"
+#include "mapping.h"
+
+#define RELOC_MAX_CANDIDATES 5
+
+// map_lidars() verifies the candidates with at least this much of the best candidate's quick map hits.
+#define RELOC_QMAP_KEEP_PERCENT 75
+
+/*
+	A candidate pose for a lidar batch, as a correction in the same form map_lidars() uses:
+	rotate the points by da around the batch midpoint, then shift by dx, dy.
+*/
+typedef struct
+{
+	int32_t da;
+	int32_t dx;
+	int32_t dy;
+	int32_t dist; // Descriptor distance, smaller is better.
+} reloc_candidate_t;
+
+// Called when a map page has been written to disk; keeps the relocalization index up to date.
+void reloc_page_written(world_t* w, int pagex, int pagey);
+
+/*
+	Searches the whole stored map for places that look like the lidar batch, regardless of the current pose
+	estimate. Builds the index from the map pages on disk on the first call.
+	Returns the number of candidates written to cands (best first), at most max_cands.
+*/
+int reloc_find_candidates(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int32_t mid_x, int32_t mid_y,
+	reloc_candidate_t* cands, int max_cands);
+
+#endif
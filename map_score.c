@@ -0,0 +1,161 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Scan matching score accumulation kernels (scalar, AVX2, NEON), selected at runtime.
+
+	All implementations do the same integer additions, so the results are bit-exact
+	with each other regardless of the order.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCORE_HAVE_AVX2
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCORE_HAVE_NEON
+#endif
+
+#include "map_score.h"
+
+void score_accum_scalar(const int8_t* scoremap, const int32_t* xcol, int num_dx, const int32_t* yrow, int num_dy,
+	int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS])
+{
+	for(int ix = 0; ix < num_dx; ix++)
+	{
+		const int8_t* col = &scoremap[xcol[ix]];
+		for(int iy = 0; iy < num_dy; iy++)
+		{
+			score[ix][iy] += col[yrow[iy]];
+		}
+	}
+}
+
+#ifdef SCORE_HAVE_AVX2
+__attribute__((target("avx2")))
+static void score_accum_avx2(const int8_t* scoremap, const int32_t* xcol, int num_dx, const int32_t* yrow, int num_dy,
+	int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS])
+{
+	int n_vec = (num_dy+7)/8;
+	__m256i rows[SCORE_MAX_STEPS/8];
+	for(int v = 0; v < n_vec; v++)
+		rows[v] = _mm256_loadu_si256((const __m256i*)&yrow[v*8]);
+
+	for(int ix = 0; ix < num_dx; ix++)
+	{
+		__m256i col = _mm256_set1_epi32(xcol[ix]);
+		for(int v = 0; v < n_vec; v++)
+		{
+			// Gather 4 bytes from each address, keep the lowest one, sign-extended.
+			__m256i vals = _mm256_i32gather_epi32((const int*)scoremap, _mm256_add_epi32(rows[v], col), 1);
+			vals = _mm256_srai_epi32(_mm256_slli_epi32(vals, 24), 24);
+			__m256i acc = _mm256_loadu_si256((__m256i*)&score[ix][v*8]);
+			_mm256_storeu_si256((__m256i*)&score[ix][v*8], _mm256_add_epi32(acc, vals));
+		}
+	}
+}
+#endif
+
+#ifdef SCORE_HAVE_NEON
+static void score_accum_neon(const int8_t* scoremap, const int32_t* xcol, int num_dx, const int32_t* yrow, int num_dy,
+	int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS])
+{
+	int n_vec = (num_dy+7)/8;
+
+	for(int ix = 0; ix < num_dx; ix++)
+	{
+		const int8_t* col = &scoremap[xcol[ix]];
+		for(int v = 0; v < n_vec; v++)
+		{
+			// No gather instruction on NEON: lane loads, then widening accumulate.
+			const int32_t* r = &yrow[v*8];
+			int8x8_t vals = vdup_n_s8(0);
+			vals = vld1_lane_s8(&col[r[0]], vals, 0);
+			vals = vld1_lane_s8(&col[r[1]], vals, 1);
+			vals = vld1_lane_s8(&col[r[2]], vals, 2);
+			vals = vld1_lane_s8(&col[r[3]], vals, 3);
+			vals = vld1_lane_s8(&col[r[4]], vals, 4);
+			vals = vld1_lane_s8(&col[r[5]], vals, 5);
+			vals = vld1_lane_s8(&col[r[6]], vals, 6);
+			vals = vld1_lane_s8(&col[r[7]], vals, 7);
+			int16x8_t wide = vmovl_s8(vals);
+
+			int32_t* acc = &score[ix][v*8];
+			vst1q_s32(acc,   vaddw_s16(vld1q_s32(acc),   vget_low_s16(wide)));
+			vst1q_s32(acc+4, vaddw_s16(vld1q_s32(acc+4), vget_high_s16(wide)));
+		}
+	}
+}
+#endif
+
+int get_score_accum_funcs(score_accum_func_t* funcs, const char** names, int max_funcs)
+{
+	int n = 0;
+	if(n < max_funcs) { funcs[n] = score_accum_scalar; names[n] = "scalar"; n++; }
+
+#ifdef SCORE_HAVE_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2") && n < max_funcs) { funcs[n] = score_accum_avx2; names[n] = "AVX2"; n++; }
+#endif
+
+#ifdef SCORE_HAVE_NEON
+	if(n < max_funcs) { funcs[n] = score_accum_neon; names[n] = "NEON"; n++; }
+#endif
+
+	return n;
+}
+
+static score_accum_func_t func = 0;
+
+void set_score_accum_func(score_accum_func_t f)
+{
+	func = f;
+}
+
+score_accum_func_t get_score_accum_func()
+{
+	if(func)
+		return func;
+
+	const char* name = "scalar";
+	score_accum_func_t f = score_accum_scalar;
+
+#ifdef SCORE_HAVE_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		f = score_accum_avx2;
+		name = "AVX2";
+	}
+#endif
+
+#ifdef SCORE_HAVE_NEON
+	f = score_accum_neon;
+	name = "NEON";
+#endif
+
+	printf("Info: scan matching uses %s score kernel\n", name);
+	func = f;
+	return func;
+}
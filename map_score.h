@@ -0,0 +1,61 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as 
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#ifndef MAP_SCORE_H
+#define MAP_SCORE_H
+
+#include <stdint.h>
+
+/*
+	Scan matching inner kernel: for one lidar point, adds scoremap[yrow[iy] + xcol[ix]] to score[ix][iy]
+	for all 0 <= ix < num_dx, 0 <= iy < num_dy.
+
+	xcol holds the scoremap column index of each candidate x offset, yrow the row start offset
+	(row index * scoremap width) of each candidate y offset.
+
+	Vector implementations process y offsets 8 at a time, so yrow must be filled with valid
+	offsets up to SCORE_MAX_STEPS entries; the extra score columns are garbage and must be ignored.
+	Gathers read 4 bytes at a time, so the scoremap buffer needs SCOREMAP_PAD extra bytes at the end.
+*/
+
+#define SCORE_MAX_STEPS 32
+#define SCOREMAP_PAD 4
+
+typedef void (*score_accum_func_t)(const int8_t* scoremap, const int32_t* xcol, int num_dx, const int32_t* yrow, int num_dy,
+	int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS]);
+
+void score_accum_scalar(const int8_t* scoremap, const int32_t* xcol, int num_dx, const int32_t* yrow, int num_dy,
+	int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS]);
+
+/*
+	Returns the fastest implementation supported by the running CPU; the choice is made on the first call.
+	x86 CPUs without AVX2 have no gather instruction, and use score_accum_scalar.
+*/
+score_accum_func_t get_score_accum_func();
+
+// Replaces the choice of get_score_accum_func(); for tests/test_score.c, to run the scan matching with each kernel.
+void set_score_accum_func(score_accum_func_t f);
+
+// All implementations compiled in and supported by the running CPU, scalar first; for tests/test_score.c.
+// Returns the number of entries written.
+int get_score_accum_funcs(score_accum_func_t* funcs, const char** names, int max_funcs);
+
+#endif
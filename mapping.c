@@ -32,6 +32,7 @@
 #include <math.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323
@@ -42,6 +43,13 @@
 #include "mapping.h"
 #include "hwdata.h"
 #include "routing.h"
+#include "map_score.h"
+#include "map_counters.h"
+#include "map_opers.h"
+#include "map_reloc.h"
+#include "pose_graph.h"
+#include "frontier.h"
+#include "arena.h"
 
 #include "tcp_comm.h"   // to send dbgpoint.
 #include "tcp_parser.h" // to send dbgpoint.
@@ -79,6 +87,11 @@ static const int search_order[25][2] = {
 
 world_t world;
 
+static inline int32_t floor_div(int32_t a, int32_t b)
+{
+	return (a >= 0) ? (a/b) : -((-a + b - 1)/b);
+}
+
 void page_coords(int mm_x, int mm_y, int* pageidx_x, int* pageidx_y, int* pageoffs_x, int* pageoffs_y)
 {
 	int unit_x = mm_x / MAP_UNIT_W;
@@ -130,6 +143,338 @@ void page_coords_from_unit_coords(int unit_x, int unit_y, int* pageidx_x, int* p
 	*pageoffs_y = offs_y;
 }
 
+map_page_t map_view_empty_page;
+
+int map_view_init(world_t* w, map_view_t* v, int unit_x0, int unit_y0, int wid, int hei, int halo)
+{
+	int ux0 = unit_x0 - halo, uy0 = unit_y0 - halo;
+	int xs = wid + 2*halo, ys = hei + 2*halo;
+	int py0 = floor_div(uy0, MAP_PAGE_W);
+	int n_rows = floor_div(uy0+ys-1, MAP_PAGE_W) - py0 + 1;
+
+	if(xs > MAP_VIEW_MAX_W || n_rows > MAP_VIEW_MAX_PAGE_ROWS)
+	{
+		printf("ERROR: map_view_init: window %d x %d (halo %d) too large\n", wid, hei, halo);
+		return -1;
+	}
+
+	v->unit_x0 = unit_x0; v->unit_y0 = unit_y0;
+	v->w = wid; v->h = hei; v->halo = halo;
+	v->y_offs = unit_y0 - py0*MAP_PAGE_W;
+	v->n_missing = 0;
+
+	for(int x = 0; x < xs; x++)
+	{
+		int ux = ux0 + x;
+		int px = floor_div(ux, MAP_PAGE_W);
+		for(int r = 0; r < n_rows; r++)
+		{
+			int py = py0 + r;
+			if(px < 0 || px >= MAP_W || py < 0 || py >= MAP_W || !w->pages[px][py])
+			{
+				v->cols[x][r] = MAP_UNIT(&map_view_empty_page, 0, 0);
+				v->n_missing++;
+			}
+			else
+				v->cols[x][r] = MAP_UNIT(w->pages[px][py], ux - px*MAP_PAGE_W, 0);
+		}
+	}
+	return 0;
+}
+
+void invalidate_scoremaps(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1)
+{
+	unit_x0 -= SCORE_MAX_RADIUS; unit_y0 -= SCORE_MAX_RADIUS;
+	unit_x1 += SCORE_MAX_RADIUS; unit_y1 += SCORE_MAX_RADIUS;
+	if(unit_x0 < 0) unit_x0 = 0;
+	if(unit_y0 < 0) unit_y0 = 0;
+	if(unit_x1 > MAP_W*MAP_PAGE_W-1) unit_x1 = MAP_W*MAP_PAGE_W-1;
+	if(unit_y1 > MAP_W*MAP_PAGE_W-1) unit_y1 = MAP_W*MAP_PAGE_W-1;
+
+	for(int tx = unit_x0/SCORE_TILE_W; tx <= unit_x1/SCORE_TILE_W; tx++)
+	{
+		for(int ty = unit_y0/SCORE_TILE_W; ty <= unit_y1/SCORE_TILE_W; ty++)
+		{
+			score_page_t* sp = w->spages[tx/SCORE_TILES][ty/SCORE_TILES];
+			if(sp)
+				sp->dirty[tx%SCORE_TILES][ty%SCORE_TILES] = (1<<SCORE_N_KINDS)-1;
+		}
+	}
+}
+
+void invalidate_map_stats(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1)
+{
+	if(unit_x0 < 0) unit_x0 = 0;
+	if(unit_y0 < 0) unit_y0 = 0;
+	if(unit_x1 > MAP_W*MAP_PAGE_W-1) unit_x1 = MAP_W*MAP_PAGE_W-1;
+	if(unit_y1 > MAP_W*MAP_PAGE_W-1) unit_y1 = MAP_W*MAP_PAGE_W-1;
+
+	for(int px = unit_x0/MAP_PAGE_W; px <= unit_x1/MAP_PAGE_W; px++)
+	{
+		for(int py = unit_y0/MAP_PAGE_W; py <= unit_y1/MAP_PAGE_W; py++)
+		{
+			if(w->stpages[px][py])
+				w->stpages[px][py]->dirty = 1;
+		}
+	}
+}
+
+static void add_unit_stats(map_page_t* p, int x, int y, map_stats_t* st)
+{
+	st->visited += MU(MAP_UNIT(p, x, y), num_visited);
+	st->seen += MU(MAP_UNIT(p, x, y), num_seen);
+	st->walls += (MU(MAP_UNIT(p, x, y), result) & UNIT_WALL)?1:0;
+	st->items += (MU(MAP_UNIT(p, x, y), result) & UNIT_ITEM)?1:0;
+}
+
+static void update_stats_page(world_t* w, int px, int py)
+{
+	map_page_t* p = w->pages[px][py];
+	stats_page_t* sp = w->stpages[px][py];
+
+	// Column sums of cells along y, added to the previous column's table.
+	for(int cx = 0; cx < STATS_CELLS; cx++)
+	{
+		map_stats_t col;
+		memset(&col, 0, sizeof(map_stats_t));
+		for(int cy = 0; cy < STATS_CELLS; cy++)
+		{
+			for(int x = cx*STATS_CELL_W; x < (cx+1)*STATS_CELL_W; x++)
+				for(int y = cy*STATS_CELL_W; y < (cy+1)*STATS_CELL_W; y++)
+					add_unit_stats(p, x, y, &col);
+
+			sp->visited[cx][cy] = col.visited + (cx?sp->visited[cx-1][cy]:0);
+			sp->seen[cx][cy]    = col.seen    + (cx?sp->seen[cx-1][cy]:0);
+			sp->walls[cx][cy]   = col.walls   + (cx?sp->walls[cx-1][cy]:0);
+			sp->items[cx][cy]   = col.items   + (cx?sp->items[cx-1][cy]:0);
+		}
+	}
+	sp->dirty = 0;
+}
+
+// Sum over [x0..x1][y0..y1] of a summed-area table, within one page.
+#define SAT_RECT(t, x0, y0, x1, y1) ( (t)[x1][y1] \
+	- ((x0)?(t)[(x0)-1][y1]:0) - ((y0)?(t)[x1][(y0)-1]:0) + (((x0)&&(y0))?(t)[(x0)-1][(y0)-1]:0) )
+
+void map_stats_rect(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1, map_stats_t* out)
+{
+	memset(out, 0, sizeof(map_stats_t));
+
+	if(unit_x0 < 0) unit_x0 = 0;
+	if(unit_y0 < 0) unit_y0 = 0;
+	if(unit_x1 > MAP_W*MAP_PAGE_W-1) unit_x1 = MAP_W*MAP_PAGE_W-1;
+	if(unit_y1 > MAP_W*MAP_PAGE_W-1) unit_y1 = MAP_W*MAP_PAGE_W-1;
+
+	for(int px = unit_x0/MAP_PAGE_W; px <= unit_x1/MAP_PAGE_W; px++)
+	{
+		for(int py = unit_y0/MAP_PAGE_W; py <= unit_y1/MAP_PAGE_W; py++)
+		{
+			if(!w->pages[px][py])
+				continue;
+
+			if(!w->stpages[px][py])
+			{
+				w->stpages[px][py] = malloc(sizeof(stats_page_t));
+				if(!w->stpages[px][py])
+				{
+					printf("ERROR: Out of memory allocating statistics page\n");
+					continue;
+				}
+				w->stpages[px][py]->dirty = 1;
+			}
+
+			stats_page_t* sp = w->stpages[px][py];
+			if(sp->dirty)
+				update_stats_page(w, px, py);
+
+			int x0 = (unit_x0 > px*MAP_PAGE_W) ? (unit_x0 - px*MAP_PAGE_W) : 0;
+			int y0 = (unit_y0 > py*MAP_PAGE_W) ? (unit_y0 - py*MAP_PAGE_W) : 0;
+			int x1 = (unit_x1 < (px+1)*MAP_PAGE_W-1) ? (unit_x1 - px*MAP_PAGE_W) : MAP_PAGE_W-1;
+			int y1 = (unit_y1 < (py+1)*MAP_PAGE_W-1) ? (unit_y1 - py*MAP_PAGE_W) : MAP_PAGE_W-1;
+
+			// Cells fully inside the rectangle; the units [ux0..ux1][uy0..uy1] they cover come from the tables.
+			int cx0 = (x0+STATS_CELL_W-1)/STATS_CELL_W, cx1 = (x1+1)/STATS_CELL_W-1;
+			int cy0 = (y0+STATS_CELL_W-1)/STATS_CELL_W, cy1 = (y1+1)/STATS_CELL_W-1;
+			int ux0 = 1, ux1 = 0, uy0 = 1, uy1 = 0;
+			if(cx0 <= cx1 && cy0 <= cy1)
+			{
+				out->visited += SAT_RECT(sp->visited, cx0, cy0, cx1, cy1);
+				out->seen    += SAT_RECT(sp->seen, cx0, cy0, cx1, cy1);
+				out->walls   += SAT_RECT(sp->walls, cx0, cy0, cx1, cy1);
+				out->items   += SAT_RECT(sp->items, cx0, cy0, cx1, cy1);
+				ux0 = cx0*STATS_CELL_W; ux1 = (cx1+1)*STATS_CELL_W-1;
+				uy0 = cy0*STATS_CELL_W; uy1 = (cy1+1)*STATS_CELL_W-1;
+			}
+
+			// The rest: at most STATS_CELL_W-1 units wide strips along the edges.
+			map_page_t* p = w->pages[px][py];
+			for(int x = x0; x <= x1; x++)
+			{
+				if(x >= ux0 && x <= ux1)
+				{
+					for(int y = y0; y < uy0; y++)
+						add_unit_stats(p, x, y, out);
+					for(int y = uy1+1; y <= y1; y++)
+						add_unit_stats(p, x, y, out);
+				}
+				else
+				{
+					for(int y = y0; y <= y1; y++)
+						add_unit_stats(p, x, y, out);
+				}
+			}
+		}
+	}
+}
+
+void invalidate_qmaps(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1)
+{
+	if(unit_x0 < 0) unit_x0 = 0;
+	if(unit_y0 < 0) unit_y0 = 0;
+	if(unit_x1 > MAP_W*MAP_PAGE_W-1) unit_x1 = MAP_W*MAP_PAGE_W-1;
+	if(unit_y1 > MAP_W*MAP_PAGE_W-1) unit_y1 = MAP_W*MAP_PAGE_W-1;
+
+	for(int tx = unit_x0/QMAP_TILE_W; tx <= unit_x1/QMAP_TILE_W; tx++)
+	{
+		for(int ty = unit_y0/QMAP_TILE_W; ty <= unit_y1/QMAP_TILE_W; ty++)
+		{
+			qmap_page_t* q = w->qpages[tx/QMAP_TILES][ty/QMAP_TILES];
+			if(q)
+				q->dirty[tx%QMAP_TILES][ty%QMAP_TILES] = 1;
+		}
+	}
+}
+
+void map_units_changed(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1)
+{
+	invalidate_frontiers(w, unit_x0, unit_y0, unit_x1, unit_y1);
+	invalidate_map_stats(w, unit_x0, unit_y0, unit_x1, unit_y1);
+	invalidate_qmaps(w, unit_x0, unit_y0, unit_x1, unit_y1);
+}
+
+// Each level up ORs 2*2 units of the level below. A tile covers QMAP_TILE_W/2 level 0 units per side.
+static void update_qmap_tile(map_page_t* p, qmap_page_t* q, int tx, int ty)
+{
+	int x0 = tx*QMAP_TILE_W/2, y0 = ty*QMAP_TILE_W/2;
+	for(int x = x0; x < x0+QMAP_TILE_W/2; x++)
+	{
+		for(int y = y0; y < y0+QMAP_TILE_W/2; y++)
+		{
+			q->units[x][y] = MU(MAP_UNIT(p, 2*x, 2*y), result) | MU(MAP_UNIT(p, 2*x+1, 2*y), result) |
+			                 MU(MAP_UNIT(p, 2*x, 2*y+1), result) | MU(MAP_UNIT(p, 2*x+1, 2*y+1), result);
+		}
+	}
+
+	x0 /= 2; y0 /= 2;
+	for(int x = x0; x < x0+QMAP_TILE_W/4; x++)
+	{
+		for(int y = y0; y < y0+QMAP_TILE_W/4; y++)
+		{
+			q->units2[x][y] = q->units[2*x][2*y] | q->units[2*x+1][2*y] |
+			                  q->units[2*x][2*y+1] | q->units[2*x+1][2*y+1];
+		}
+	}
+
+	x0 /= 2; y0 /= 2;
+	for(int x = x0; x < x0+QMAP_TILE_W/8; x++)
+	{
+		for(int y = y0; y < y0+QMAP_TILE_W/8; y++)
+		{
+			q->units4[x][y] = q->units2[2*x][2*y] | q->units2[2*x+1][2*y] |
+			                  q->units2[2*x][2*y+1] | q->units2[2*x+1][2*y+1];
+		}
+	}
+
+	q->dirty[tx][ty] = 0;
+}
+
+qmap_page_t* get_qmap_page(world_t* w, int pagex, int pagey)
+{
+	if(!w->pages[pagex][pagey])
+		return NULL;
+
+	if(!w->qpages[pagex][pagey])
+	{
+		w->qpages[pagex][pagey] = malloc(sizeof(qmap_page_t));
+		if(!w->qpages[pagex][pagey])
+		{
+			printf("ERROR: Out of memory allocating quick map page\n");
+			return NULL;
+		}
+		memset(w->qpages[pagex][pagey]->dirty, 1, sizeof(w->qpages[pagex][pagey]->dirty));
+	}
+
+	qmap_page_t* q = w->qpages[pagex][pagey];
+	for(int tx = 0; tx < QMAP_TILES; tx++)
+	{
+		for(int ty = 0; ty < QMAP_TILES; ty++)
+		{
+			if(q->dirty[tx][ty])
+				update_qmap_tile(w->pages[pagex][pagey], q, tx, ty);
+		}
+	}
+	return q;
+}
+
+uint8_t qmap_unit(qmap_page_t* q, int level, int qx, int qy)
+{
+	if(level == 0) return q->units[qx][qy];
+	if(level == 1) return q->units2[qx][qy];
+	return q->units4[qx][qy];
+}
+
+void qmap_render(world_t* w, int level, int unit_x0, int unit_y0, int xs, int ys, uint8_t* out)
+{
+	int shift = level+1; // map units per quick map unit: 1<<shift
+
+	int prev_px = -1, prev_py = -1;
+	qmap_page_t* q = NULL;
+	for(int y = 0; y < ys; y++)
+	{
+		for(int x = 0; x < xs; x++)
+		{
+			int ux = unit_x0 + (x<<shift), uy = unit_y0 + (y<<shift);
+			if(ux < 0 || uy < 0 || ux >= MAP_W*MAP_PAGE_W || uy >= MAP_W*MAP_PAGE_W)
+			{
+				out[y*xs+x] = 0;
+				continue;
+			}
+
+			int px = ux/MAP_PAGE_W, py = uy/MAP_PAGE_W;
+			if(px != prev_px || py != prev_py)
+			{
+				q = get_qmap_page(w, px, py);
+				prev_px = px; prev_py = py;
+			}
+
+			out[y*xs+x] = q ? qmap_unit(q, level, (ux%MAP_PAGE_W)>>shift, (uy%MAP_PAGE_W)>>shift) : 0;
+		}
+	}
+}
+
+// Wrappers for num_obstacles modification, so that the cached scoremaps get invalidated. u is the unit at
+// absolute unit coords (ux, uy).
+static void obstacles_changed(world_t* w, map_unit_ref_t u, int ux, int uy, int old_val)
+{
+	int new_val = MU(u, num_obstacles);
+	if(new_val != old_val && (new_val < SCORE_SATURATION_OBSTACLES || old_val < SCORE_SATURATION_OBSTACLES))
+		invalidate_scoremaps(w, ux, uy, ux, uy);
+}
+
+static void plus_obstacles(world_t* w, map_unit_ref_t u, int ux, int uy)
+{
+	int old_val = MU(u, num_obstacles);
+	PLUS_SAT_255(MU(u, num_obstacles));
+	obstacles_changed(w, u, ux, uy, old_val);
+}
+
+static void minus_obstacles(world_t* w, map_unit_ref_t u, int ux, int uy)
+{
+	int old_val = MU(u, num_obstacles);
+	MINUS_SAT_0(MU(u, num_obstacles));
+	obstacles_changed(w, u, ux, uy, old_val);
+}
+
 
 // Shift page,offset coords directly by shift_x, shift_y units.
 void shift_coords(int* px, int* py, int* ox, int* oy, int shift_x, int shift_y)
@@ -162,6 +507,123 @@ void shift_coords(int* px, int* py, int* ox, int* oy, int shift_x, int shift_y)
 
 #define sq(x) ((x)*(x))
 
+/*
+	Spatial hash over all valid points of a lidar_list, used by the prefilters so that each point
+	is only compared against the points in the neighbouring cells instead of every point of every scan.
+
+	Cells are cell_w*cell_w mm; with cell_w >= the search radius, the 3x3 cells around the point
+	contain every candidate. Buckets are chained; since two cells may share a bucket, the cell coords
+	are stored in each entry and compared on lookup, so no point is ever visited twice.
+
+	The point validity is checked on lookup, not on build, so that points removed by the prefilter
+	during the same pass are ignored exactly like the original all-pairs loop did.
+*/
+
+#define LIDAR_GRID_BUCKETS 4096 // power of two
+
+typedef struct
+{
+	int32_t cx;
+	int32_t cy;
+	int16_t l;	// index in lidar_list
+	int16_t p;	// index in lidar_list[l]->scan
+	int32_t next;	// next entry in the same bucket, -1 terminates
+} lidar_grid_entry_t;
+
+typedef struct
+{
+	int cell_w;
+	int32_t head[LIDAR_GRID_BUCKETS];
+	lidar_grid_entry_t* entries;
+} lidar_grid_t;
+
+static inline int lidar_grid_bucket(int32_t cx, int32_t cy)
+{
+	return ((uint32_t)cx*73856093U ^ (uint32_t)cy*19349663U) & (LIDAR_GRID_BUCKETS-1);
+}
+
+static int build_lidar_grid(lidar_grid_t* g, int cell_w, int n_lidars, lidar_scan_t** lidar_list)
+{
+	g->cell_w = cell_w;
+	for(int i=0; i<LIDAR_GRID_BUCKETS; i++)
+		g->head[i] = -1;
+
+	g->entries = malloc(n_lidars*MAX_LIDAR_POINTS*sizeof(lidar_grid_entry_t));
+	if(!g->entries)
+	{
+		printf("ERROR: Out of memory in build_lidar_grid\n");
+		return -1;
+	}
+
+	int n = 0;
+	for(int l=0; l<n_lidars; l++)
+	{
+		lidar_scan_t* lid = lidar_list[l];
+		for(int p=0; p<lid->n_points; p++)
+		{
+			if(!lid->scan[p].valid)
+				continue;
+
+			int32_t cx = floor_div(lid->scan[p].x, cell_w);
+			int32_t cy = floor_div(lid->scan[p].y, cell_w);
+			int b = lidar_grid_bucket(cx, cy);
+
+			g->entries[n].cx = cx;
+			g->entries[n].cy = cy;
+			g->entries[n].l = l;
+			g->entries[n].p = p;
+			g->entries[n].next = g->head[b];
+			g->head[b] = n;
+			n++;
+		}
+	}
+	return 0;
+}
+
+static void free_lidar_grid(lidar_grid_t* g)
+{
+	free(g->entries);
+	g->entries = NULL;
+}
+
+/*
+	Counts valid points from other scans than skip_l, closer than dist to (x,y).
+	If stop_at > 0, returns as soon as stop_at points are found.
+*/
+static int lidar_grid_count_near(lidar_grid_t* g, int n_lidars, lidar_scan_t** lidar_list, int skip_l, int32_t x, int32_t y, int dist, int stop_at)
+{
+	int cnt = 0;
+	int32_t cx = floor_div(x, g->cell_w);
+	int32_t cy = floor_div(y, g->cell_w);
+
+	for(int32_t ncx = cx-1; ncx <= cx+1; ncx++)
+	{
+		for(int32_t ncy = cy-1; ncy <= cy+1; ncy++)
+		{
+			for(int32_t e = g->head[lidar_grid_bucket(ncx, ncy)]; e >= 0; e = g->entries[e].next)
+			{
+				lidar_grid_entry_t* ent = &g->entries[e];
+				if(ent->cx != ncx || ent->cy != ncy || ent->l == skip_l)
+					continue;
+
+				point_t* pt = &lidar_list[ent->l]->scan[ent->p];
+				if(!pt->valid)
+					continue;
+
+				int64_t dx = pt->x - x;
+				int64_t dy = pt->y - y;
+				if(sq(dx) + sq(dy) < sq((int64_t)dist))
+				{
+					cnt++;
+					if(stop_at > 0 && cnt >= stop_at)
+						return cnt;
+				}
+			}
+		}
+	}
+	return cnt;
+}
+
 /*
 	Go through every point in every lidar scan.
 	Find closest point from every other scan. If far away,
@@ -175,6 +637,10 @@ static int prefilter_lidar_list(int n_lidars, lidar_scan_t** lidar_list)
 	int n_removed_per_scan[32] = {0};
 	int n_removed = 0;
 
+	lidar_grid_t grid;
+	if(build_lidar_grid(&grid, 100, n_lidars, lidar_list))
+		return 0;
+
 	for(int la=0; la<n_lidars; la++)
 	{
 		lidar_scan_t* lida = lidar_list[la];
@@ -185,33 +651,17 @@ static int prefilter_lidar_list(int n_lidars, lidar_scan_t** lidar_list)
 			if(!lida->scan[pa].valid)
 				continue;
 
-			for(int lb=0; lb<n_lidars; lb++)
-			{
-				if(la == lb) continue;
-
-				lidar_scan_t* lidb = lidar_list[lb];
-
-				for(int pb=0; pb<lidb->n_points; pb++)
-				{
-					if(!lidb->scan[pb].valid)
-						continue;
-
-					int64_t dx = lidb->scan[pb].x - lida->scan[pa].x;
-					int64_t dy = lidb->scan[pb].y - lida->scan[pa].y;
-					int64_t dist = sq(dx) + sq(dy);
-
-					if(dist < sq(100)) goto FOUND_NEAR;
-				}
-			}
+			if(lidar_grid_count_near(&grid, n_lidars, lidar_list, la, lida->scan[pa].x, lida->scan[pa].y, 100, 1))
+				continue;
 
 			lida->scan[pa].valid = 0;
 			n_removed_per_scan[la]++;
 			n_removed++;
-
-			FOUND_NEAR:;
 		}
 	}
 
+	free_lidar_grid(&grid);
+
 //	printf("prefilter_lidar_list() removed %d points: ", n_removed);
 //	for(int i=0; i < n_lidars; i++)	printf("%d, ", n_removed_per_scan[i]);
 //	printf("\n");
@@ -224,6 +674,10 @@ static int prefilter_lidar_list_aggressive(int n_lidars, lidar_scan_t** lidar_li
 	int n_removed_per_scan[32] = {0};
 	int n_removed = 0;
 
+	lidar_grid_t grid;
+	if(build_lidar_grid(&grid, 80, n_lidars, lidar_list))
+		return 0;
+
 	for(int la=0; la<n_lidars; la++)
 	{
 		lidar_scan_t* lida = lidar_list[la];
@@ -233,25 +687,7 @@ static int prefilter_lidar_list_aggressive(int n_lidars, lidar_scan_t** lidar_li
 			if(!lida->scan[pa].valid)
 				continue;
 
-			int nears = 0;
-			for(int lb=0; lb<n_lidars; lb++)
-			{
-				if(la == lb) continue;
-
-				lidar_scan_t* lidb = lidar_list[lb];
-
-				for(int pb=0; pb<lidb->n_points; pb++)
-				{
-					if(!lidb->scan[pb].valid)
-						continue;
-
-					int64_t dx = lidb->scan[pb].x - lida->scan[pa].x;
-					int64_t dy = lidb->scan[pb].y - lida->scan[pa].y;
-					int64_t dist = sq(dx) + sq(dy);
-
-					if(dist < sq(80)) nears++;
-				}
-			}
+			int nears = lidar_grid_count_near(&grid, n_lidars, lidar_list, la, lida->scan[pa].x, lida->scan[pa].y, 80, 0);
 
 			if(nears < n_lidars/2)
 			{
@@ -262,125 +698,309 @@ static int prefilter_lidar_list_aggressive(int n_lidars, lidar_scan_t** lidar_li
 		}
 	}
 
+	free_lidar_grid(&grid);
+
 //	printf("prefilter_lidar_list_aggressive() removed %d points: ", n_removed);
 //	for(int i=0; i < n_lidars; i++)	printf("%d, ", n_removed_per_scan[i]);
 //	printf("\n");
 	return n_removed;
 }
 
-
-/* Rotation:
-x2 = x*cos(a) + y*sin(a)
-y2 = -1*x*sin(a) + y*cos(a)
+/*
+	Point set for pass1. Dense wall segments near the robot give many almost identical points, which
+	cost scoring time but add nothing to the match. The batch is downsampled to one point per
+	PASS1_VOXEL_W cell (first come), into copies of the scans in the scratch arena. Pass2 and the mapping
+	still use every point. Returns the number of points kept, or -1 if out of memory, in which case
+	out_list points to the original scans.
+
+	With map_pass1_keypoints, only corners (direction change over PASS1_CORNER_ANG between the
+	neighbours in the scan), segment ends and every PASS1_KEYPOINT_SUBSAMPLE:th other point are kept.
 */
 
-#define TEMP_MAP_W (2*MAP_PAGE_W)
-#define TEMP_MAP_MIDDLE (TEMP_MAP_W/2)
+#define PASS1_VOXEL_W 40
+#define PASS1_CORNER_MAX_GAP 300       // mm; farther neighbours are not on the same segment
+#define PASS1_CORNER_SIN (0.5)         // sin(30 deg)
+#define PASS1_KEYPOINT_SUBSAMPLE 4
 
-// Slower, allows stepping larger steps, pays the used extra time back when searching large areas:
-static int gen_scoremap_for_large_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
-{
-	int px, py, ox, oy;
-	page_coords(mid_x, mid_y, &px, &py, &ox, &oy);
-	load_25pages(w, px, py);
+#ifndef MAP_PASS1_KEYPOINTS
+#define MAP_PASS1_KEYPOINTS 0
+#endif
 
-	printf("Generating scoremap (for large steps)..."); fflush(stdout);
-	for(int xx = 0; xx < TEMP_MAP_W; xx++)
-	{
-		for(int yy = 0; yy < TEMP_MAP_W; yy++)
-		{
-			page_coords(mid_x + (xx-TEMP_MAP_MIDDLE)*MAP_UNIT_W, mid_y + (yy-TEMP_MAP_MIDDLE)*MAP_UNIT_W, &px, &py, &ox, &oy);
-//			load_9pages(w, px, py);
+int map_pass1_keypoints = MAP_PASS1_KEYPOINTS;
 
-			int score = 3*w->pages[px][py]->units[ox][oy].num_obstacles;
+static int is_keypoint(lidar_scan_t* lid, int p)
+{
+	int prev = p-1, next = p+1;
+	while(prev >= 0 && !lid->scan[prev].valid) prev--;
+	while(next < lid->n_points && !lid->scan[next].valid) next++;
+	if(prev < 0 || next >= lid->n_points)
+		return 1;
+
+	int64_t ax = lid->scan[p].x - lid->scan[prev].x, ay = lid->scan[p].y - lid->scan[prev].y;
+	int64_t bx = lid->scan[next].x - lid->scan[p].x, by = lid->scan[next].y - lid->scan[p].y;
+	int64_t a2 = sq(ax)+sq(ay), b2 = sq(bx)+sq(by);
+
+	// Segment end (occlusion edge)
+	if(a2 > sq((int64_t)PASS1_CORNER_MAX_GAP) || b2 > sq((int64_t)PASS1_CORNER_MAX_GAP))
+		return 1;
+
+	// |a x b| > sin(ang) |a| |b|, or turning back
+	double cross = (double)(ax*by - ay*bx);
+	return cross*cross > PASS1_CORNER_SIN*PASS1_CORNER_SIN*(double)a2*(double)b2 || ax*bx + ay*by < 0;
+}
 
-			for(int ix=-5; ix<=5; ix++)
-			{
-				for(int iy=-5; iy<=5; iy++)
-				{
-					int npx = px, npy = py, nox = ox + ix, noy = oy + iy;
-					if(nox < 0) { nox += MAP_PAGE_W; npx--; } else if(nox >= MAP_PAGE_W) { nox -= MAP_PAGE_W; npx++;}
-					if(noy < 0) { noy += MAP_PAGE_W; npy--; } else if(noy >= MAP_PAGE_W) { noy -= MAP_PAGE_W; npy++;}
+static int downsample_lidar_list(int n_lidars, lidar_scan_t** lidar_list, lidar_scan_t** out_list)
+{
+	arena_t* arena = thread_arena();
 
-					int neigh_score;
-					neigh_score = 2*w->pages[npx][npy]->units[nox][noy].num_obstacles;
-					if(neigh_score > score) score = neigh_score;
-				}
-			}
+	int n_in = 0;
+	for(int l=0; l<n_lidars; l++)
+		n_in += lidar_list[l]->n_points;
 
-			if(score > 63) score=63;
+	int table_size = 1024;
+	while(table_size < 2*n_in) table_size <<= 1;
 
-			scoremap[yy*TEMP_MAP_W+xx] = score;
-		}
+	uint64_t* cells = arena_alloc(arena, table_size*sizeof(uint64_t));
+	lidar_scan_t* copies = arena_alloc(arena, n_lidars*sizeof(lidar_scan_t));
+	if(!cells || !copies)
+	{
+		for(int l=0; l<n_lidars; l++)
+			out_list[l] = lidar_list[l];
+		return -1;
 	}
 
-/*
-	// Output 768x768x24bit raw image for debug.
-	FILE* dbg_f = fopen("dbg_scoremap.data", "w");
+	const uint64_t empty = 1ULL<<63; // Voxel x = INT32_MIN: more than 80000 km away
+	for(int i=0; i<table_size; i++)
+		cells[i] = empty;
 
-	for(int iy = 0; iy < TEMP_MAP_W; iy++)
+	int n_out = 0;
+	for(int l=0; l<n_lidars; l++)
 	{
-		for(int ix = 0; ix < TEMP_MAP_W; ix++)
+		lidar_scan_t* lid = lidar_list[l];
+		lidar_scan_t* out = &copies[l];
+		out_list[l] = out;
+
+		out->filtered = lid->filtered;
+		out->significant_for_mapping = lid->significant_for_mapping;
+		out->is_invalid = lid->is_invalid;
+		out->id = lid->id;
+		out->robot_pos = lid->robot_pos;
+		out->n_points = 0;
+
+		int n_other = 0;
+		for(int p=0; p<lid->n_points; p++)
 		{
-			int r = 0, g = 0;
-			if(scoremap[iy*TEMP_MAP_W+ix] > 0)
-				g = scoremap[iy*TEMP_MAP_W+ix]*4;
-			else
-				r = scoremap[iy*TEMP_MAP_W+ix]*-4;
+			if(!lid->scan[p].valid)
+				continue;
 
-			if(r > 255) r = 255; if(g > 255) g = 255;
-			fputc(r, dbg_f); // R
-			fputc(g, dbg_f); // G
-			fputc(0, dbg_f); // B
+			uint64_t key = ((uint64_t)(uint32_t)floor_div(lid->scan[p].x, PASS1_VOXEL_W)<<32) | (uint32_t)floor_div(lid->scan[p].y, PASS1_VOXEL_W);
+			uint32_t h = (key * 0x9E3779B97F4A7C15ULL) >> 32;
+			int i = h & (table_size-1);
+			while(cells[i] != empty && cells[i] != key)
+				i = (i+1) & (table_size-1);
+			if(cells[i] == key)
+				continue;
+			cells[i] = key;
+
+			if(map_pass1_keypoints && !is_keypoint(lid, p) && (n_other++ % PASS1_KEYPOINT_SUBSAMPLE) != 0)
+				continue;
+
+			out->scan[out->n_points++] = lid->scan[p];
 		}
+		n_out += out->n_points;
 	}
 
-	fclose(dbg_f);
+	return n_out;
+}
+
+
+/* Rotation:
+x2 = x*cos(a) + y*sin(a)
+y2 = -1*x*sin(a) + y*cos(a)
 */
-	printf(" OK.\n");
 
+#define TEMP_MAP_W (2*MAP_PAGE_W)
+#define TEMP_MAP_MIDDLE (TEMP_MAP_W/2)
 
-	return 0;
+static const int scoremap_radius[SCORE_N_KINDS] = {1 /*SCORE_SMALL_STEPS*/, SCORE_MAX_RADIUS /*SCORE_LARGE_STEPS*/, SCORE_MAX_RADIUS /*SCORE_LFIELD*/};
+
+#define SCORE_HALO_W (SCORE_TILE_W+2*SCORE_MAX_RADIUS)
+
+#define LFIELD_MIN_OBSTACLES 2  // num_obstacles needed for a unit to be an obstacle in the likelihood field
+
+// Felzenszwalb-Huttenlocher 1D squared distance transform of f (n values, stride apart), in place.
+static void edt_1d(int32_t* f, int n, int stride, int32_t* tmp_f, int* v, float* z)
+{
+	for(int q = 0; q < n; q++)
+		tmp_f[q] = f[q*stride];
+
+	int k = 0;
+	v[0] = 0;
+	z[0] = -1e20;
+	z[1] = 1e20;
+	for(int q = 1; q < n; q++)
+	{
+		float s = ((float)(tmp_f[q] + q*q) - (float)(tmp_f[v[k]] + v[k]*v[k])) / (float)(2*q - 2*v[k]);
+		while(s <= z[k])
+		{
+			k--;
+			s = ((float)(tmp_f[q] + q*q) - (float)(tmp_f[v[k]] + v[k]*v[k])) / (float)(2*q - 2*v[k]);
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = 1e20;
+	}
+
+	k = 0;
+	for(int q = 0; q < n; q++)
+	{
+		while(z[k+1] < q)
+			k++;
+		f[q*stride] = (q-v[k])*(q-v[k]) + tmp_f[v[k]];
+	}
+}
+
+/*
+	Likelihood field tile: squared distance to the nearest obstacle. The distance transform only sees the tile
+	plus SCORE_MAX_RADIUS units around it, which is exact for all distances up to SCORE_MAX_RADIUS; anything
+	further is LFIELD_D2_FAR.
+*/
+static void update_lfield_tile(map_view_t* v, score_page_t* sp, int tx, int ty)
+{
+	int r = SCORE_MAX_RADIUS;
+	int32_t d2[SCORE_HALO_W*SCORE_HALO_W];
+	for(int x = 0; x < SCORE_HALO_W; x++)
+		for(int y = 0; y < SCORE_HALO_W; y++)
+			d2[y*SCORE_HALO_W+x] = (MU(MAP_VIEW_UNIT(v, x-r, y-r), num_obstacles) >= LFIELD_MIN_OBSTACLES) ? 0 : 4*SCORE_HALO_W*SCORE_HALO_W;
+
+	int32_t tmp_f[SCORE_HALO_W];
+	int tmp_v[SCORE_HALO_W];
+	float z[SCORE_HALO_W+1];
+	for(int x = 0; x < SCORE_HALO_W; x++)
+		edt_1d(&d2[x], SCORE_HALO_W, SCORE_HALO_W, tmp_f, tmp_v, z);
+	for(int y = r; y < r+SCORE_TILE_W; y++)
+		edt_1d(&d2[y*SCORE_HALO_W], SCORE_HALO_W, 1, tmp_f, tmp_v, z);
+
+	int ox0 = tx*SCORE_TILE_W, oy0 = ty*SCORE_TILE_W;
+	for(int y = 0; y < SCORE_TILE_W; y++)
+	{
+		for(int x = 0; x < SCORE_TILE_W; x++)
+		{
+			int32_t d = d2[(y+r)*SCORE_HALO_W+x+r];
+			sp->score[SCORE_LFIELD][oy0+y][ox0+x] = (d < LFIELD_D2_FAR) ? d : LFIELD_D2_FAR;
+		}
+	}
 }
 
+// Recalculates one tile of a cached score page. (px,py) is the page, (tx,ty) the tile within it.
+static void update_score_tile(world_t* w, score_page_t* sp, int kind, int px, int py, int tx, int ty)
+{
+	int r = scoremap_radius[kind];
+	int in_w = SCORE_TILE_W+2*r;
+	uint8_t obst[SCORE_HALO_W*SCORE_HALO_W];
+	uint8_t tmp[SCORE_TILE_W*SCORE_HALO_W];
+	uint8_t neigh_max[SCORE_TILE_W*SCORE_TILE_W];
 
-static int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
+	// Gather num_obstacles of the tile plus r units around it, crossing page borders.
+	map_view_t v;
+	map_view_init(w, &v, px*MAP_PAGE_W + tx*SCORE_TILE_W, py*MAP_PAGE_W + ty*SCORE_TILE_W, SCORE_TILE_W, SCORE_TILE_W, r);
+
+	if(kind == SCORE_LFIELD)
+	{
+		update_lfield_tile(&v, sp, tx, ty);
+		sp->dirty[tx][ty] &= ~(1<<kind);
+		return;
+	}
+
+	for(int x = 0; x < in_w; x++)
+		for(int y = 0; y < in_w; y++)
+			obst[y*in_w+x] = MU(MAP_VIEW_UNIT(&v, x-r, y-r), num_obstacles);
+
+	max_filter_2d(obst, in_w, in_w, r, tmp, neigh_max);
+
+	int ox0 = tx*SCORE_TILE_W, oy0 = ty*SCORE_TILE_W;
+	for(int y = 0; y < SCORE_TILE_W; y++)
+	{
+		for(int x = 0; x < SCORE_TILE_W; x++)
+		{
+			int score = 3*obst[(y+r)*in_w+x+r];
+			int neigh_score = 2*neigh_max[y*SCORE_TILE_W+x];
+			if(neigh_score > score) score = neigh_score;
+			if(score > 63) score=63;
+
+			sp->score[kind][oy0+y][ox0+x] = score;
+		}
+	}
+	sp->dirty[tx][ty] &= ~(1<<kind);
+}
+
+/*
+	Fills the TEMP_MAP_W*TEMP_MAP_W scoremap centered at mid_x, mid_y. The scores are kept in w->spages, and only
+	the tiles invalidated since the last call are recalculated; the rest is copying.
+
+	Large steps: slower, allows stepping larger steps, pays the used extra time back when searching large areas.
+
+	Returns 0 on success, -1 if a score page couldn't be allocated; the scoremap is then incomplete.
+*/
+static int gen_scoremap(world_t *w, int8_t *scoremap, int mid_x, int mid_y, int kind)
 {
 	int px, py, ox, oy;
-
 	page_coords(mid_x, mid_y, &px, &py, &ox, &oy);
 	load_25pages(w, px, py);
 
+	// Unit coordinates of the scoremap rows and columns, calculated like page_coords() does for each cell.
+	static int ux[TEMP_MAP_W], uy[TEMP_MAP_W];
+	for(int i = 0; i < TEMP_MAP_W; i++)
+		unit_coords(mid_x + (i-TEMP_MAP_MIDDLE)*MAP_UNIT_W, mid_y + (i-TEMP_MAP_MIDDLE)*MAP_UNIT_W, &ux[i], &uy[i]);
 
-//	printf("Generating scoremap..."); fflush(stdout);
-	for(int xx = 0; xx < TEMP_MAP_W; xx++)
+	int n_updated = 0;
+	for(int tx = ux[0]/SCORE_TILE_W; tx <= ux[TEMP_MAP_W-1]/SCORE_TILE_W; tx++)
 	{
-		for(int yy = 0; yy < TEMP_MAP_W; yy++)
+		for(int ty = uy[0]/SCORE_TILE_W; ty <= uy[TEMP_MAP_W-1]/SCORE_TILE_W; ty++)
 		{
-			page_coords(mid_x + (xx-TEMP_MAP_MIDDLE)*MAP_UNIT_W, mid_y + (yy-TEMP_MAP_MIDDLE)*MAP_UNIT_W, &px, &py, &ox, &oy);
-//			load_9pages(w, px, py);
-
-			int score = 3*w->pages[px][py]->units[ox][oy].num_obstacles;
-
-			for(int ix=-1; ix<=1; ix++)
+			int tpx = tx/SCORE_TILES, tpy = ty/SCORE_TILES;
+			score_page_t* sp = w->spages[tpx][tpy];
+			if(!sp)
 			{
-				for(int iy=-1; iy<=1; iy++)
+				sp = w->spages[tpx][tpy] = malloc(sizeof(score_page_t));
+				if(!sp)
 				{
-					int npx = px, npy = py, nox = ox + ix, noy = oy + iy;
-					if(nox < 0) { nox += MAP_PAGE_W; npx--; } else if(nox >= MAP_PAGE_W) { nox -= MAP_PAGE_W; npx++;}
-					if(noy < 0) { noy += MAP_PAGE_W; npy--; } else if(noy >= MAP_PAGE_W) { noy -= MAP_PAGE_W; npy++;}
-
-					int neigh_score = 2*w->pages[npx][npy]->units[nox][noy].num_obstacles;
-					if(neigh_score > score) score = neigh_score;
+					printf("ERROR: Out of memory allocating score page\n");
+					return -1;
 				}
+				memset(sp->dirty, 0xff, sizeof(sp->dirty));
 			}
 
-			if(score > 63) score=63;
+			if(sp->dirty[tx%SCORE_TILES][ty%SCORE_TILES] & (1<<kind))
+			{
+				update_score_tile(w, sp, kind, tpx, tpy, tx%SCORE_TILES, ty%SCORE_TILES);
+				n_updated++;
+			}
+		}
+	}
 
-			scoremap[yy*TEMP_MAP_W+xx] = score;
+	for(int yy = 0; yy < TEMP_MAP_W; yy++)
+	{
+		int8_t* out = &scoremap[yy*TEMP_MAP_W];
+		int spy = uy[yy]/MAP_PAGE_W, soy = uy[yy]%MAP_PAGE_W;
+		int xx = 0;
+		while(xx < TEMP_MAP_W)
+		{
+			// Copy a run of consecutive units within one page. (ux may repeat at the zero crossing.)
+			int spx = ux[xx]/MAP_PAGE_W;
+			int len = 1;
+			while(xx+len < TEMP_MAP_W && ux[xx+len] == ux[xx]+len && ux[xx+len]/MAP_PAGE_W == spx)
+				len++;
+
+			memcpy(&out[xx], &w->spages[spx][spy]->score[kind][soy][ux[xx]%MAP_PAGE_W], len);
+			xx += len;
 		}
 	}
 
+	if(kind == SCORE_LARGE_STEPS)
+		printf("Generating scoremap (for large steps)... OK (%d tiles updated).\n", n_updated);
+
 /*
 	// Output 768x768x24bit raw image for debug.
 	FILE* dbg_f = fopen("dbg_scoremap.data", "w");
@@ -404,12 +1024,26 @@ static int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x,
 
 	fclose(dbg_f);
 */
-//	printf(" OK.\n");
-
 
 	return 0;
 }
 
+static int gen_scoremap_for_large_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
+{
+	return gen_scoremap(w, scoremap, mid_x, mid_y, SCORE_LARGE_STEPS);
+}
+
+static int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
+{
+	return gen_scoremap(w, scoremap, mid_x, mid_y, SCORE_SMALL_STEPS);
+}
+
+// Points that fall outside the temp map score the edge unit instead of reading past the buffer.
+static inline int temp_map_clamp_idx(int i)
+{
+	return (i < 0) ? 0 : ((i >= TEMP_MAP_W) ? (TEMP_MAP_W-1) : i);
+}
+
 // now, num_dx must equal num_dy, also, num_dx, num_dy must be odd values.
 static int32_t score_quick_search_xy(int8_t *scoremap, int n_lidars, lidar_scan_t** lidar_list, 
 	       int32_t rotate_mid_x, int32_t rotate_mid_y, 
@@ -419,15 +1053,24 @@ static int32_t score_quick_search_xy(int8_t *scoremap, int n_lidars, lidar_scan_
 	int n_points = 0;
 
 //	printf("score_quick_search_xy: dx: %d, %d, %d   dy: %d, %d, %d\n", dx_start, dx_step, num_dx, dy_start, dy_step, num_dy);
-	if(num_dx > 32 || num_dy > 32 || num_dx < 1 || num_dy < 1)
+	if(num_dx > SCORE_MAX_STEPS || num_dy > SCORE_MAX_STEPS || num_dx < 1 || num_dy < 1)
 	{
 		printf("ERROR: score_quick_search_xy(): Invalid num_dx or num_dy\n.");
 		exit(1);
 	}
 
-	int score[32][32] = {{0}};
+	int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS] = {{0}};
 
+	// sin and cos are evaluated once per call, not per point; the rotation expression itself
+	// is kept as-is, so the rotated coordinates are identical.
 	float ang = (float)da/((float)ANG_1_DEG*360.0)*2.0*M_PI;
+	double cos_a = cos(ang);
+	double sin_a = sin(ang);
+
+	score_accum_func_t score_accum = get_score_accum_func();
+
+	int32_t xcol[SCORE_MAX_STEPS];
+	int32_t yrow[SCORE_MAX_STEPS];
 
 	// Go through all valid points in all lidars in the lidar_list.
 	for(int l=0; l<n_lidars; l++)
@@ -446,28 +1089,19 @@ static int32_t score_quick_search_xy(int8_t *scoremap, int n_lidars, lidar_scan_
 			int pre_x = lid->scan[p].x - rotate_mid_x;
 			int pre_y = lid->scan[p].y - rotate_mid_y;
 
-			int rotated_x = pre_x*cos(ang) + pre_y*sin(ang);
-			int rotated_y = -1*pre_x*sin(ang) + pre_y*cos(ang);
+			int rotated_x = pre_x*cos_a + pre_y*sin_a;
+			int rotated_y = -1*pre_x*sin_a + pre_y*cos_a;
 
+			// Scoremap indices for each candidate offset; x and y are independent of each other.
 			for(int ix = 0; ix < num_dx; ix++)
-			{
-				for(int iy = 0; iy < num_dy; iy++)
-				{
-					int x = rotated_x + dx_start+dx_step*ix;
-					int y = rotated_y + dy_start+dy_step*iy;
+				xcol[ix] = temp_map_clamp_idx((rotated_x + dx_start+dx_step*ix)/MAP_UNIT_W + TEMP_MAP_MIDDLE);
 
-					x /= MAP_UNIT_W; y /= MAP_UNIT_W;
-					x += TEMP_MAP_MIDDLE; y += TEMP_MAP_MIDDLE;
+			for(int iy = 0; iy < num_dy; iy++)
+				yrow[iy] = temp_map_clamp_idx((rotated_y + dy_start+dy_step*iy)/MAP_UNIT_W + TEMP_MAP_MIDDLE)*TEMP_MAP_W;
+			for(int iy = num_dy; iy < SCORE_MAX_STEPS; iy++)
+				yrow[iy] = yrow[0];
 
-			/*			if(x < 1 || x >= 767 || y < 1 || y >= 767)
-					{
-						printf("Error: illegal indexes in score_quick: (%d, %d)\n", x, y);
-						return -99999;
-					}
-			*/
-					score[ix][iy] += scoremap[y*TEMP_MAP_W+x];
-				}
-			}
+			score_accum(scoremap, xcol, num_dx, yrow, num_dy, score);
 		}
 	}
 
@@ -487,33 +1121,918 @@ static int32_t score_quick_search_xy(int8_t *scoremap, int n_lidars, lidar_scan_
 			}
 			else
 			{
-				sco = score[ix][iy];
+				sco = score[ix][iy];
+			}
+
+//			printf(" (%2d,%2d): %6d ", ix, iy, score[ix][iy]);
+			if(sco > best_score)
+			{
+				best_score = sco;
+				best_ix = ix;
+				best_iy = iy;
+			}
+		}
+	}
+
+//	printf("\n");
+	*best_dx = dx_start+dx_step*best_ix;
+	*best_dy = dy_start+dy_step*best_iy;
+
+	if(n_points < 10) return 0;
+	return (200*(int64_t)best_score)/n_points;
+}
+
+
+/*
+	Angle sweep: runs score_quick_search_xy for n_da angles (da_start, da_start+da_step, ...), split over
+	map_search_threads workers. Every angle only reads the scoremap and the lidar list.
+
+	The per-angle results are stored, and the best one is picked afterwards in angle order with the same
+	strict > comparison as the original serial loop, so ties resolve the same way and the result does not
+	depend on the thread count or scheduling.
+
+	The extra workers are a pool of threads, started on the first sweep and then kept waiting for the next
+	one. The normal mode sweeps only 5..7 angles per pass, so the gain on the target hasn't been measured;
+	the default is 1, which runs everything in the calling thread, and never starts the pool.
+*/
+
+#ifndef MAP_SEARCH_THREADS
+#define MAP_SEARCH_THREADS 1
+#endif
+
+#define MAX_SEARCH_THREADS 16
+#define MAX_SWEEP_ANGLES 256
+
+int map_search_threads = MAP_SEARCH_THREADS;
+
+typedef struct
+{
+	int8_t *scoremap;
+	int n_lidars;
+	lidar_scan_t** lidar_list;
+	int32_t rotate_mid_x, rotate_mid_y;
+	int32_t da_start, da_step;
+	int n_da;
+	int32_t dx_start, dx_step, num_dx, dy_start, dy_step, num_dy;
+	int ena_weigh;
+	int n_workers;
+
+	int32_t scores[MAX_SWEEP_ANGLES];
+	int32_t best_dxs[MAX_SWEEP_ANGLES];
+	int32_t best_dys[MAX_SWEEP_ANGLES];
+} angle_sweep_t;
+
+static void angle_sweep_worker(angle_sweep_t* sw, int worker_idx)
+{
+	// Interleaved: every angle costs about the same, so this balances well.
+	for(int i = worker_idx; i < sw->n_da; i += sw->n_workers)
+	{
+		int32_t ida = sw->da_start + (int64_t)i*sw->da_step;
+		sw->scores[i] = score_quick_search_xy(sw->scoremap, sw->n_lidars, sw->lidar_list, sw->rotate_mid_x, sw->rotate_mid_y,
+			ida, sw->dx_start, sw->dx_step, sw->num_dx, sw->dy_start, sw->dy_step, sw->num_dy, &sw->best_dxs[i], &sw->best_dys[i], sw->ena_weigh);
+	}
+}
+
+static pthread_mutex_t sweep_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the variables below
+static pthread_cond_t sweep_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sweep_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t sweep_call_mutex = PTHREAD_MUTEX_INITIALIZER; // One sweep at a time uses the pool
+static int sweep_pool_size;  // Pool threads running; worker 0 is always the calling thread.
+static int sweep_pool_tried;
+static angle_sweep_t* sweep_job;
+static int sweep_gen;        // Incremented for every sweep given to the pool
+static int sweep_busy;       // Pool threads still working on the current sweep
+
+static void* sweep_pool_thread(void* arg)
+{
+	int worker_idx = (int)(intptr_t)arg;
+	int done_gen = 0;
+
+	pthread_mutex_lock(&sweep_mutex);
+	while(1)
+	{
+		while(sweep_gen == done_gen)
+			pthread_cond_wait(&sweep_start_cond, &sweep_mutex);
+		done_gen = sweep_gen;
+		angle_sweep_t* sw = sweep_job;
+		pthread_mutex_unlock(&sweep_mutex);
+
+		angle_sweep_worker(sw, worker_idx);
+
+		pthread_mutex_lock(&sweep_mutex);
+		if(--sweep_busy == 0)
+			pthread_cond_signal(&sweep_done_cond);
+	}
+	return NULL;
+}
+
+// Starts the pool threads once; a failed start leaves a smaller pool. Call with sweep_mutex locked.
+static void start_sweep_pool(int n_threads)
+{
+	sweep_pool_tried = 1;
+	for(int t = 0; t < n_threads; t++)
+	{
+		pthread_t thread;
+		int ret;
+		if( (ret = pthread_create(&thread, NULL, sweep_pool_thread, (void*)(intptr_t)(sweep_pool_size+1))) != 0)
+		{
+			printf("WARN: angle_sweep(): pthread_create failed (ret = %d), using %d worker threads\n", ret, sweep_pool_size+1);
+			break;
+		}
+		pthread_detach(thread);
+		sweep_pool_size++;
+	}
+}
+
+static int32_t angle_sweep(int8_t *scoremap, int n_lidars, lidar_scan_t** lidar_list, int32_t rotate_mid_x, int32_t rotate_mid_y,
+	int32_t da_start, int32_t da_step, int n_da,
+	int32_t dx_start, int32_t dx_step, int32_t num_dx, int32_t dy_start, int32_t dy_step, int32_t num_dy, int ena_weigh,
+	int32_t *best_da, int32_t *best_dx, int32_t *best_dy)
+{
+	static angle_sweep_t sw;
+
+	if(n_da < 1 || n_da > MAX_SWEEP_ANGLES)
+	{
+		printf("ERROR: angle_sweep(): Invalid n_da (%d)\n", n_da);
+		return -999999;
+	}
+
+	pthread_mutex_lock(&sweep_call_mutex);
+
+	sw.scoremap = scoremap; sw.n_lidars = n_lidars; sw.lidar_list = lidar_list;
+	sw.rotate_mid_x = rotate_mid_x; sw.rotate_mid_y = rotate_mid_y;
+	sw.da_start = da_start; sw.da_step = da_step; sw.n_da = n_da;
+	sw.dx_start = dx_start; sw.dx_step = dx_step; sw.num_dx = num_dx;
+	sw.dy_start = dy_start; sw.dy_step = dy_step; sw.num_dy = num_dy;
+	sw.ena_weigh = ena_weigh;
+
+	int n_threads = map_search_threads;
+	if(n_threads > MAX_SEARCH_THREADS) n_threads = MAX_SEARCH_THREADS;
+
+	if(n_threads > 1)
+	{
+		get_score_accum_func(); // Do the kernel selection before the threads race for it.
+
+		pthread_mutex_lock(&sweep_mutex);
+		if(!sweep_pool_tried)
+			start_sweep_pool(n_threads-1);
+
+		// All pool threads take part, and skip the angles past n_da.
+		sw.n_workers = sweep_pool_size+1;
+		sweep_job = &sw;
+		sweep_busy = sweep_pool_size;
+		sweep_gen++;
+		pthread_cond_broadcast(&sweep_start_cond);
+		pthread_mutex_unlock(&sweep_mutex);
+
+		angle_sweep_worker(&sw, 0);
+
+		pthread_mutex_lock(&sweep_mutex);
+		while(sweep_busy > 0)
+			pthread_cond_wait(&sweep_done_cond, &sweep_mutex);
+		pthread_mutex_unlock(&sweep_mutex);
+	}
+	else
+	{
+		sw.n_workers = 1;
+		angle_sweep_worker(&sw, 0);
+	}
+
+	int32_t best_score = -999999;
+	*best_da = 0; *best_dx = 0; *best_dy = 0;
+	for(int i = 0; i < n_da; i++)
+	{
+		if(sw.scores[i] > best_score)
+		{
+			best_score = sw.scores[i];
+			*best_da = da_start + (int64_t)i*da_step;
+			*best_dx = sw.best_dxs[i];
+			*best_dy = sw.best_dys[i];
+		}
+	}
+
+	pthread_mutex_unlock(&sweep_call_mutex);
+	return best_score;
+}
+
+/*
+	Branch-and-bound version of the pass1 search, for the big search areas.
+
+	Finds the same optimum as running score_quick_search_xy for every angle and picking the best with
+	the strict > comparison (ties go to the first angle, and to the first ix, then iy within an angle),
+	but skips whole blocks of candidate offsets whose upper bound cannot win.
+
+	Upper bounds come from a pyramid of max-pooled scoremaps: level L holds, for each cell, the max of
+	the scoremap over the 2^L x 2^L window starting at that cell. A block of 2^h x 2^h candidate
+	offsets moves a point over at most ((2^h-1)*step+39)/40+1 cells in each direction, so one lookup
+	per point at a big enough level bounds every candidate in the block. Weighting (ena_weigh) is bounded
+	by the largest weight within the block.
+
+	Cell indices are clamped to the scoremap; score_quick_search_xy would read outside it in that case.
+*/
+
+#define BB_MAX_LEVELS 10 // 512 cells wide at the top, i.e., the whole scoremap
+
+static int8_t score_pyramid[BB_MAX_LEVELS-1][TEMP_MAP_W*TEMP_MAP_W];
+
+static int ceil_log2(int x)
+{
+	int l = 0;
+	while((1<<l) < x) l++;
+	return l;
+}
+
+static void build_score_pyramid(int8_t *scoremap, int8_t** levels, int n_levels)
+{
+	levels[0] = scoremap;
+	for(int l = 1; l < n_levels; l++)
+	{
+		int8_t* src = levels[l-1];
+		int8_t* dst = score_pyramid[l-1];
+		int d = 1<<(l-1);
+		for(int yy = 0; yy < TEMP_MAP_W; yy++)
+		{
+			int yy2 = (yy+d < TEMP_MAP_W) ? (yy+d) : yy;
+			for(int xx = 0; xx < TEMP_MAP_W; xx++)
+			{
+				int xx2 = (xx+d < TEMP_MAP_W) ? (xx+d) : xx;
+				int8_t m = src[yy*TEMP_MAP_W+xx];
+				if(src[yy*TEMP_MAP_W+xx2] > m)  m = src[yy*TEMP_MAP_W+xx2];
+				if(src[yy2*TEMP_MAP_W+xx] > m)  m = src[yy2*TEMP_MAP_W+xx];
+				if(src[yy2*TEMP_MAP_W+xx2] > m) m = src[yy2*TEMP_MAP_W+xx2];
+				dst[yy*TEMP_MAP_W+xx] = m;
+			}
+		}
+		levels[l] = dst;
+	}
+}
+
+/*
+	The exhaustive result is the maximum of this key over all candidates:
+	final score (desc), angle index (asc), weighted score (desc), ix (asc), iy (asc).
+	For a block of candidates, the key built from its upper bound and its first ix, iy is at least the
+	key of every candidate in it, so a block can be skipped when that is not better than the best so far.
+*/
+typedef struct
+{
+	int32_t final;
+	int angle;
+	int64_t sco;
+	int ix, iy;
+} bb_key_t;
+
+static inline int bb_key_better(bb_key_t* a, bb_key_t* b)
+{
+	if(a->final != b->final) return a->final > b->final;
+	if(a->angle != b->angle) return a->angle < b->angle;
+	if(a->sco != b->sco) return a->sco > b->sco;
+	if(a->ix != b->ix) return a->ix < b->ix;
+	return a->iy < b->iy;
+}
+
+typedef struct
+{
+	bb_key_t key; // upper bound key
+	int h;
+} bb_node_t;
+
+typedef struct
+{
+	int8_t* levels[BB_MAX_LEVELS];
+	int level_for_h[BB_MAX_LEVELS];
+
+	int n_lidars;
+	lidar_scan_t** lidar_list;
+	int32_t rotate_mid_x, rotate_mid_y;
+	int32_t da_start, da_step;
+
+	int n_points;
+	int rotated_angle; // Angle index rx, ry are rotated by, -1 = none
+	int32_t *rx, *ry;
+
+	int32_t dx_start, dx_step, num_dx, dy_start, dy_step, num_dy;
+	int ena_weigh;
+
+	bb_key_t best;
+	int n_nodes;
+} bb_search_t;
+
+static inline int32_t bb_final_score(bb_search_t* bb, int64_t sco)
+{
+	// Same conversion as the return value of score_quick_search_xy
+	if(bb->n_points < 10) return 0;
+	return (200*sco)/bb->n_points;
+}
+
+static inline int bb_max_weight(int num, int mid, int i0, int i1)
+{
+	if(mid >= i0 && mid <= i1)
+		return num;
+	int d0 = abs(mid - i0), d1 = abs(mid - i1);
+	return num - ((d0 < d1) ? d0 : d1);
+}
+
+static void bb_rotate(bb_search_t* bb, int angle)
+{
+	if(bb->rotated_angle == angle)
+		return;
+
+	int32_t ida = bb->da_start + (int64_t)angle*bb->da_step;
+
+	// Same rotation as in score_quick_search_xy
+	float ang = (float)ida/((float)ANG_1_DEG*360.0)*2.0*M_PI;
+	double cos_a = cos(ang);
+	double sin_a = sin(ang);
+
+	int n = 0;
+	for(int l=0; l<bb->n_lidars; l++)
+	{
+		lidar_scan_t* lid = bb->lidar_list[l];
+		for(int p=0; p<lid->n_points; p++)
+		{
+			if(!lid->scan[p].valid)
+				continue;
+
+			int pre_x = lid->scan[p].x - bb->rotate_mid_x;
+			int pre_y = lid->scan[p].y - bb->rotate_mid_y;
+
+			bb->rx[n] = pre_x*cos_a + pre_y*sin_a;
+			bb->ry[n] = -1*pre_x*sin_a + pre_y*cos_a;
+			n++;
+		}
+	}
+
+	bb->n_points = n;
+	bb->rotated_angle = angle;
+}
+
+// Fills in the upper bound key for the block of 2^h x 2^h candidates at node->key.ix, iy. Exact when h == 0.
+static void bb_bound(bb_search_t* bb, bb_node_t* node)
+{
+	bb->n_nodes++;
+	bb_rotate(bb, node->key.angle);
+
+	int ix0 = node->key.ix, iy0 = node->key.iy;
+	const int8_t* lvl = bb->levels[bb->level_for_h[node->h]];
+	int32_t offs_x = bb->dx_start + bb->dx_step*ix0;
+	int32_t offs_y = bb->dy_start + bb->dy_step*iy0;
+
+	int64_t sum = 0;
+	for(int i = 0; i < bb->n_points; i++)
+	{
+		int x = temp_map_clamp_idx((bb->rx[i] + offs_x)/MAP_UNIT_W + TEMP_MAP_MIDDLE);
+		int y = temp_map_clamp_idx((bb->ry[i] + offs_y)/MAP_UNIT_W + TEMP_MAP_MIDDLE);
+		sum += lvl[y*TEMP_MAP_W+x];
+	}
+
+	if(bb->ena_weigh)
+	{
+		int k = 1<<node->h;
+		int ix1 = ix0+k-1; if(ix1 >= bb->num_dx) ix1 = bb->num_dx-1;
+		int iy1 = iy0+k-1; if(iy1 >= bb->num_dy) iy1 = bb->num_dy-1;
+		int mid = bb->num_dx/2;
+		sum *= (int64_t)bb_max_weight(bb->num_dx, mid, ix0, ix1) * (int64_t)bb_max_weight(bb->num_dy, mid, iy0, iy1);
+	}
+
+	node->key.sco = sum;
+	node->key.final = bb_final_score(bb, sum);
+}
+
+static int bb_node_cmp(const void* a, const void* b)
+{
+	bb_node_t* na = (bb_node_t*)a;
+	bb_node_t* nb = (bb_node_t*)b;
+	if(bb_key_better(&na->key, &nb->key)) return -1;
+	if(bb_key_better(&nb->key, &na->key)) return 1;
+	return 0;
+}
+
+static void bb_search_node(bb_search_t* bb, bb_node_t* node)
+{
+	if(node->h == 0)
+	{
+		if(bb_key_better(&node->key, &bb->best))
+			bb->best = node->key;
+		return;
+	}
+
+	int half = 1<<(node->h-1);
+	bb_node_t children[4];
+	int n_child = 0;
+
+	for(int cx = 0; cx < 2; cx++)
+	{
+		for(int cy = 0; cy < 2; cy++)
+		{
+			bb_node_t c;
+			c.key.angle = node->key.angle;
+			c.key.ix = node->key.ix + cx*half;
+			c.key.iy = node->key.iy + cy*half;
+			c.h = node->h-1;
+			if(c.key.ix >= bb->num_dx || c.key.iy >= bb->num_dy)
+				continue;
+
+			bb_bound(bb, &c);
+
+			// Insertion sort, best first
+			int pos = n_child;
+			while(pos > 0 && bb_key_better(&c.key, &children[pos-1].key))
+			{
+				children[pos] = children[pos-1];
+				pos--;
+			}
+			children[pos] = c;
+			n_child++;
+		}
+	}
+
+	for(int i = 0; i < n_child; i++)
+	{
+		if(!bb_key_better(&children[i].key, &bb->best))
+			break; // The rest are even worse.
+
+		bb_search_node(bb, &children[i]);
+	}
+}
+
+#define BB_START_LEVEL 5 // Start nodes look at 32x32 cell windows
+
+static int32_t branch_and_bound_search(int8_t *scoremap, int n_lidars, lidar_scan_t** lidar_list, int32_t rotate_mid_x, int32_t rotate_mid_y,
+	int32_t da_start, int32_t da_step, int n_da,
+	int32_t dx_start, int32_t dx_step, int32_t num_dx, int32_t dy_start, int32_t dy_step, int32_t num_dy, int ena_weigh,
+	int32_t *best_da, int32_t *best_dx, int32_t *best_dy)
+{
+	bb_search_t bb;
+	memset(&bb, 0, sizeof(bb));
+
+	int h_root = ceil_log2((num_dx > num_dy) ? num_dx : num_dy);
+	int max_step = (dx_step > dy_step) ? dx_step : dy_step;
+	int h_start = 0;
+	for(int h = 0; h <= h_root && h < BB_MAX_LEVELS; h++)
+	{
+		int w_cells = (((1<<h)-1)*max_step + MAP_UNIT_W-1)/MAP_UNIT_W + 1;
+		bb.level_for_h[h] = ceil_log2(w_cells);
+		if(bb.level_for_h[h] <= BB_START_LEVEL)
+			h_start = h;
+	}
+
+	if(bb.level_for_h[h_start] >= BB_MAX_LEVELS)
+	{
+		printf("ERROR: branch_and_bound_search(): candidate step too large\n");
+		return -999999;
+	}
+
+	build_score_pyramid(scoremap, bb.levels, bb.level_for_h[h_start]+1);
+
+	int k_start = 1<<h_start;
+	int n_start_x = (num_dx + k_start-1)/k_start;
+	int n_start_y = (num_dy + k_start-1)/k_start;
+	int n_start = n_da*n_start_x*n_start_y;
+
+	bb.rx = arena_alloc(thread_arena(), 2*n_lidars*MAX_LIDAR_POINTS*sizeof(int32_t));
+	bb_node_t* start_nodes = arena_alloc(thread_arena(), n_start*sizeof(bb_node_t));
+	if(!bb.rx || !start_nodes)
+	{
+		printf("ERROR: Out of memory in branch_and_bound_search\n");
+		return -999999;
+	}
+	bb.ry = bb.rx + n_lidars*MAX_LIDAR_POINTS;
+
+	bb.n_lidars = n_lidars; bb.lidar_list = lidar_list;
+	bb.rotate_mid_x = rotate_mid_x; bb.rotate_mid_y = rotate_mid_y;
+	bb.da_start = da_start; bb.da_step = da_step;
+	bb.rotated_angle = -1;
+	bb.dx_start = dx_start; bb.dx_step = dx_step; bb.num_dx = num_dx;
+	bb.dy_start = dy_start; bb.dy_step = dy_step; bb.num_dy = num_dy;
+	bb.ena_weigh = ena_weigh;
+
+	// Anything beats this:
+	bb.best.final = -999999; bb.best.angle = n_da; bb.best.sco = -1; bb.best.ix = 0; bb.best.iy = 0;
+
+	// Bound all start nodes, then search them best first: the good angles are found early, and most of the
+	// rest is cut right at the start level.
+	int n = 0;
+	for(int a = 0; a < n_da; a++)
+	{
+		for(int sx = 0; sx < n_start_x; sx++)
+		{
+			for(int sy = 0; sy < n_start_y; sy++)
+			{
+				start_nodes[n].key.angle = a;
+				start_nodes[n].key.ix = sx*k_start;
+				start_nodes[n].key.iy = sy*k_start;
+				start_nodes[n].h = h_start;
+				bb_bound(&bb, &start_nodes[n]);
+				n++;
+			}
+		}
+	}
+
+	qsort(start_nodes, n_start, sizeof(bb_node_t), bb_node_cmp);
+
+	for(int i = 0; i < n_start; i++)
+	{
+		if(!bb_key_better(&start_nodes[i].key, &bb.best))
+			break;
+
+		bb_search_node(&bb, &start_nodes[i]);
+	}
+
+	*best_da = da_start + (int64_t)bb.best.angle*da_step;
+	*best_dx = dx_start + dx_step*bb.best.ix;
+	*best_dy = dy_start + dy_step*bb.best.iy;
+
+//	printf("Branch and bound search: %d angles, %d nodes evaluated (exhaustive: %d)\n", n_da, bb.n_nodes, n_da*num_dx*num_dy);
+
+	return bb.best.final;
+}
+
+/*
+	Likelihood field pass2 (map_pass2_refine == PASS2_REFINE_GAUSS_NEWTON):
+
+	Instead of another grid sweep on the dilated integer scoremap, a smooth field
+	exp(-d^2/(2*sigma^2)) is built from the distance d to the nearest obstacle unit,
+	and the pass1 pose is refined with a few Gauss-Newton iterations, minimizing sum (1 - field)^2
+	over the points, with bilinear interpolation giving the gradients. The result is not bound to
+	the 40 mm / 0.5 deg grid.
+
+	The distances come from the SCORE_LFIELD score page tiles, so only the tiles changed by mapping are
+	recalculated. Beyond SCORE_MAX_RADIUS units the distance is cut off: with LFIELD_SIGMA_MM 60, the field at
+	5 units (200 mm) is exp(-5.56) = 0.004, and every distance beyond reads as LFIELD_D2_FAR, 0.003.
+*/
+
+#ifndef MAP_PASS2_REFINE
+#define MAP_PASS2_REFINE PASS2_REFINE_GRID
+#endif
+
+int map_pass2_refine = MAP_PASS2_REFINE;
+
+#define LFIELD_SIGMA_MM 60.0
+#define LFIELD_GN_MAX_ITERS 8
+
+// exp(-d^2/(2*sigma^2)) for each squared distance (in units^2) stored in the SCORE_LFIELD tiles.
+static float lfield_lut[LFIELD_D2_FAR+1];
+
+// Fills the TEMP_MAP_W*TEMP_MAP_W squared distance map centered at mid_x, mid_y; lfield_interp() turns it into the field.
+static int gen_likelihood_field(world_t *w, int8_t *d2map, int mid_x, int mid_y)
+{
+	const float k = -1.0*(float)(MAP_UNIT_W*MAP_UNIT_W) / (2.0*LFIELD_SIGMA_MM*LFIELD_SIGMA_MM);
+	for(int i = 0; i <= LFIELD_D2_FAR; i++)
+		lfield_lut[i] = expf(k*(float)i);
+
+	return gen_scoremap(w, d2map, mid_x, mid_y, SCORE_LFIELD);
+}
+
+// Bilinear interpolation at continuous cell coords (u,v); cell centers are at +0.5. Gradients are per cell.
+static inline int lfield_interp(const int8_t* d2map, double u, double v, double* val, double* du, double* dv)
+{
+	double fu = u - 0.5, fv = v - 0.5;
+	int iu = floor(fu), iv = floor(fv);
+	if(iu < 0 || iu >= TEMP_MAP_W-1 || iv < 0 || iv >= TEMP_MAP_W-1)
+		return 0;
+
+	double a = fu - iu, b = fv - iv;
+	double m00 = lfield_lut[d2map[iv*TEMP_MAP_W+iu]],     m10 = lfield_lut[d2map[iv*TEMP_MAP_W+iu+1]];
+	double m01 = lfield_lut[d2map[(iv+1)*TEMP_MAP_W+iu]], m11 = lfield_lut[d2map[(iv+1)*TEMP_MAP_W+iu+1]];
+
+	*val = (1.0-a)*(1.0-b)*m00 + a*(1.0-b)*m10 + (1.0-a)*b*m01 + a*b*m11;
+	*du = (1.0-b)*(m10-m00) + b*(m11-m01);
+	*dv = (1.0-a)*(m01-m00) + a*(m11-m10);
+	return 1;
+}
+
+/*
+	Refines da, dx, dy (same meaning as in score_quick_search_xy: rotate around rotate_mid, then shift)
+	in place. Returns the number of iterations done.
+*/
+static int refine_pose_gauss_newton(const int8_t* d2map, int n_lidars, lidar_scan_t** lidar_list, int32_t rotate_mid_x, int32_t rotate_mid_y,
+	int32_t *da, int32_t *dx, int32_t *dy)
+{
+	const double ang_per_rad = (double)ANG_1_DEG*360.0/(2.0*M_PI);
+
+	double th = (double)*da/ang_per_rad;
+	double tx = *dx, ty = *dy;
+
+	int iter;
+	for(iter = 0; iter < LFIELD_GN_MAX_ITERS; iter++)
+	{
+		double H[3][3] = {{0}};
+		double g[3] = {0};
+		int n_used = 0;
+
+		double cos_a = cos(th), sin_a = sin(th);
+
+		for(int l=0; l<n_lidars; l++)
+		{
+			lidar_scan_t* lid = lidar_list[l];
+			for(int p=0; p<lid->n_points; p++)
+			{
+				if(!lid->scan[p].valid)
+					continue;
+
+				double pre_x = lid->scan[p].x - rotate_mid_x;
+				double pre_y = lid->scan[p].y - rotate_mid_y;
+				double x2 = pre_x*cos_a + pre_y*sin_a;
+				double y2 = -1*pre_x*sin_a + pre_y*cos_a;
+
+				double val, du, dv;
+				if(!lfield_interp(d2map, (x2+tx)/(double)MAP_UNIT_W + TEMP_MAP_MIDDLE, (y2+ty)/(double)MAP_UNIT_W + TEMP_MAP_MIDDLE, &val, &du, &dv))
+					continue;
+
+				du /= (double)MAP_UNIT_W; dv /= (double)MAP_UNIT_W; // per mm
+
+				// Residual r = 1 - field; d(x2)/d(th) = y2, d(y2)/d(th) = -x2
+				double r = 1.0 - val;
+				double J[3] = { -(du*y2 - dv*x2), -du, -dv };
+
+				for(int i=0; i<3; i++)
+				{
+					g[i] += J[i]*r;
+					for(int o=0; o<3; o++)
+						H[i][o] += J[i]*J[o];
+				}
+				n_used++;
+			}
+		}
+
+		if(n_used < 10)
+			break;
+
+		// Tiny Levenberg-Marquardt style damping keeps flat areas from producing huge steps.
+		for(int i=0; i<3; i++)
+			H[i][i] *= 1.001;
+		H[0][0] += 1e-9; H[1][1] += 1e-9; H[2][2] += 1e-9;
+
+		double det = H[0][0]*(H[1][1]*H[2][2]-H[1][2]*H[2][1]) - H[0][1]*(H[1][0]*H[2][2]-H[1][2]*H[2][0]) + H[0][2]*(H[1][0]*H[2][1]-H[1][1]*H[2][0]);
+		if(fabs(det) < 1e-30)
+			break;
+
+		// delta = -H^-1 g, Cramer's rule
+		double b0 = -g[0], b1 = -g[1], b2 = -g[2];
+		double d_th = (b0*(H[1][1]*H[2][2]-H[1][2]*H[2][1]) - H[0][1]*(b1*H[2][2]-H[1][2]*b2) + H[0][2]*(b1*H[2][1]-H[1][1]*b2)) / det;
+		double d_tx = (H[0][0]*(b1*H[2][2]-H[1][2]*b2) - b0*(H[1][0]*H[2][2]-H[1][2]*H[2][0]) + H[0][2]*(H[1][0]*b2-b1*H[2][0])) / det;
+		double d_ty = (H[0][0]*(H[1][1]*b2-b1*H[2][1]) - H[0][1]*(H[1][0]*b2-b1*H[2][0]) + b0*(H[1][0]*H[2][1]-H[1][1]*H[2][0])) / det;
+
+		// Don't jump out of the basin in one step.
+		if(fabs(d_tx) > 2*MAP_UNIT_W || fabs(d_ty) > 2*MAP_UNIT_W || fabs(d_th) > DEGTORAD(1.0))
+		{
+			double scale = 1.0;
+			if(fabs(d_tx)*scale > 2*MAP_UNIT_W) scale = 2*MAP_UNIT_W/fabs(d_tx);
+			if(fabs(d_ty)*scale > 2*MAP_UNIT_W) scale = 2*MAP_UNIT_W/fabs(d_ty);
+			if(fabs(d_th)*scale > DEGTORAD(1.0)) scale = DEGTORAD(1.0)/fabs(d_th);
+			d_th *= scale; d_tx *= scale; d_ty *= scale;
+		}
+
+		th += d_th; tx += d_tx; ty += d_ty;
+
+		if(fabs(d_tx) < 1.0 && fabs(d_ty) < 1.0 && fabs(d_th) < DEGTORAD(0.02))
+		{
+			iter++;
+			break;
+		}
+	}
+
+	*da = th*ang_per_rad;
+	*dx = tx;
+	*dy = ty;
+	return iter;
+}
+
+typedef struct  // Each bit represents each lidar scan (i.e., 32 lidar scans max).
+{
+	uint32_t seen;
+	uint32_t wall;
+} temp_map_img_t;
+
+/*
+	Hit counting for temp_map_img_t bitmasks: the index of the highest set bit + 1. Note that this is not the
+	number of set bits; this is what the thresholds in do_mapping have always been tuned with.
+*/
+static inline int scan_bits_cnt(uint32_t bits)
+{
+	return bits ? (32 - __builtin_clz(bits)) : 0;
+}
+
+/*
+	Marks the units from (x0,y0) towards (x1,y1), excluding the end point, as seen.
+	Steps one unit at a time along the major axis; the minor axis coordinate is x0 + floor(i*d_minor/|d_major|),
+	tracked as an integer quotient and remainder.
+*/
+static void mark_seen_ray(temp_map_img_t* temp_map, int x0, int y0, int x1, int y1, uint32_t bit)
+{
+	int dx = x1 - x0, dy = y1 - y0;
+	int adx = abs(dx), ady = abs(dy);
+
+	if(adx >= ady) // Step in X direction
+	{
+		int sx = (dx >= 0) ? 1 : -1;
+		int now_y = y0, rem = 0;
+		for(int ix = 0; ix < adx; ix++)
+		{
+			temp_map[now_y*TEMP_MAP_W + x0 + ix*sx].seen |= bit;
+			rem += dy;
+			if(rem >= adx) { rem -= adx; now_y++; }
+			else if(rem < 0) { rem += adx; now_y--; }
+		}
+	}
+	else // Step in Y direction
+	{
+		int sy = (dy >= 0) ? 1 : -1;
+		int now_x = x0, rem = 0;
+		for(int iy = 0; iy < ady; iy++)
+		{
+			temp_map[(y0 + iy*sy)*TEMP_MAP_W + now_x].seen |= bit;
+			rem += dx;
+			if(rem >= ady) { rem -= ady; now_x++; }
+			else if(rem < 0) { rem += ady; now_x--; }
+		}
+	}
+}
+
+/*
+	do_mapping works in two passes over the temp map: the rays are drawn first, then the units are classified
+	into merge_ops. The merge into the map units is order dependent (existing walls are claimed by the first
+	new wall nearby, the counters saturate, neighbours within two units interact), so the writes are done
+	afterwards from merge_ops, in the original order.
+
+	The exception are units only seen through, with no clear wall within two units: nothing else in the merge
+	touches them or reads them back, so they go to seen_ops instead, and map_seen_counters() updates them
+	a page column at a time.
+*/
+
+typedef struct
+{
+	temp_map_img_t* temp_map;
+	uint8_t* merge_ops;
+	uint8_t* seen_ops;
+	int act_x0, act_x1, act_y0, act_y1; // Units the rays and the duplicate wall removal reach, within 3..TEMP_MAP_W-4
+	int n_lidars;
+	lidar_scan_t** lidar_list;
+	int32_t (*pts)[2];
+	int* robot_xs;
+	int* robot_ys;
+} insert_job_t;
+
+static void insert_raycast(insert_job_t* job)
+{
+	temp_map_img_t* temp_map = job->temp_map;
+
+	for(int l=0; l<job->n_lidars; l++)
+	{
+		lidar_scan_t* lid = job->lidar_list[l];
+		int robot_x = job->robot_xs[l], robot_y = job->robot_ys[l];
+
+		for(int p=0; p<lid->n_points; p++)
+		{
+			if(!lid->scan[p].valid)
+				continue;
+
+			int x = job->pts[l*MAX_LIDAR_POINTS+p][0];
+			int y = job->pts[l*MAX_LIDAR_POINTS+p][1];
+
+			if(x < 5 || x >= TEMP_MAP_W-5 || y < 5 || y > TEMP_MAP_W-5)
+				continue;
+
+			// Mark areas between the robot coords and the current point: "seen".
+			mark_seen_ray(temp_map, robot_x, robot_y, x, y, 1UL<<l);
+
+			// Finally, mark the lidar point as a wall, at the end of the "seen" vector
+			temp_map[y*TEMP_MAP_W + x].wall |= 1UL<<l;
+		}
+	}
+}
+
+#define TEMP_MAP_WORDS (TEMP_MAP_W/64)
+
+static void insert_classify(insert_job_t* job)
+{
+	temp_map_img_t* temp_map = job->temp_map;
+	uint8_t* merge_ops = job->merge_ops;
+	uint8_t* seen_ops = job->seen_ops;
+
+	/*
+		MERGE_WALL units on rows iy-2..iy+2, rotating; row r is in walls[r%5]. A seen unit is handed to the
+		counter kernel once the rows two units below it are classified. Outside act_y0..act_y1 there are no walls.
+	*/
+	uint64_t walls[5][TEMP_MAP_WORDS];
+	memset(walls, 0, sizeof(walls));
+
+	for(int iy = job->act_y0; iy < job->act_y1+2; iy++)
+	{
+		uint64_t* wall_bits = walls[iy%5];
+		for(int i = 0; i < TEMP_MAP_WORDS; i++)
+			wall_bits[i] = 0;
+
+		if(iy < job->act_y1)
+		{
+			for(int ix = job->act_x0; ix < job->act_x1; ix++)
+			{
+				int s_cnt = scan_bits_cnt(temp_map[iy*TEMP_MAP_W+ix].seen);
+				int w_cnt = scan_bits_cnt(temp_map[iy*TEMP_MAP_W+ix].wall);
+				uint8_t op = 0;
+
+				if(w_cnt > 3)
+				{
+					op = MERGE_WALL;
+					wall_bits[ix/64] |= 1ULL << (ix%64);
+				}
+				else if(w_cnt == 0 && s_cnt > 3)
+				{
+					int neigh_w_cnt =
+						scan_bits_cnt(temp_map[(iy)*TEMP_MAP_W+(ix+1)].wall) +
+						scan_bits_cnt(temp_map[(iy)*TEMP_MAP_W+(ix-1)].wall) +
+						scan_bits_cnt(temp_map[(iy+1)*TEMP_MAP_W+(ix+1)].wall) +
+						scan_bits_cnt(temp_map[(iy+1)*TEMP_MAP_W+(ix-1)].wall) +
+						scan_bits_cnt(temp_map[(iy+1)*TEMP_MAP_W+(ix  )].wall) +
+						scan_bits_cnt(temp_map[(iy-1)*TEMP_MAP_W+(ix+1)].wall) +
+						scan_bits_cnt(temp_map[(iy-1)*TEMP_MAP_W+(ix-1)].wall) +
+						scan_bits_cnt(temp_map[(iy-1)*TEMP_MAP_W+(ix  )].wall);
+
+					op = MERGE_SEEN;
+					if(s_cnt > 5 && neigh_w_cnt == 0) op |= MERGE_SEEN_SURE;
+					if(neigh_w_cnt < 2) op |= MERGE_FEW_NEIGH;
+				}
+
+				merge_ops[iy*TEMP_MAP_W+ix] = op;
 			}
+		}
 
-//			printf(" (%2d,%2d): %6d ", ix, iy, score[ix][iy]);
-			if(sco > best_score)
+		int fy = iy-2;
+		if(fy < job->act_y0)
+			continue;
+
+		// Units with a MERGE_WALL unit within the +-2 units the wall search in do_mapping reaches.
+		uint64_t rows[TEMP_MAP_WORDS], near_wall[TEMP_MAP_WORDS];
+		for(int i = 0; i < TEMP_MAP_WORDS; i++)
+			rows[i] = walls[0][i] | walls[1][i] | walls[2][i] | walls[3][i] | walls[4][i];
+		for(int i = 0; i < TEMP_MAP_WORDS; i++)
+		{
+			uint64_t lo = (i > 0) ? rows[i-1] : 0;
+			uint64_t hi = (i < TEMP_MAP_WORDS-1) ? rows[i+1] : 0;
+			near_wall[i] = rows[i] | rows[i]<<1 | rows[i]<<2 | rows[i]>>1 | rows[i]>>2 |
+				lo>>63 | lo>>62 | hi<<63 | hi<<62;
+		}
+
+		// No wall can claim these: they go to the counter kernel, column-major like the map pages.
+		for(int ix = job->act_x0; ix < job->act_x1; ix++)
+		{
+			uint8_t op = merge_ops[fy*TEMP_MAP_W+ix];
+			if((op & MERGE_SEEN) && !((near_wall[ix/64] >> (ix%64)) & 1))
 			{
-				best_score = sco;
-				best_ix = ix;
-				best_iy = iy;
+				seen_ops[ix*TEMP_MAP_W+fy] = op;
+				merge_ops[fy*TEMP_MAP_W+ix] = 0;
 			}
 		}
 	}
+}
 
-//	printf("\n");
-	*best_dx = dx_start+dx_step*best_ix;
-	*best_dy = dy_start+dy_step*best_iy;
+/*
+	While merging a batch into the map, do_mapping needs to read num_obstacles as it was before the batch, so
+	that what was just written doesn't affect the adjacent units. Instead of copying the 3x3 pages around the
+	batch, the first write to a unit saves its old value here. Indexed by unit coordinates within the 3x3 page
+	window; an entry is valid only if its gen equals batch_gen, so nothing needs clearing between batches.
+*/
+#define BATCH_WIN_W (3*MAP_PAGE_W)
 
-	if(n_points < 10) return 0;
-	return (200*best_score)/n_points;
+typedef struct
+{
+	uint8_t written_gen;    // num_obstacles has been modified in this batch, orig_obstacles holds the old value
+	uint8_t orig_obstacles;
+	uint8_t used_gen;       // an existing wall here has already been matched in this batch
+} batch_overlay_t;
+
+static batch_overlay_t batch_overlay[BATCH_WIN_W][BATCH_WIN_W];
+static uint8_t batch_gen;
+
+static void batch_overlay_start()
+{
+	batch_gen++;
+	if(batch_gen == 0) // Wrapped around, old tags could match again.
+	{
+		memset(batch_overlay, 0, sizeof(batch_overlay));
+		batch_gen = 1;
+	}
 }
 
+static int pre_batch_obstacles(map_unit_ref_t u, int wx, int wy)
+{
+	if(batch_overlay[wx][wy].written_gen == batch_gen)
+		return batch_overlay[wx][wy].orig_obstacles;
+	return MU(u, num_obstacles);
+}
 
-typedef struct  // Each bit represents each lidar scan (i.e., 32 lidar scans max).
+// Call before modifying num_obstacles during the batch.
+static void batch_save_obstacles(map_unit_ref_t u, int wx, int wy)
 {
-	uint32_t seen;
-	uint32_t wall;
-} temp_map_img_t;
+	if(wx < 0 || wx >= BATCH_WIN_W || wy < 0 || wy >= BATCH_WIN_W)
+		return; // Never read back.
+
+	if(batch_overlay[wx][wy].written_gen != batch_gen)
+	{
+		batch_overlay[wx][wy].written_gen = batch_gen;
+		batch_overlay[wx][wy].orig_obstacles = MU(u, num_obstacles);
+	}
+}
 
 static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
                       int32_t da, int32_t dx, int32_t dy, int32_t rotate_mid_x, int32_t rotate_mid_y,
@@ -529,120 +2048,114 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 		This map is (3* MAP_PAGE_W) x (3* MAP_PAGE_W) in size, the middle point being at rotate_mid_x,rotate_mid_y.
 	*/
 
-	temp_map_img_t* temp_map = calloc(TEMP_MAP_W*TEMP_MAP_W, sizeof(temp_map_img_t));
+	temp_map_img_t* temp_map = arena_calloc(thread_arena(), TEMP_MAP_W*TEMP_MAP_W, sizeof(temp_map_img_t));
 	if(!temp_map)
 	{
 		printf("ERROR: Out of memory in do_mapping\n");
 		return -1;
 	}
 
-	// Go through all valid points in all lidars in the lidar_list.
+	/*
+		Rotate the robot positions and the points by da, shift by dx, dy, and convert to temp map units.
+		Done once here, both passes below use the results.
+	*/
+	int32_t (*pts)[2] = arena_alloc(thread_arena(), n_lidars*MAX_LIDAR_POINTS*sizeof(*pts));
+	if(!pts)
+	{
+		printf("ERROR: Out of memory in do_mapping\n");
+		return -1;
+	}
+	int robot_xs[32], robot_ys[32];
+
+	float ang = (float)da/((float)ANG_1_DEG*360.0)*2.0*M_PI;
+	double cos_a = cos(ang), sin_a = sin(ang);
+
 	for(int l=0; l<n_lidars; l++)
 	{
 		lidar_scan_t* lid = lidar_list[l];
 
-		// Rotate the point by da and then shift by dx, dy.
-		float ang = (float)da/((float)ANG_1_DEG*360.0)*2.0*M_PI;
-
 		int robot_pre_x = lid->robot_pos.x - rotate_mid_x;
 		int robot_pre_y = lid->robot_pos.y - rotate_mid_y;
 
-		int robot_x = robot_pre_x*cos(ang) + robot_pre_y*sin(ang) /* + rotate_mid_x */ + dx ;
-		int robot_y = -1*robot_pre_x*sin(ang) + robot_pre_y*cos(ang) /* + rotate_mid_y */ + dy;
+		int robot_x = robot_pre_x*cos_a + robot_pre_y*sin_a /* + rotate_mid_x */ + dx ;
+		int robot_y = -1*robot_pre_x*sin_a + robot_pre_y*cos_a /* + rotate_mid_y */ + dy;
 
-		robot_x /= MAP_UNIT_W; robot_y /= MAP_UNIT_W;
-		robot_x += TEMP_MAP_MIDDLE; robot_y += TEMP_MAP_MIDDLE;
+		robot_xs[l] = robot_x/MAP_UNIT_W + TEMP_MAP_MIDDLE;
+		robot_ys[l] = robot_y/MAP_UNIT_W + TEMP_MAP_MIDDLE;
 
-		// Robot coords should be in the middle 1/4..3/4 section.
-		if(robot_x < TEMP_MAP_W/4 || robot_x >= 3*TEMP_MAP_W/4 || robot_y < TEMP_MAP_W/4 || robot_y > 3*TEMP_MAP_W/4)
-		{
-			printf("ERROR: out of range temp map coords (%d, %d) (robot position)\n", robot_x, robot_y);
-			free(temp_map);
-			return -2;
-		}
-		
 		for(int p=0; p<lid->n_points; p++)
 		{
 			if(!lid->scan[p].valid)
 				continue;
 
-			// Rotate the point by da and then shift by dx, dy.	
 			int pre_x = lid->scan[p].x - rotate_mid_x;
 			int pre_y = lid->scan[p].y - rotate_mid_y;
 
-			int x = pre_x*cos(ang) + pre_y*sin(ang) /* + rotate_mid_x */ + dx ;
-			int y = -1*pre_x*sin(ang) + pre_y*cos(ang) /* + rotate_mid_y */ + dy;
+			int x = pre_x*cos_a + pre_y*sin_a /* + rotate_mid_x */ + dx ;
+			int y = -1*pre_x*sin_a + pre_y*cos_a /* + rotate_mid_y */ + dy;
 
-			x /= MAP_UNIT_W; y /= MAP_UNIT_W;
-
-			x += TEMP_MAP_MIDDLE; y += TEMP_MAP_MIDDLE;
+			pts[l*MAX_LIDAR_POINTS+p][0] = x/MAP_UNIT_W + TEMP_MAP_MIDDLE;
+			pts[l*MAX_LIDAR_POINTS+p][1] = y/MAP_UNIT_W + TEMP_MAP_MIDDLE;
+		}
+	}
 
-			if(x < 5 || x >= TEMP_MAP_W-5 || y < 5 || y > TEMP_MAP_W-5)
-			{
-//				printf("WARN: ignoring out of range temp map coords (%d, %d) (scan point)\n", x, y);
-//				free(temp_map);
-//				return -2;
-				continue;
-			}
+	// Robot coords should be in the middle 1/4..3/4 section.
+	for(int l=0; l<n_lidars; l++)
+	{
+		if(robot_xs[l] < TEMP_MAP_W/4 || robot_xs[l] >= 3*TEMP_MAP_W/4 || robot_ys[l] < TEMP_MAP_W/4 || robot_ys[l] > 3*TEMP_MAP_W/4)
+		{
+			printf("ERROR: out of range temp map coords (%d, %d) (robot position)\n", robot_xs[l], robot_ys[l]);
+			return -2;
+		}
+	}
 
-			// Mark areas between the robot coords and the current point: "seen".
+	insert_job_t job;
+	job.temp_map = temp_map;
+	job.merge_ops = NULL;
+	job.n_lidars = n_lidars;
+	job.lidar_list = lidar_list;
+	job.pts = pts;
+	job.robot_xs = robot_xs;
+	job.robot_ys = robot_ys;
 
-			int dx = x - robot_x;
-			int dy = y - robot_y;
+	/*
+		Nothing is marked outside the bounding box of the robot positions and the scan points; the duplicate
+		wall removal can move a wall one unit further. The merge only looks at this area.
+		Don't go near to the edges, the neighbouring cells are compared.
+	*/
+	int act_x0 = TEMP_MAP_W, act_x1 = 0, act_y0 = TEMP_MAP_W, act_y1 = 0;
+	for(int l=0; l<n_lidars; l++)
+	{
+		lidar_scan_t* lid = lidar_list[l];
 
-			if(abs(dx) >= abs(dy)) // Step in X direction
-			{
-				if(dx >= 0)
-				{
-					float dy_per_step = (float)dy/(float)dx;
-					for(int ix = 0; ix < dx; ix++)
-					{
-						int now_y = robot_y + dy_per_step*(float)ix;
-						int now_x = robot_x + ix;
-						temp_map[now_y*TEMP_MAP_W + now_x].seen |= 1UL<<l;
-					}
-				}
-				else // dx < 0
-				{
-					float dy_per_step = (float)dy/(float)dx;
-					for(int ix = 0; ix < -1*dx; ix++)
-					{
-						int now_y = robot_y - dy_per_step*(float)ix;
-						int now_x = robot_x - ix;
-						temp_map[now_y*TEMP_MAP_W + now_x].seen |= 1UL<<l;
-					}
-				}
+		if(robot_xs[l] < act_x0) act_x0 = robot_xs[l];
+		if(robot_xs[l] > act_x1) act_x1 = robot_xs[l];
+		if(robot_ys[l] < act_y0) act_y0 = robot_ys[l];
+		if(robot_ys[l] > act_y1) act_y1 = robot_ys[l];
 
-			}
-			else // Step in Y direction
-			{
-				if(dy >= 0)
-				{
-					float dx_per_step = (float)dx/(float)dy;
-					for(int iy = 0; iy < dy; iy++)
-					{
-						int now_x = robot_x + dx_per_step*(float)iy;
-						int now_y = robot_y + iy;
-						temp_map[now_y*TEMP_MAP_W + now_x].seen |= 1UL<<l;
-					}
-				}
-				else // dy < 0
-				{
-					float dx_per_step = (float)dx/(float)dy;
-					for(int iy = 0; iy < -1*dy; iy++)
-					{
-						int now_x = robot_x - dx_per_step*(float)iy;
-						int now_y = robot_y - iy;
-						temp_map[now_y*TEMP_MAP_W + now_x].seen |= 1UL<<l;
-					}
-				}
+		for(int p=0; p<lid->n_points; p++)
+		{
+			if(!lid->scan[p].valid)
+				continue;
 
-			}
+			int x = pts[l*MAX_LIDAR_POINTS+p][0];
+			int y = pts[l*MAX_LIDAR_POINTS+p][1];
+			if(x < 5 || x >= TEMP_MAP_W-5 || y < 5 || y > TEMP_MAP_W-5)
+				continue;
 
-			// Finally, mark the lidar point as a wall, at the end of the "seen" vector
-			temp_map[y*TEMP_MAP_W + x].wall |= 1UL<<l;
+			if(x < act_x0) act_x0 = x;
+			if(x > act_x1) act_x1 = x;
+			if(y < act_y0) act_y0 = y;
+			if(y > act_y1) act_y1 = y;
 		}
 	}
+	job.act_x0 = (act_x0-1 < 3) ? 3 : act_x0-1;
+	job.act_y0 = (act_y0-1 < 3) ? 3 : act_y0-1;
+	job.act_x1 = (act_x1+2 > TEMP_MAP_W-3) ? TEMP_MAP_W-3 : act_x1+2;
+	job.act_y1 = (act_y1+2 > TEMP_MAP_W-3) ? TEMP_MAP_W-3 : act_y1+2;
+
+	// Go through all valid points in all lidars in the lidar_list.
+	insert_raycast(&job);
 
 /*
 	// Output 768x768x24bit raw image for debug.
@@ -694,72 +2207,47 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 		if(pagex != prev_visit_px || pagey != prev_visit_py || offsx != prev_visit_ox || offsy != prev_visit_oy)
 		{
 			load_1page(w, pagex, pagey);
-			PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_visited);
+			PLUS_SAT_255(MU(MAP_UNIT(w->pages[pagex][pagey], offsx, offsy), num_visited));
 		}
 		prev_visit_px = pagex; prev_visit_py = pagey; prev_visit_ox = offsx; prev_visit_oy = offsy;
 
-		// Rotate the point by da and then shift by dx, dy.
-		float ang = (float)da/((float)ANG_1_DEG*360.0)*2.0*M_PI;
-
-		int robot_pre_x = lid->robot_pos.x - rotate_mid_x;
-		int robot_pre_y = lid->robot_pos.y - rotate_mid_y;
-
-		int robot_x = robot_pre_x*cos(ang) + robot_pre_y*sin(ang) /* + rotate_mid_x */ + dx ;
-		int robot_y = -1*robot_pre_x*sin(ang) + robot_pre_y*cos(ang) /* + rotate_mid_y */ + dy;
-
-		robot_x /= MAP_UNIT_W; robot_y /= MAP_UNIT_W;
-		robot_x += TEMP_MAP_MIDDLE; robot_y += TEMP_MAP_MIDDLE;
+		int robot_x = robot_xs[l], robot_y = robot_ys[l];
 
 		for(int p=0; p<lid->n_points; p++)
 		{
 			if(!lid->scan[p].valid)
 				continue;
 
-			// Rotate the point by da and then shift by dx, dy.	
-			int pre_x = lid->scan[p].x - rotate_mid_x;
-			int pre_y = lid->scan[p].y - rotate_mid_y;
-
-			int x = pre_x*cos(ang) + pre_y*sin(ang) /* + rotate_mid_x */ + dx ;
-			int y = -1*pre_x*sin(ang) + pre_y*cos(ang) /* + rotate_mid_y */ + dy;
-
-			x /= MAP_UNIT_W; y /= MAP_UNIT_W;
-
-			x += TEMP_MAP_MIDDLE; y += TEMP_MAP_MIDDLE;
+			int x = pts[l*MAX_LIDAR_POINTS+p][0];
+			int y = pts[l*MAX_LIDAR_POINTS+p][1];
 
 			// Find the next unit from where we did put the wall before.
 
 			int dx = x - robot_x;
 			int dy = y - robot_y;
+			int adx = abs(dx), ady = abs(dy);
+
+			if(adx == 0 && ady == 0)
+				continue;
 
 			int next_x, next_y;
-			if(abs(dx) >= abs(dy)) // Step in X direction
+			if(adx >= ady) // Step in X direction
 			{
-				float dy_per_step = (float)dy/(float)dx;
-				int next_dx = dx + ((dx>0)?1:-1);
-				next_y = robot_y + dy_per_step*(float)next_dx;
-				next_x = robot_x + next_dx;
+				next_y = robot_y + floor_div(dy*(adx+1), adx);
+				next_x = x + ((dx>0)?1:-1);
 			}
 			else // Step in Y direction
 			{
-				float dx_per_step = (float)dx/(float)dy;
-				int next_dy = dy + ((dy>0)?1:-1);
-				next_x = robot_x + dx_per_step*(float)next_dy;
-				next_y = robot_y + next_dy;
-
+				next_x = robot_x + floor_div(dx*(ady+1), ady);
+				next_y = y + ((dy>0)?1:-1);
 			}
 
-			int w_cnt_at_next = 0;
-
 			if(next_x < 1 || next_x >= TEMP_MAP_W-1 || next_y < 1 || next_y >= TEMP_MAP_W-1)
 			{
 				continue;
 			}
-			uint32_t tmp = temp_map[next_y*TEMP_MAP_W+next_x].wall;
-			while(tmp) { w_cnt_at_next++; tmp>>=1;}
-
-			int w_cnt_at_cur = 0;
-			tmp = temp_map[y*TEMP_MAP_W+x].wall;
-			while(tmp) { w_cnt_at_cur++; tmp>>=1;}
+			int w_cnt_at_next = scan_bits_cnt(temp_map[next_y*TEMP_MAP_W+next_x].wall);
+			int w_cnt_at_cur = scan_bits_cnt(temp_map[y*TEMP_MAP_W+x].wall);
 
 			if(w_cnt_at_next > 0 && w_cnt_at_cur > 0 && w_cnt_at_next > w_cnt_at_cur) // next spot wins
 			{
@@ -813,106 +2301,135 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 
 	// Add our temporary map to the actual map.
 	// Don't loop near to the edges, we are comparing neighbouring cells inside the loop.
-	// Operate by reading a copy, writing to actual map, so that what we have just now written doesn't affect the adjacent units:
+	// Read the pre-batch state (see batch_overlay_t), write to actual map, so that what we have just now written doesn't affect the adjacent units:
 
 	
-	int mid_x_mm = (rotate_mid_x/MAP_UNIT_W)*MAP_UNIT_W;
-	int mid_y_mm = (rotate_mid_y/MAP_UNIT_W)*MAP_UNIT_W;
-	page_coords(mid_x_mm, mid_y_mm, &pagex, &pagey, &offsx, &offsy);
+	// Temp map (ix, iy) is the unit (written_ux0+ix, written_uy0+iy). The view covers the units written to,
+	// starting at temp map (3, 3), and its halo the neighbours searched for an existing wall.
+	int written_ux0 = rotate_mid_x/MAP_UNIT_W - TEMP_MAP_MIDDLE + MAP_MIDDLE_UNIT;
+	int written_uy0 = rotate_mid_y/MAP_UNIT_W - TEMP_MAP_MIDDLE + MAP_MIDDLE_UNIT;
+
+	map_view_t* view = arena_alloc(thread_arena(), sizeof(map_view_t));
+	if(!view)
+	{
+		printf("ERROR: Out of memory in do_mapping\n");
+		return -1;
+	}
+	if(map_view_init(w, view, written_ux0+3, written_uy0+3, TEMP_MAP_W-6, TEMP_MAP_W-6, 2) < 0)
+		return -3;
+	if(view->n_missing)
+	{
+		printf("ERROR: do_mapping: map pages around (%d, %d) not in memory\n", pagex, pagey);
+		return -3;
+	}
 
-	static map_page_t copies[3][3];
-	static uint8_t spot_used[3][3][MAP_PAGE_W][MAP_PAGE_W];
+	// Unit coords within the 3x3 page window of the batch overlay
+	int win_ux0 = (written_ux0 + TEMP_MAP_MIDDLE)/MAP_PAGE_W*MAP_PAGE_W - MAP_PAGE_W;
+	int win_uy0 = (written_uy0 + TEMP_MAP_MIDDLE)/MAP_PAGE_W*MAP_PAGE_W - MAP_PAGE_W;
 
-	int copy_pagex_start = pagex-1;
-	int copy_pagey_start = pagey-1;
+	batch_overlay_start();
+
+	job.merge_ops = arena_alloc(thread_arena(), TEMP_MAP_W*TEMP_MAP_W);
+	job.seen_ops = arena_calloc(thread_arena(), TEMP_MAP_W*TEMP_MAP_W, 1);
+	uint8_t* obst_changed = arena_alloc(thread_arena(), MAP_PAGE_W);
+	if(!job.merge_ops || !job.seen_ops || !obst_changed)
+	{
+		printf("ERROR: Out of memory in do_mapping\n");
+		return -1;
+	}
+	insert_classify(&job);
 
-	for(int i = 0; i<3; i++)
+	// Seen units out of the reach of the wall search: counter updates in runs along the page columns.
+	for(int ix = job.act_x0; ix < job.act_x1; ix++)
 	{
-		for(int o=0; o<3; o++)
+		int ux = written_ux0 + ix;
+		for(int iy = job.act_y0; iy < job.act_y1; )
 		{
-			memcpy(&copies[i][o], w->pages[copy_pagex_start+i][copy_pagey_start+o], sizeof(map_page_t));
-			memset(spot_used[i][o], 0, MAP_PAGE_W*MAP_PAGE_W);
+			int uy = written_uy0 + iy;
+			int n = MAP_PAGE_W - uy%MAP_PAGE_W;
+			if(n > job.act_y1-iy) n = job.act_y1-iy;
+
+			map_unit_ref_t u = MAP_VIEW_UNIT(view, ix-3, iy-3);
+			if(map_seen_counters(&MU(u, result), &MU(u, num_seen), &MU(u, num_obstacles), MU_STRIDE,
+				&job.seen_ops[ix*TEMP_MAP_W+iy], obst_changed, n))
+			{
+				w->changed[ux/MAP_PAGE_W][uy/MAP_PAGE_W] = 1;
+
+				// Same as obstacles_changed() on every unit, runs of adjacent units combined.
+				for(int i = 0; i < n; i++)
+				{
+					if(!obst_changed[i])
+						continue;
+					int end = i;
+					while(end+1 < n && obst_changed[end+1])
+						end++;
+					invalidate_scoremaps(w, ux, uy+i, ux, uy+end);
+					i = end;
+				}
+			}
+			iy += n;
 		}
 	}
 
 	int avg_drift_cnt = 0, avg_drift_x = 0, avg_drift_y = 0;
 
-	for(int iy = 3; iy < TEMP_MAP_W-3; iy++)
+	for(int iy = job.act_y0; iy < job.act_y1; iy++)
 	{
-		for(int ix = 3; ix < TEMP_MAP_W-3; ix++)
+		int uy = written_uy0 + iy;
+		int wy = uy - win_uy0;
+
+		for(int ix = job.act_x0; ix < job.act_x1; ix++)
 		{
-			int x_mm = (rotate_mid_x/MAP_UNIT_W - TEMP_MAP_MIDDLE + ix)*MAP_UNIT_W;
-			int y_mm = (rotate_mid_y/MAP_UNIT_W - TEMP_MAP_MIDDLE + iy)*MAP_UNIT_W;
-			page_coords(x_mm, y_mm, &pagex, &pagey, &offsx, &offsy);
-//			if(ix == 2 && iy == 2)
-//				printf("temp map -> map: start: page (%d, %d) offs (%d, %d)\n", pagex, pagey, offsx, offsy);
+			int ux = written_ux0 + ix;
+			int wx = ux - win_ux0;
 
 //			float ang_from_middle = atan2(y_mm-rotate_mid_y, x_mm-rotete_mid_x)*(8.0/(2.0*M_PI));
 //			if(ang_from_middle < 0.0) ang_from_middle += 8.0;
 //			int ang_idx = ang_from_middle+0.5;
 
-			int s_cnt = 0, w_cnt = 0, neigh_w_cnt = 0;
-			uint32_t tmp = temp_map[iy*TEMP_MAP_W+ix].seen; while(tmp) { s_cnt++; tmp>>=1; }
-			tmp = temp_map[iy*TEMP_MAP_W+ix].wall; while(tmp) { w_cnt++; tmp>>=1; }
+			uint8_t op = job.merge_ops[iy*TEMP_MAP_W+ix];
 
-			tmp = temp_map[(iy)*TEMP_MAP_W+(ix+1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy)*TEMP_MAP_W+(ix-1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy+1)*TEMP_MAP_W+(ix+1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy+1)*TEMP_MAP_W+(ix-1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy+1)*TEMP_MAP_W+(ix  )].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy-1)*TEMP_MAP_W+(ix+1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy-1)*TEMP_MAP_W+(ix-1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy-1)*TEMP_MAP_W+(ix  )].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
+			if(!op)
+				continue; // Nothing to write.
 
+			map_unit_ref_t u = MAP_VIEW_UNIT(view, ix-3, iy-3);
 
-			if(w_cnt > 3) // A wall is very clearly here.
+			if(op & MERGE_WALL)
 			{
-				int px = pagex, py = pagey;
-
-				int copy_px = px - copy_pagex_start;
-				int copy_py = py - copy_pagey_start;
-
-				if(copy_px < 0 || copy_px > 2 || copy_py < 0 || copy_py > 2 || (copy_px == 0 && offsx < 3) || (copy_py == 0 && offsy < 3) ||
-				   (copy_px == 2 && offsx > MAP_PAGE_W-4) || (copy_py == 2 && offsy > MAP_PAGE_W-4))
+				if(wx < 3 || wx > BATCH_WIN_W-4 || wy < 3 || wy > BATCH_WIN_W-4)
 				{
-					printf("ERROR: invalid copy_px (%d) and/or copy_py (%d)\n", copy_px, copy_py);
-					free(temp_map);
+					printf("ERROR: invalid window coords (%d, %d)\n", wx, wy);
 					return -3;
 				}
 
 				int found = 0;
 				for(int i=0; i<25; i++)
 				{
-					px = pagex;
-					py = pagey;
-					int ox = offsx+search_order[i][0];
-					int oy = offsy+search_order[i][1];
-
-					if(ox >= MAP_PAGE_W) {ox-=MAP_PAGE_W; px++;}
-					else if(ox < 0) {ox+=MAP_PAGE_W; px--;}
-					if(oy >= MAP_PAGE_W) {oy-=MAP_PAGE_W; py++;}
-					else if(oy < 0) {oy+=MAP_PAGE_W; py--;}
+					int nx = ix+search_order[i][0];
+					int ny = iy+search_order[i][1];
+					map_unit_ref_t nu = MAP_VIEW_UNIT(view, nx-3, ny-3);
 
-					copy_px = px - copy_pagex_start;
-					copy_py = py - copy_pagey_start;
+					int nwx = wx+search_order[i][0];
+					int nwy = wy+search_order[i][1];
 
-					if((copies[copy_px][copy_py].units[ox][oy].num_obstacles))
+					if(pre_batch_obstacles(nu, nwx, nwy))
 					{
-						if(!spot_used[copy_px][copy_py][ox][oy])
+						if(batch_overlay[nwx][nwy].used_gen != batch_gen)
 						{
 							avg_drift_cnt++;
 							avg_drift_x += search_order[i][0];
 							avg_drift_y += search_order[i][1];
 
 							// Existing wall here, it suffices, increase the seen count.
-							PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_seen);
-							PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_obstacles);
+							PLUS_SAT_255(MU(nu, num_seen));
+							batch_save_obstacles(nu, nwx, nwy);
+							plus_obstacles(w, nu, written_ux0+nx, written_uy0+ny);
 
-							//if(w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles > 2)
-								w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_WALL;
+							//if(MU(u, num_obstacles) > 2)
+								MU(u, result) |= UNIT_WALL;
 
-							spot_used[copy_px][copy_py][ox][oy] = 1;
-							w->changed[px][py] = 1;
+							batch_overlay[nwx][nwy].used_gen = batch_gen;
+							w->changed[(written_ux0+nx)/MAP_PAGE_W][(written_uy0+ny)/MAP_PAGE_W] = 1;
 							found = 1;
 							break;
 						}
@@ -922,68 +2439,352 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 				if(!found)
 				{
 					// We have a new wall.
-					w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_MAPPED;
+					MU(u, result) |= UNIT_MAPPED;
 
 					// If the area is basically unmapped, just decide that the new wall is actually a wall, right away.
 					// For mapped areas, UNIT_WALL is not set right away to avoid moving people etc. being count as walls.
-					if(w->pages[pagex][pagey]->units[offsx][offsy].num_seen < 2)
-						w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_WALL;
+					if(MU(u, num_seen) < 2)
+						MU(u, result) |= UNIT_WALL;
+
+					batch_save_obstacles(u, wx, wy);
+					plus_obstacles(w, u, ux, uy);
+					PLUS_SAT_255(MU(u, num_seen));
+					w->changed[ux/MAP_PAGE_W][uy/MAP_PAGE_W] = 1;
+				}
+			}
+
+			if(op & MERGE_SEEN)
+			{
+				// We don't have a wall, but we mapped this unit nevertheless.
+				MU(u, result) |= UNIT_MAPPED;
+				PLUS_SAT_255(MU(u, num_seen));
 
-					PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles);
-					PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_seen);
-					w->changed[pagex][pagey] = 1;
+				batch_save_obstacles(u, wx, wy);
+				minus_obstacles(w, u, ux, uy);
+
+				if(
+				   ( (op & MERGE_SEEN_SURE) && // we are quite sure:
+				   ((int)MU(u, num_seen) > (2*(int)MU(u, num_obstacles) + 3)))
+				   || ((op & MERGE_FEW_NEIGH) &&  // there is 1 wall neighbor, so we are not so sure, but do it eventually.
+				   ((int)MU(u, num_seen) > (5*(int)MU(u, num_obstacles) + 10))))
+				{
+					// Wall has vanished
+					MU(u, result) &= ~(UNIT_WALL);
 				}
+
+				w->changed[ux/MAP_PAGE_W][uy/MAP_PAGE_W] = 1;
 			}
+		}
+	}
+
+	map_units_changed(w, written_ux0, written_uy0, written_ux0+TEMP_MAP_W-1, written_uy0+TEMP_MAP_W-1);
+
+	if(avg_drift_cnt > 50)
+	{
+		*after_dx = (avg_drift_x*MAP_UNIT_W)/avg_drift_cnt;
+		*after_dy = (avg_drift_y*MAP_UNIT_W)/avg_drift_cnt;
+	}
+
+//	printf("Average adjustment during map insertion: x=%d mm, y=%d mm (%d samples)\n", *after_dx, *after_dy, avg_drift_cnt);
+
+
+	return 0;
+}
+
+void lidars_avg_midpoint(int n_lidars, lidar_scan_t** lidar_list, int32_t* mid_x, int32_t* mid_y)
+{
+	int64_t x = 0;
+	int64_t y = 0;
+	for(int l=0; l<n_lidars; l++)
+	{
+		lidar_scan_t* lid = lidar_list[l];
+		x += lid->robot_pos.x;
+		y += lid->robot_pos.y;
+	}
+
+	*mid_x = x / n_lidars;
+	*mid_y = y / n_lidars;
+}
+
+/*
+	Keyframe selection for the significant lidar scans. parse_uart_msg() marks a scan significant after
+	50 mm or 15 degrees of movement; while creeping through an already mapped area, most of those scans
+	show nothing new. A scan is new if enough of its points hit units not yet seen as walls, or the rays
+	go through unmapped area. Redundant scans are still kept after KEYFRAME_MAX_DIST / KEYFRAME_MAX_ANG
+	of movement, so that localization keeps going. Without mapping_2d, nothing is new, so all scans are kept.
+*/
+
+#define KEYFRAME_POINT_STEP 2          // Check every n:th point
+#define KEYFRAME_NEW_PERCENT 8         // Percentage of new points needed
+#define KEYFRAME_MAX_DIST 200          // mm
+#define KEYFRAME_MAX_ANG (20*ANG_1_DEG)
+
+static int unit_result(world_t* w, int mm_x, int mm_y)
+{
+	int px, py, ox, oy;
+	page_coords(mm_x, mm_y, &px, &py, &ox, &oy);
+	if(!w->pages[px][py])
+		return 0;
+	return MU(MAP_UNIT(w->pages[px][py], ox, oy), result);
+}
+
+static int wall_near(world_t* w, int mm_x, int mm_y)
+{
+	for(int iy=-1; iy<=1; iy++)
+		for(int ix=-1; ix<=1; ix++)
+			if(unit_result(w, mm_x + ix*MAP_UNIT_W, mm_y + iy*MAP_UNIT_W) & UNIT_WALL)
+				return 1;
+	return 0;
+}
+
+int lidar_is_keyframe(world_t* w, lidar_scan_t* lid)
+{
+	static pos_t last_kf_pos;
+	static int have_last_kf;
+	static int n_checked, n_dropped;
+
+	n_checked++;
+
+	int32_t da = lid->robot_pos.ang - last_kf_pos.ang;
+	int dx = lid->robot_pos.x - last_kf_pos.x;
+	int dy = lid->robot_pos.y - last_kf_pos.y;
+
+	int keep = !state_vect.v.mapping_2d || !have_last_kf ||
+		da > KEYFRAME_MAX_ANG || da < -KEYFRAME_MAX_ANG || sq(dx)+sq(dy) > sq(KEYFRAME_MAX_DIST);
+
+	if(!keep)
+	{
+		int n_pts = 0, n_new = 0;
+		for(int p = 0; p < lid->n_points; p += KEYFRAME_POINT_STEP)
+		{
+			if(!lid->scan[p].valid)
+				continue;
+
+			n_pts++;
+			int mid_x = (lid->robot_pos.x + lid->scan[p].x)/2;
+			int mid_y = (lid->robot_pos.y + lid->scan[p].y)/2;
+			if(!wall_near(w, lid->scan[p].x, lid->scan[p].y) || !(unit_result(w, mid_x, mid_y) & UNIT_MAPPED))
+				n_new++;
+		}
+
+		keep = n_new*100 >= n_pts*KEYFRAME_NEW_PERCENT;
+	}
+
+	if(keep)
+	{
+		last_kf_pos = lid->robot_pos;
+		have_last_kf = 1;
+	}
+	else
+		n_dropped++;
+
+	if(n_checked >= 200)
+	{
+		printf("Info: keyframe selection dropped %d of %d significant lidar scans\n", n_dropped, n_checked);
+		n_checked = 0;
+		n_dropped = 0;
+	}
+
+	return keep;
+}
+
+/*
+	Mapping rate governor.
+
+	After every normal (small search area) map_lidars() call, the level goes up (wider search) if the
+	localization failed or used more than half of the search range, unless the duty cycle is already over
+	GOV_TARGET_DUTY. Over the target, or after GOV_CHEAPER_STREAK successful localizations in a row, it goes
+	down (larger, less frequent batches, narrower search).
+
+	The wider levels keep the default batch size: a smaller batch has fewer points to localize with, which
+	is the opposite of what a failing localization needs. A batch spanning too far is cut short by
+	LIDAR_BATCH_MAX_SPAN anyway.
+*/
+
+extern double subsec_timestamp();
+
+#define GOV_TARGET_DUTY 0.30
+#define GOV_CHEAPER_STREAK 10
+#define GOV_ACCEPT_SCORE 300   // Same limit as in map_lidars()
+
+static const struct
+{
+	int lidar_batch;
+	int a_range;
+	int xy_range; // Multiple of the 80 mm pass1 step
+	int tof_batch;
+} gov_levels[] =
+{
+	{6, 2, 240, 5},
+	{5, 2, 320, 4},
+	{4, 3, 400, 3}, // The earlier fixed settings
+	{4, 4, 560, 3},
+	{4, 5, 800, 3}
+};
+
+#define GOV_N_LEVELS (sizeof(gov_levels)/sizeof(gov_levels[0]))
+#define GOV_DEFAULT_LEVEL 2
+
+map_governor_t map_governor =
+{
+	.level = GOV_DEFAULT_LEVEL,
+	.lidar_batch = 4,
+	.a_range = 3,
+	.xy_range = 400,
+	.tof_batch = 3
+};
+
+static double gov_busy;            // Seconds spent mapping since the last decision
+static double gov_last_decision;
+
+static void governor_add_busy(int stage, double secs)
+{
+	gov_busy += secs;
+	map_governor.stage_ms[stage] = 0.9*map_governor.stage_ms[stage] + 0.1*secs*1000.0;
+}
+
+static void governor_set_level(int level)
+{
+	map_governor.level = level;
+	map_governor.lidar_batch = gov_levels[level].lidar_batch;
+	map_governor.a_range = gov_levels[level].a_range;
+	map_governor.xy_range = gov_levels[level].xy_range;
+	map_governor.tof_batch = gov_levels[level].tof_batch;
+}
+
+static void governor_decide(int score, int32_t corr_da, int32_t corr_dx, int32_t corr_dy)
+{
+	static int streak;
 
-			if(w_cnt == 0 && s_cnt > 3)
-			{
-				// We don't have a wall, but we mapped this unit nevertheless.
-				w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_MAPPED;
-				PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_seen);
+	double now = subsec_timestamp();
+	if(gov_last_decision > 0.0 && now > gov_last_decision)
+		map_governor.duty = 0.8*map_governor.duty + 0.2*(gov_busy/(now - gov_last_decision));
+	gov_last_decision = now;
+	gov_busy = 0.0;
 
-				MINUS_SAT_0(w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles);
+	map_governor.n_lidar_batches++;
 
-				if(
-				   ( s_cnt > 5 && neigh_w_cnt == 0 && // we are quite sure:
-				   ((int)w->pages[pagex][pagey]->units[offsx][offsy].num_seen > (2*(int)w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles + 3)))
-				   || (neigh_w_cnt < 2 &&  // there is 1 wall neighbor, so we are not so sure, but do it eventually.
-				   ((int)w->pages[pagex][pagey]->units[offsx][offsy].num_seen > (5*(int)w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles + 10))))
-				{
-					// Wall has vanished
-					w->pages[pagex][pagey]->units[offsx][offsy].result &= ~(UNIT_WALL);
-				}
+	int over_budget = map_governor.duty > GOV_TARGET_DUTY;
+	if(over_budget)
+		map_governor.n_over_budget++;
 
-				w->changed[pagex][pagey] = 1;
-			}
+	int at_edge = abs(corr_da) > map_governor.a_range*ANG_1_DEG/2 ||
+	              abs(corr_dx) > map_governor.xy_range/2 || abs(corr_dy) > map_governor.xy_range/2;
+
+	int level = map_governor.level;
+	if(score < GOV_ACCEPT_SCORE || at_edge)
+	{
+		if(score < GOV_ACCEPT_SCORE)
+			map_governor.n_rejected++;
+		else
+			map_governor.n_accepted++;
+		streak = 0;
+		if(!over_budget && level < GOV_N_LEVELS-1)
+			level++;
+	}
+	else
+	{
+		map_governor.n_accepted++;
+		streak++;
+		if((over_budget || streak >= GOV_CHEAPER_STREAK) && level > 0)
+		{
+			level--;
+			streak = 0;
 		}
 	}
 
-	if(avg_drift_cnt > 50)
+	if(level != map_governor.level)
 	{
-		*after_dx = (avg_drift_x*MAP_UNIT_W)/avg_drift_cnt;
-		*after_dy = (avg_drift_y*MAP_UNIT_W)/avg_drift_cnt;
+		if(level > map_governor.level)
+			map_governor.n_wider++;
+		else
+			map_governor.n_cheaper++;
+
+		printf("Info: mapping governor: level %d -> %d (duty %.2f, score %d)\n", map_governor.level, level, map_governor.duty, score);
+		governor_set_level(level);
 	}
+}
 
-//	printf("Average adjustment during map insertion: x=%d mm, y=%d mm (%d samples)\n", *after_dx, *after_dy, avg_drift_cnt);
+/*
+	Coarse stage of the relocalization candidate check, on the 320 mm quick maps: the most points of the batch
+	that land on a unit with a wall, over the same angle and xy window as the scoremap search around the
+	candidate, at the quick map resolution. Needs no scoremap; loads the pages around the candidate like
+	gen_scoremap() does. Returns 0 if out of memory.
+*/
+static int reloc_qmap_hits(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int32_t mid_x, int32_t mid_y,
+	reloc_candidate_t* cand)
+{
+	const int level = QMAP_LEVELS-1;
+	const int step = (2<<level); // in map units; the unit coords of the shifted points are shifted by exactly this
+	const int n_steps = 2*(960/(step*MAP_UNIT_W)) + 1;
 
+	int n_points = 0;
+	for(int l = 0; l < n_lidars; l++)
+		n_points += lidar_list[l]->n_points;
 
-	free(temp_map);
-	return 0;
-}
+	int32_t* units = arena_alloc(thread_arena(), 2*n_points*sizeof(int32_t));
+	if(!units)
+		return 0;
 
-void lidars_avg_midpoint(int n_lidars, lidar_scan_t** lidar_list, int32_t* mid_x, int32_t* mid_y)
-{
-	int64_t x = 0;
-	int64_t y = 0;
-	for(int l=0; l<n_lidars; l++)
+	int px, py, ox, oy;
+	page_coords(mid_x+cand->dx, mid_y+cand->dy, &px, &py, &ox, &oy);
+	load_25pages(w, px, py);
+
+	int best = 0;
+	for(int ia = -3; ia <= 3; ia++)
 	{
-		lidar_scan_t* lid = lidar_list[l];
-		x += lid->robot_pos.x;
-		y += lid->robot_pos.y;
-	}
+		float ang = (float)(cand->da + ia*3*ANG_1_DEG)/((float)ANG_1_DEG*360.0)*2.0*M_PI;
+		double cos_a = cos(ang);
+		double sin_a = sin(ang);
 
-	*mid_x = x / n_lidars;
-	*mid_y = y / n_lidars;
+		// Unit coords of the rotated points, at the middle of the xy window
+		int n = 0;
+		for(int l = 0; l < n_lidars; l++)
+		{
+			lidar_scan_t* lid = lidar_list[l];
+			for(int p = 0; p < lid->n_points; p++)
+			{
+				if(!lid->scan[p].valid)
+					continue;
+
+				int pre_x = lid->scan[p].x - mid_x;
+				int pre_y = lid->scan[p].y - mid_y;
+				unit_coords(mid_x + cand->dx + pre_x*cos_a + pre_y*sin_a, mid_y + cand->dy - pre_x*sin_a + pre_y*cos_a,
+					&units[2*n], &units[2*n+1]);
+				n++;
+			}
+		}
+
+		for(int ix = 0; ix < n_steps; ix++)
+		{
+			for(int iy = 0; iy < n_steps; iy++)
+			{
+				int sx = (ix-n_steps/2)*step, sy = (iy-n_steps/2)*step;
+				int hits = 0;
+				int prev_px = -1, prev_py = -1;
+				qmap_page_t* q = NULL;
+				for(int i = 0; i < n; i++)
+				{
+					int ux = units[2*i]+sx, uy = units[2*i+1]+sy;
+					if(ux < 0 || uy < 0 || ux >= MAP_W*MAP_PAGE_W || uy >= MAP_W*MAP_PAGE_W)
+						continue;
+
+					int upx = ux/MAP_PAGE_W, upy = uy/MAP_PAGE_W;
+					if(upx != prev_px || upy != prev_py)
+					{
+						q = get_qmap_page(w, upx, upy);
+						prev_px = upx; prev_py = upy;
+					}
+
+					if(q && (qmap_unit(q, level, (ux%MAP_PAGE_W)>>(level+1), (uy%MAP_PAGE_W)>>(level+1)) & UNIT_WALL))
+						hits++;
+				}
+				if(hits > best)
+					best = hits;
+			}
+		}
+	}
+	return best;
 }
 
 /*
@@ -1016,7 +2817,9 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 {
 	double time;
 
-	static int8_t scoremap[TEMP_MAP_W*TEMP_MAP_W];
+	static int8_t scoremap[TEMP_MAP_W*TEMP_MAP_W + SCOREMAP_PAD];
+
+	arena_reset(thread_arena()); // New mapping cycle, nothing from the previous one is in use.
 
 	*da = 0;
 	*dx = 0;
@@ -1063,7 +2866,20 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 
 
 	time = subsec_timestamp();
-	prefilter_lidar_list(n_lidars, lidar_list);
+	int prefilter_removed = prefilter_lidar_list(n_lidars, lidar_list);
+
+	// Pass1 scores only the downsampled copy: pass1_list.
+	lidar_scan_t* pass1_list[32];
+	int n_pass1_points = downsample_lidar_list(n_lidars, lidar_list, pass1_list);
+	if(n_pass1_points < 0)
+	{
+		printf("WARN: Out of memory downsampling for pass1, using all points\n");
+		n_pass1_points = 0;
+		for(int l=0; l<n_lidars; l++)
+			for(int p=0; p<lidar_list[l]->n_points; p++)
+				if(lidar_list[l]->scan[p].valid)
+					n_pass1_points++;
+	}
 	double prefilter_time = subsec_timestamp() - time;
 
 	double scoremap_time=0.0;
@@ -1078,30 +2894,41 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 	lidars_avg_midpoint(n_lidars, lidar_list, &mid_x, &mid_y);
 
 	int corr_da=0, corr_dx=0, corr_dy=0;
+	int relocalized = 0;
+	int big_search = state_vect.v.localize_with_big_search_area;
+	int gov_score = 0;
+	int32_t gov_da = 0, gov_dx = 0, gov_dy = 0;
 
 	if(state_vect.v.loca_2d)
 	{
-		if(state_vect.v.localize_with_big_search_area)
+		if(big_search)
 		{
 			send_info(INFO_STATE_THINK);
 		}
 
 		time = subsec_timestamp();
+		int sm_ret;
 		if(state_vect.v.localize_with_big_search_area)
 		{
 			stop_movement();
-			gen_scoremap_for_large_steps(w, scoremap, mid_x, mid_y);
+			sm_ret = gen_scoremap_for_large_steps(w, scoremap, mid_x, mid_y);
 		}
 		else
-			gen_scoremap_for_small_steps(w, scoremap, mid_x, mid_y);
+			sm_ret = gen_scoremap_for_small_steps(w, scoremap, mid_x, mid_y);
 		scoremap_time = subsec_timestamp() - time;
 
+		if(sm_ret)
+		{
+			printf("ERROR: scoremap generation failed, not mapping\n");
+			return -1;
+		}
+
 		int a_range, xy_range, xy_step, a_step;
 
 		if(state_vect.v.localize_with_big_search_area == 0)
 		{
-			a_range = 3;
-			xy_range = 400;
+			a_range = map_governor.a_range;
+			xy_range = map_governor.xy_range;
 			xy_step = 80;
 			a_step = 1*ANG_1_DEG;
 		}
@@ -1115,7 +2942,7 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 		else if(state_vect.v.localize_with_big_search_area == 2)
 		{
 			a_range = 178;
-			xy_range = 2400; // max, produces 32 steps.
+			xy_range = 4800; // about +-5 m; branch and bound search has no step count limit.
 			xy_step = 160;
 			a_step = 3*ANG_1_DEG;
 		}
@@ -1123,27 +2950,87 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 		int n_xy_steps = 2*(xy_range/xy_step) + 1;
 
 		int best_score = -999999;
-		int best1_da=0, best1_dx=0, best1_dy=0;
+		int32_t best1_da=0, best1_dx=0, best1_dy=0;
 
 		time = subsec_timestamp();
 
-		for(int ida=-1*a_range*ANG_1_DEG; ida<=a_range*ANG_1_DEG; ida+=a_step)
+		int32_t pass1_da_start = -1*a_range*ANG_1_DEG;
+		int pass1_n_da = (2*(int64_t)a_range*ANG_1_DEG)/a_step + 1;
+		if(state_vect.v.localize_with_big_search_area)
+			best_score = branch_and_bound_search(scoremap, n_lidars, pass1_list, mid_x, mid_y, pass1_da_start, a_step, pass1_n_da,
+				-1*xy_range, xy_step, n_xy_steps, -1*xy_range, xy_step, n_xy_steps, 1, &best1_da, &best1_dx, &best1_dy);
+		else
+			best_score = angle_sweep(scoremap, n_lidars, pass1_list, mid_x, mid_y, pass1_da_start, a_step, pass1_n_da,
+				-1*xy_range, xy_step, n_xy_steps, -1*xy_range, xy_step, n_xy_steps, 1, &best1_da, &best1_dx, &best1_dy);
+
+		// Scoremap (and likelihood field) middle point relative to mid_x, mid_y. Nonzero only when relocalized
+		// far away: the scoremap is then generated around the candidate, and pass2 offsets are relative to it.
+		int32_t sm_off_x = 0, sm_off_y = 0;
+
+		if(state_vect.v.localize_with_big_search_area == 2)
 		{
-			int32_t idx = 0, idy = 0;
-			int score_now = score_quick_search_xy(scoremap, n_lidars, lidar_list, mid_x, mid_y,
-				ida, -1*xy_range, xy_step, n_xy_steps, -1*xy_range, xy_step, n_xy_steps, &idx, &idy,1);
-			if(score_now > best_score)
+			/*
+				The robot may be anywhere in the map: verify the global relocalization candidates, too.
+				The pass1 score is weighed by the distance from the middle of its grid, so it can't be compared
+				with anything searched on another grid. The local winner and the candidates are compared by their
+				unweighed scores instead, each on the large step scoremap around it. The candidates tie within
+				a few percent on the coarse grid (e.g. the same room, 180 deg around), so each pose is refined
+				to 0.5 deg, 40 mm before comparing.
+			*/
+			best_score = branch_and_bound_search(scoremap, n_lidars, pass1_list, mid_x, mid_y,
+				best1_da-2*ANG_1_DEG, ANG_0_5_DEG, 9, best1_dx-120, 40, 7, best1_dy-120, 40, 7, 0, &best1_da, &best1_dx, &best1_dy);
+			printf("Local pass1 result: a=%.1fdeg, x=%dmm, y=%dmm, unweighed score=%d\n",
+				(float)best1_da/(float)ANG_1_DEG, best1_dx, best1_dy, best_score);
+
+			reloc_candidate_t cands[RELOC_MAX_CANDIDATES];
+			int n_cands = reloc_find_candidates(w, n_lidars, lidar_list, mid_x, mid_y, cands, RELOC_MAX_CANDIDATES);
+
+			// Coarse to fine: only the candidates close to the best one on the quick maps get a scoremap.
+			int qmap_hits[RELOC_MAX_CANDIDATES];
+			int best_qmap_hits = 0;
+			for(int c=0; c<n_cands; c++)
 			{
-				best_score = score_now;
-				best1_da = ida;
-				best1_dx = idx;
-				best1_dy = idy;
+				qmap_hits[c] = reloc_qmap_hits(w, n_lidars, pass1_list, mid_x, mid_y, &cands[c]);
+				if(qmap_hits[c] > best_qmap_hits)
+					best_qmap_hits = qmap_hits[c];
 			}
-		}
 
+			for(int c=0; c<n_cands; c++)
+			{
+				if(qmap_hits[c]*100 < best_qmap_hits*RELOC_QMAP_KEEP_PERCENT)
+				{
+					printf("Relocalization candidate %d: %d quick map hits of the best %d, skipped\n", c, qmap_hits[c], best_qmap_hits);
+					continue;
+				}
+
+				int32_t off_x = (cands[c].dx/MAP_UNIT_W)*MAP_UNIT_W;
+				int32_t off_y = (cands[c].dy/MAP_UNIT_W)*MAP_UNIT_W;
+				int32_t c_da, c_dx, c_dy;
+
+				if(gen_scoremap_for_large_steps(w, scoremap, mid_x+off_x, mid_y+off_y))
+					continue;
+				int score = branch_and_bound_search(scoremap, n_lidars, pass1_list, mid_x, mid_y,
+					cands[c].da-9*ANG_1_DEG, 3*ANG_1_DEG, 7, -960, 160, 13, -960, 160, 13, 0, &c_da, &c_dx, &c_dy);
+				score = branch_and_bound_search(scoremap, n_lidars, pass1_list, mid_x, mid_y,
+					c_da-2*ANG_1_DEG, ANG_0_5_DEG, 9, c_dx-120, 40, 7, c_dy-120, 40, 7, 0, &c_da, &c_dx, &c_dy);
+
+				printf("Relocalization candidate %d: a=%.1fdeg, x=%dmm, y=%dmm, score=%d (%d quick map hits)\n", c,
+					(float)c_da/(float)ANG_1_DEG, off_x+c_dx, off_y+c_dy, score, qmap_hits[c]);
+
+				if(score > best_score)
+				{
+					best_score = score;
+					best1_da = c_da; best1_dx = c_dx; best1_dy = c_dy;
+					sm_off_x = off_x; sm_off_y = off_y;
+				}
+			}
+		}
 
 		pass1_time = subsec_timestamp() - time;
 
+		// Pass2 scoremap middle point relative to mid_x+sm_off_x, mid_y+sm_off_y; pass2 offsets are relative to it.
+		int32_t p2_off_x = 0, p2_off_y = 0;
+
 		int pass2_a_range, pass2_a_step;
 		int pass2_dx_start, pass2_dx_step, pass2_num_dx, pass2_dy_start, pass2_dy_step, pass2_num_dy;
 
@@ -1161,9 +3048,21 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 		}
 		else // massive
 		{
-			printf("Pass1 complete, correction a=%.1fdeg, x=%dmm, y=%dmm, score=%d\n", (float)best1_da/(float)ANG_1_DEG, best1_dx, best1_dy, best_score);
+			printf("Pass1 complete, correction a=%.1fdeg, x=%dmm, y=%dmm, score=%d\n", (float)best1_da/(float)ANG_1_DEG, sm_off_x+best1_dx, sm_off_y+best1_dy, best_score);
+
+			// Pass1 may have moved us up to +-5 m; center the small step scoremap on its result, so that the
+			// lidar points stay inside the +-10 m scoremap.
+			p2_off_x = (best1_dx/MAP_UNIT_W)*MAP_UNIT_W;
+			p2_off_y = (best1_dy/MAP_UNIT_W)*MAP_UNIT_W;
+			best1_dx -= p2_off_x;
+			best1_dy -= p2_off_y;
 
-			gen_scoremap_for_small_steps(w, scoremap, mid_x, mid_y); // overwrite large step scoremap.
+			// Overwrite the large step scoremap.
+			if(gen_scoremap_for_small_steps(w, scoremap, mid_x+sm_off_x+p2_off_x, mid_y+sm_off_y+p2_off_y))
+			{
+				printf("ERROR: scoremap generation failed, not mapping\n");
+				return -1;
+			}
 			pass2_a_range = 8; // in half degs
 			pass2_a_step = ANG_0_5_DEG;
 			pass2_dx_start = best1_dx-200;
@@ -1174,34 +3073,61 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 			pass2_num_dy = 2*(200/20) + 1;
 		}
 
-		best_score = -999999;
-		int best2_da=0, best2_dx=0, best2_dy=0;
+		int32_t best2_da=0, best2_dx=0, best2_dy=0;
 
 		time = subsec_timestamp();
 
-
-		for(int ida=best1_da-pass2_a_range*pass2_a_step; ida<=best1_da+pass2_a_range*pass2_a_step; ida+=pass2_a_step)
+		if(map_pass2_refine == PASS2_REFINE_GAUSS_NEWTON)
 		{
-			int32_t idx = 0, idy = 0;
-			int score_now = score_quick_search_xy(scoremap, n_lidars, lidar_list, mid_x, mid_y,
-				ida, pass2_dx_start, pass2_dx_step, pass2_num_dx, pass2_dy_start, pass2_dy_step, pass2_num_dy, &idx, &idy,0);
-			if(score_now > best_score)
+			static int8_t lfield_d2[TEMP_MAP_W*TEMP_MAP_W];
+			int32_t unused_dx, unused_dy;
+
+			if(gen_likelihood_field(w, lfield_d2, mid_x+sm_off_x+p2_off_x, mid_y+sm_off_y+p2_off_y) == 0)
+			{
+				best2_da = best1_da; best2_dx = best1_dx; best2_dy = best1_dy;
+				int iters = refine_pose_gauss_newton(lfield_d2, n_lidars, lidar_list, mid_x, mid_y, &best2_da, &best2_dx, &best2_dy);
+
+				// Scores from the small step scoremap, so that the acceptance limits below mean the same as with the grid.
+				int score_pass1 = score_quick_search_xy(scoremap, n_lidars, lidar_list, mid_x, mid_y,
+					best1_da, best1_dx, 1, 1, best1_dy, 1, 1, &unused_dx, &unused_dy, 0);
+				best_score = score_quick_search_xy(scoremap, n_lidars, lidar_list, mid_x, mid_y,
+					best2_da, best2_dx, 1, 1, best2_dy, 1, 1, &unused_dx, &unused_dy, 0);
+
+				printf("Pass2 (Gauss-Newton): %d iterations, a=%.2fdeg, x=%dmm, y=%dmm, score=%d (pass1 pose score=%d)\n",
+					iters, (float)best2_da/(float)ANG_1_DEG, p2_off_x+best2_dx, p2_off_y+best2_dy, best_score, score_pass1);
+
+				if(score_pass1 > best_score)
+				{
+					best_score = score_pass1;
+					best2_da = best1_da; best2_dx = best1_dx; best2_dy = best1_dy;
+				}
+			}
+			else
 			{
-				best_score = score_now;
-				best2_da = ida;
-				best2_dx = idx;
-				best2_dy = idy;
+				best_score = angle_sweep(scoremap, n_lidars, lidar_list, mid_x, mid_y, best1_da-pass2_a_range*pass2_a_step, pass2_a_step, 2*pass2_a_range + 1,
+					pass2_dx_start, pass2_dx_step, pass2_num_dx, pass2_dy_start, pass2_dy_step, pass2_num_dy, 0, &best2_da, &best2_dx, &best2_dy);
 			}
 		}
+		else
+		{
+			best_score = angle_sweep(scoremap, n_lidars, lidar_list, mid_x, mid_y, best1_da-pass2_a_range*pass2_a_step, pass2_a_step, 2*pass2_a_range + 1,
+				pass2_dx_start, pass2_dx_step, pass2_num_dx, pass2_dy_start, pass2_dy_step, pass2_num_dy, 0, &best2_da, &best2_dx, &best2_dy);
+		}
 
 		pass2_time = subsec_timestamp() - time;
 
+		best2_dx += p2_off_x;
+		best2_dy += p2_off_y;
+
 		corr_da = best2_da;
-		corr_dx = best2_dx;
-		corr_dy = best2_dy;
+		corr_dx = sm_off_x + best2_dx;
+		corr_dy = sm_off_y + best2_dy;
 
 		printf("Map search complete, correction a=%.1fdeg, x=%dmm, y=%dmm, score=%d\n", (float)corr_da/(float)ANG_1_DEG, corr_dx, corr_dy, best_score);
 
+		gov_score = best_score;
+		gov_da = corr_da; gov_dx = corr_dx; gov_dy = corr_dy;
+
 		uint8_t success_code = 0;
 		if(best_score < 100)
 		{
@@ -1209,6 +3135,13 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 			printf("Best score very low, using zero correction.\n");
 			corr_da = 0; corr_dx = 0; corr_dy = 0;
 		}
+		else if(best_score < 300 && (sm_off_x || sm_off_y))
+		{
+			success_code = 2;
+			printf("Best score low for a relocalization far away, using zero correction.\n");
+			corr_da = 0; corr_dx = 0; corr_dy = 0;
+			sm_off_x = 0; sm_off_y = 0;
+		}
 		else if(best_score < 300)
 		{
 			success_code = 1;
@@ -1225,11 +3158,27 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 
 		tcp_send_localization_result(corr_da, corr_dx, corr_dy, success_code, best_score);
 
+		if(sm_off_x || sm_off_y)
+		{
+			// Don't map with a pose that was found just now: let the next batch confirm it with the normal search.
+			printf("Info: relocalized far away, not mapping this batch.\n");
+			relocalized = 1;
+		}
 
+		if(big_search || relocalized)
+		{
+			// The robot was lost; odometry from the earlier keyframes doesn't connect to this pose.
+			pose_graph_reset();
+		}
+		else if(map_pose_graph != POSE_GRAPH_OFF)
+		{
+			pos_t kf_pos = {lidar_list[n_lidars/2]->robot_pos.ang, mid_x, mid_y};
+			pose_graph_add_keyframe(kf_pos, best2_da, sm_off_x+best2_dx, sm_off_y+best2_dy, best_score, n_lidars, lidar_list);
+		}
 	}
 
 	int32_t aft_corr_x = 0, aft_corr_y = 0;
-	if(state_vect.v.mapping_2d)
+	if(state_vect.v.mapping_2d && !relocalized)
 	{
 
 		time = subsec_timestamp();
@@ -1239,8 +3188,16 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 		mapping_time = subsec_timestamp() - time;
 	}
 
-	printf("Performance: prefilter %.1fms scoremap %.1fms pass1 %.1fms pass2 %.1fms mapping %.1fms\n",
-		prefilter_time*1000.0, scoremap_time*1000.0, pass1_time*1000.0, pass2_time*1000.0, mapping_time*1000.0);
+	printf("Performance: prefilter %.1fms (%d pts removed, %d to pass1) scoremap %.1fms pass1 %.1fms pass2 %.1fms mapping %.1fms\n",
+		prefilter_time*1000.0, prefilter_removed, n_pass1_points, scoremap_time*1000.0, pass1_time*1000.0, pass2_time*1000.0, mapping_time*1000.0);
+
+	governor_add_busy(GOV_STAGE_PREFILTER, prefilter_time);
+	governor_add_busy(GOV_STAGE_SCOREMAP, scoremap_time);
+	governor_add_busy(GOV_STAGE_PASS1, pass1_time);
+	governor_add_busy(GOV_STAGE_PASS2, pass2_time);
+	governor_add_busy(GOV_STAGE_MAPPING, mapping_time);
+	if(state_vect.v.loca_2d && !big_search)
+		governor_decide(gov_score, gov_da, gov_dx, gov_dy);
 
 	*da = corr_da;
 	*dx = corr_dx + aft_corr_x;
@@ -1270,6 +3227,7 @@ void tofs_avg_midpoint(int n_tofs, tof3d_scan_t** tof_list, int32_t* mid_x, int3
 
 int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int32_t *my)
 {
+	double start_time = subsec_timestamp();
 //	printf("Mapping %d  3DTOF scans\n", n_tofs);
 	int32_t mid_x, mid_y;
 	tofs_avg_midpoint(n_tofs, tof_list, &mid_x, &mid_y);
@@ -1279,64 +3237,84 @@ int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int3
 	// Rotate and move 3DTOF points to absolute world coordinates, insert them into temporary (composite) map.
 	// Filter moving / unsure objects by using value closest to 0 at each point.
 
-	int8_t *drops =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *items =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *walls =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *maybes = calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *seens =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
+	arena_t* arena = thread_arena();
+	arena_reset(arena); // New mapping cycle, nothing from the previous one is in use.
+
+	int8_t *drops =  arena_calloc(arena, MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
+	int8_t *items =  arena_calloc(arena, MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
+	int8_t *walls =  arena_calloc(arena, MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
+	int8_t *maybes = arena_calloc(arena, MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
+	int8_t *seens =  arena_calloc(arena, MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
 
 	if(!drops || !items || !walls || !maybes || !seens)
 	{
 		printf("ERROR: Out of memory in map_3dtof. Not mapping.\n");
-		if(drops) free(drops);
-		if(items) free(items);
-		if(walls) free(walls);
-		if(maybes) free(maybes);
-		if(seens) free(seens);
 		return -1;
 	}
 
 	#define TOF_TEMP_MIDDLE (MAP_PAGE_W/2)
 
+	// Truncation towards zero of a 16.16 fixed point value
+	#define TRUNC_Q16(q) (((q) >= 0) ? ((q) >> 16) : -((-(q)) >> 16))
+
 	int out_of_area_ignores = 0;
+	int min_tm_x = MAP_PAGE_W, max_tm_x = -1, min_tm_y = MAP_PAGE_W, max_tm_y = -1;
 	for(int t=0; t < n_tofs; t++)
 	{
 		tof3d_scan_t* tof = tof_list[t];
-		float ang = -1*ANG32TORAD(tof->robot_pos.ang);
-		for(int iy=0; iy < TOF3D_HMAP_YSPOTS; iy++)
+		double ang = -1*ANG32TORAD(tof->robot_pos.ang);
+		double cos_a = cos(ang), sin_a = sin(ang);
+
+		/*
+			The rotation and translation is affine in the objmap cell coordinates: temp map coordinates of the
+			cell (ix, iy) are base + ix*col + iy*row, in 16.16 fixed point map units. Only the cells in the
+			objmap cell list are transformed.
+		*/
+		double pre_x0 = (double)tof->robot_pos.x - TOF3D_HMAP_XMIDDLE*TOF3D_HMAP_SPOT_SIZE - mid_x;
+		double pre_y0 = (double)tof->robot_pos.y - TOF3D_HMAP_YMIDDLE*TOF3D_HMAP_SPOT_SIZE - mid_y;
+		double q16 = 65536.0/MAP_UNIT_W;
+		int32_t base_x = lround((pre_x0*cos_a + pre_y0*sin_a)*q16);
+		int32_t base_y = lround((-1*pre_x0*sin_a + pre_y0*cos_a)*q16);
+		int32_t col_x = lround(TOF3D_HMAP_SPOT_SIZE*cos_a*q16), col_y = lround(-1*TOF3D_HMAP_SPOT_SIZE*sin_a*q16);
+		int32_t row_x = lround(TOF3D_HMAP_SPOT_SIZE*sin_a*q16), row_y = lround(TOF3D_HMAP_SPOT_SIZE*cos_a*q16);
+
+		for(int c=0; c < tof->n_objmap_cells; c++)
 		{
-			for(int ix=0; ix < TOF3D_HMAP_XSPOTS; ix++)
-			{
-				float pre_x = (float)tof->robot_pos.x + (float)(ix-TOF3D_HMAP_XMIDDLE)*(float)TOF3D_HMAP_SPOT_SIZE - (float)mid_x;
-				float pre_y = (float)tof->robot_pos.y + (float)(iy-TOF3D_HMAP_YMIDDLE)*(float)TOF3D_HMAP_SPOT_SIZE - (float)mid_y;
-				int rotax = pre_x*cos(ang) + pre_y*sin(ang);
-				int rotay = -1*pre_x*sin(ang) + pre_y*cos(ang);
+			int cell = tof->objmap_cells[c];
+			int ix = cell % TOF3D_HMAP_XSPOTS;
+			int iy = cell / TOF3D_HMAP_XSPOTS;
 
-				int tm_x = rotax/MAP_UNIT_W + TOF_TEMP_MIDDLE;
-				int tm_y = rotay/MAP_UNIT_W + TOF_TEMP_MIDDLE;
+			int32_t q_x = base_x + ix*col_x + iy*row_x;
+			int32_t q_y = base_y + ix*col_y + iy*row_y;
+			int tm_x = TRUNC_Q16(q_x) + TOF_TEMP_MIDDLE;
+			int tm_y = TRUNC_Q16(q_y) + TOF_TEMP_MIDDLE;
 
-				if(tm_x < 0 || tm_x >= MAP_PAGE_W || tm_y < 0 || tm_y >= MAP_PAGE_W)
-				{
-					out_of_area_ignores++;
-					continue;
-				}
+			if(tm_x < 0 || tm_x >= MAP_PAGE_W || tm_y < 0 || tm_y >= MAP_PAGE_W)
+			{
+				out_of_area_ignores++;
+				continue;
+			}
 
-				switch(tof->objmap[iy*TOF3D_HMAP_XSPOTS+ix])
-				{
-					case TOF3D_BIG_DROP     : drops[tm_y*MAP_PAGE_W+tm_x]++; break;
+			if(tm_x < min_tm_x) min_tm_x = tm_x;
+			if(tm_x > max_tm_x) max_tm_x = tm_x;
+			if(tm_y < min_tm_y) min_tm_y = tm_y;
+			if(tm_y > max_tm_y) max_tm_y = tm_y;
+
+			switch(tof->objmap[cell])
+			{
+				case TOF3D_BIG_DROP     : drops[tm_y*MAP_PAGE_W+tm_x]++; break;
 
-					case TOF3D_SMALL_DROP   :
-					case TOF3D_THRESHOLD    : maybes[tm_y*MAP_PAGE_W+tm_x]++; break;
+				case TOF3D_SMALL_DROP   :
+				case TOF3D_THRESHOLD    : maybes[tm_y*MAP_PAGE_W+tm_x]++; break;
 
-					case TOF3D_SMALL_ITEM   :
-					case TOF3D_BIG_ITEM     :
-					case TOF3D_LOW_CEILING  : items[tm_y*MAP_PAGE_W+tm_x]++; break;
+				case TOF3D_SMALL_ITEM   :
+				case TOF3D_BIG_ITEM     :
+				case TOF3D_LOW_CEILING  : items[tm_y*MAP_PAGE_W+tm_x]++; break;
 
-					case TOF3D_WALL         : walls[tm_y*MAP_PAGE_W+tm_x]++; break;
+				case TOF3D_WALL         : walls[tm_y*MAP_PAGE_W+tm_x]++; break;
 
-					case TOF3D_FLOOR        : seens[tm_y*MAP_PAGE_W+tm_x]++; break;
-					default: break;
-				}
+				case TOF3D_FLOOR        : seens[tm_y*MAP_PAGE_W+tm_x]++; break;
+				default: break;
 			}
 		}
 	}
@@ -1344,14 +3322,38 @@ int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int3
 	if(out_of_area_ignores > 100)
 		printf("Ignored %d far-away points not fitting to tempmap.\n", out_of_area_ignores);
 
+	if(max_tm_x < 0)
+	{
+		governor_add_busy(GOV_STAGE_3DTOF, subsec_timestamp() - start_time);
+		return 0;
+	}
+
 	// Copy tempmaps to actual map
 
-	int mid_px, mid_py, mid_ox, mid_oy;
-	page_coords(mid_x, mid_y, &mid_px, &mid_py, &mid_ox, &mid_oy);
-	load_9pages(&world, mid_px, mid_py);
+	// Temp map (ix, iy) is the unit (written_ux0+ix, written_uy0+iy). Only the pages under the written box
+	// (plus the neighbours cleared around it) are loaded, and the view covers just that box.
+	int written_ux0, written_uy0;
+	unit_coords(mid_x-TOF_TEMP_MIDDLE*MAP_UNIT_W, mid_y-TOF_TEMP_MIDDLE*MAP_UNIT_W, &written_ux0, &written_uy0);
 
-	int start_px, start_py, start_ox, start_oy;
-	page_coords(mid_x-TOF_TEMP_MIDDLE*MAP_UNIT_W, mid_y-TOF_TEMP_MIDDLE*MAP_UNIT_W, &start_px, &start_py, &start_ox, &start_oy);
+	int box_ux0 = written_ux0+min_tm_x, box_uy0 = written_uy0+min_tm_y;
+	int box_ux1 = written_ux0+max_tm_x, box_uy1 = written_uy0+max_tm_y;
+	for(int px = (box_ux0-1)/MAP_PAGE_W; px <= (box_ux1+1)/MAP_PAGE_W; px++)
+		for(int py = (box_uy0-1)/MAP_PAGE_W; py <= (box_uy1+1)/MAP_PAGE_W; py++)
+			load_1page(&world, px, py);
+
+	map_view_t* view = arena_alloc(arena, sizeof(map_view_t));
+	if(!view)
+	{
+		printf("ERROR: Out of memory in map_3dtof. Not mapping.\n");
+		return -1;
+	}
+	if(map_view_init(w, view, box_ux0, box_uy0, max_tm_x-min_tm_x+1, max_tm_y-min_tm_y+1, 1) < 0)
+		return -1;
+	if(view->n_missing)
+	{
+		printf("ERROR: map_3dtof: map pages around units (%d, %d) unallocated!\n", box_ux0, box_uy0);
+		return -1;
+	}
 
 	int cnt_drop = 0, cnt_item = 0, cnt_3dwall = 0, cnt_removal = 0, cnt_total_removal = 0;
 
@@ -1361,97 +3363,75 @@ int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int3
 	int seen_total_removal_limit = (2*n_tofs)/3+1;
 	int seen_removal_limit = 1; //n_tofs/4+1;
 
-	int py = start_py; int oy = start_oy;
-	for(int iy=0; iy < MAP_PAGE_W; iy++)
+	// All counters are zero outside the units written to above.
+	for(int iy=min_tm_y; iy <= max_tm_y; iy++)
 	{
-		int px = start_px; int ox = start_ox;
-		for(int ix=0; ix < MAP_PAGE_W; ix++)
+		int py = (written_uy0+iy)/MAP_PAGE_W;
+		for(int ix=min_tm_x; ix <= max_tm_x; ix++)
 		{
-			if(ox < 0 || ox >= MAP_PAGE_W || oy < 0 || oy >= MAP_PAGE_W || px < 0 || px >= MAP_W || py < 0 || py >= MAP_W)
-			{
-				printf("ERROR: map_3dtof: invalid page coords (page (%d, %d), offs (%d, %d))\n", px, py, ox, oy);
-				continue;
-			}
-
-			if(!w->pages[px][py])
-			{
-				printf("ERROR: map_3dtof: page (%d, %d) unallocated!\n", px, py);
-				free(drops);
-				free(items);
-				free(walls);
-				free(maybes);
-				free(seens);
-
-				return -1;
-			}
+			int px = (written_ux0+ix)/MAP_PAGE_W;
+			map_unit_ref_t u = MAP_VIEW_UNIT(view, ix-min_tm_x, iy-min_tm_y);
 
 			if(walls[iy*MAP_PAGE_W+ix] >= wall_limit)
 			{
-				if(!(w->pages[px][py]->units[ox][oy].result & UNIT_3D_WALL)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result |= UNIT_3D_WALL;
-				w->pages[px][py]->units[ox][oy].latest |= UNIT_3D_WALL;
-				PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_3d_obstacles);
+				if(!(MU(u, result) & UNIT_3D_WALL)) w->changed[px][py] = 1;
+				MU(u, result) |= UNIT_3D_WALL;
+				MU(u, latest) |= UNIT_3D_WALL;
+				PLUS_SAT_255(MU(u, num_3d_obstacles));
 				cnt_3dwall++;
 			}
 			else if(items[iy*MAP_PAGE_W+ix] >= item_limit)
 			{
-				if(!(w->pages[px][py]->units[ox][oy].result & UNIT_ITEM)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result |= UNIT_ITEM;
-				w->pages[px][py]->units[ox][oy].latest |= UNIT_ITEM;
-				PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_3d_obstacles);
+				if(!(MU(u, result) & UNIT_ITEM)) w->changed[px][py] = 1;
+				MU(u, result) |= UNIT_ITEM;
+				MU(u, latest) |= UNIT_ITEM;
+				PLUS_SAT_255(MU(u, num_3d_obstacles));
 				cnt_item++;
 			}
 			else if(drops[iy*MAP_PAGE_W+ix] >= drop_limit)
 			{
-				if(!(w->pages[px][py]->units[ox][oy].result & UNIT_DROP)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result |= UNIT_DROP;
-				w->pages[px][py]->units[ox][oy].latest |= UNIT_DROP;
-				PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_3d_obstacles);
+				if(!(MU(u, result) & UNIT_DROP)) w->changed[px][py] = 1;
+				MU(u, result) |= UNIT_DROP;
+				MU(u, latest) |= UNIT_DROP;
+				PLUS_SAT_255(MU(u, num_3d_obstacles));
 				cnt_drop++;
 			}
 			else if(seens[iy*MAP_PAGE_W+ix] >= seen_total_removal_limit && maybes[iy*MAP_PAGE_W+ix] == 0 && drops[iy*MAP_PAGE_W+ix] == 0 && items[iy*MAP_PAGE_W+ix] == 0 && walls[iy*MAP_PAGE_W+ix] == 0)
 			{
-				if(w->pages[px][py]->units[ox][oy].result & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
-				w->pages[px][py]->units[ox][oy].latest &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
-				w->pages[px][py]->units[ox][oy].num_3d_obstacles = 0;
+				if(MU(u, result) & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL)) w->changed[px][py] = 1;
+				MU(u, result) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
+				MU(u, latest) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
+				MU(u, num_3d_obstacles) = 0;
 				cnt_total_removal++;
 			}
 			else if(seens[iy*MAP_PAGE_W+ix] >= seen_removal_limit && drops[iy*MAP_PAGE_W+ix] == 0 && items[iy*MAP_PAGE_W+ix] == 0 && walls[iy*MAP_PAGE_W+ix] == 0)
 			{
-				// Clear neighbors as well. But to save time/complexity, don't go over page borders.
+				// Clear neighbors as well, also across page borders through the view (these used to be skipped,
+				// so the output differs from the pre-view code next to page borders).
 				for(int nx=-1; nx<=1; nx++)
 				{
 					for(int ny=-1; ny<=1; ny++)
 					{
-						int oxn = ox+nx; if(oxn < 0 || oxn >= MAP_PAGE_W) continue;
-						int oyn = oy+ny; if(oyn < 0 || oyn >= MAP_PAGE_W) continue;
-						if(w->pages[px][py]->units[oxn][oyn].result & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL)) w->changed[px][py] = 1;
-						w->pages[px][py]->units[oxn][oyn].result &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
-						w->pages[px][py]->units[oxn][oyn].latest &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
-						w->pages[px][py]->units[oxn][oyn].num_3d_obstacles = 0;
+						map_unit_ref_t nu = MAP_VIEW_UNIT(view, ix-min_tm_x+nx, iy-min_tm_y+ny);
+						if(MU(nu, result) & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL))
+							w->changed[(written_ux0+ix+nx)/MAP_PAGE_W][(written_uy0+iy+ny)/MAP_PAGE_W] = 1;
+						MU(nu, result) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
+						MU(nu, latest) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
+						MU(nu, num_3d_obstacles) = 0;
 						cnt_removal++;
 
 					}
 				}
 			}
-
-			ox++;
-			if(ox >= MAP_PAGE_W) { ox=0; px++;}
 		}
-
-		oy++;
-		if(oy >= MAP_PAGE_W) { oy=0; py++;}
 	}
 
-	free(drops);
-	free(items);
-	free(walls);
-	free(maybes);
-	free(seens);
+	map_units_changed(w, box_ux0-1, box_uy0-1, box_ux1+1, box_uy1+1);
+
 //	printf("3D TOF objmap inserted: added %d drops, %d items and %d 3dwalls. Cleared %d units; of which %d confidently\n", 
 //		cnt_drop, cnt_item, cnt_3dwall, cnt_removal+cnt_total_removal, cnt_total_removal);
 
+	governor_add_busy(GOV_STAGE_3DTOF, subsec_timestamp() - start_time);
 	return 0;
 }
 
@@ -1556,65 +3536,172 @@ const int robot_outline[32] =
 };
 
 
-void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, int stop_reason, int vect_valid, float vect_ang_rad)
+/*
+	Footprints of clear_within_robot() and map_collision_obstacle(), rasterized to map units ahead of time for
+	FOOTPRINT_HEADINGS headings and FOOTPRINT_SUBPOS*FOOTPRINT_SUBPOS robot positions within the map unit.
+	Same layout as the routing robot_shapes: one uint32 per x, bit (31-y) set when unit (x, y) of the window
+	is covered. The robot's unit is at (FOOTPRINT_WINDOW/2, FOOTPRINT_WINDOW/2).
+*/
+
+#define FOOTPRINT_HEADINGS 256
+#define FOOTPRINT_SUBPOS   2
+#define FOOTPRINT_WINDOW   32
+
+#define FOOTPRINT_CLEAR       0
+#define FOOTPRINT_FRONT_RIGHT 1
+#define FOOTPRINT_FRONT_LEFT  2
+#define FOOTPRINT_BACK_RIGHT  3
+#define FOOTPRINT_BACK_LEFT   4
+#define FOOTPRINT_KINDS       5
+
+static uint32_t footprints[FOOTPRINT_KINDS][FOOTPRINT_HEADINGS][FOOTPRINT_SUBPOS][FOOTPRINT_SUBPOS][FOOTPRINT_WINDOW];
+static int footprints_generated;
+
+// fx, fy: sample point relative to the robot origin, fx forward, fy to the left, in mm.
+static void footprint_point(uint32_t* fp, float ang, float sub_x, float sub_y, float fx, float fy)
 {
-	int idx_x, idx_y, offs_x, offs_y;
-	if(stop_reason == STOP_REASON_OBSTACLE_FRONT_LEFT || stop_reason == STOP_REASON_OBSTACLE_FRONT_RIGHT)
+	float x = sub_x + cos(ang)*fx - sin(ang)*fy;
+	float y = sub_y + sin(ang)*fx + cos(ang)*fy;
+	int ix = (int)floor(x/(float)MAP_UNIT_W) + FOOTPRINT_WINDOW/2;
+	int iy = (int)floor(y/(float)MAP_UNIT_W) + FOOTPRINT_WINDOW/2;
+
+	if(ix < 0 || ix >= FOOTPRINT_WINDOW || iy < 0 || iy >= FOOTPRINT_WINDOW)
 	{
-		printf("Mapping FRONT obstacle due to wheel slip.\n");
-		for(int deep=0; deep<3; deep++)
-		{
-			float x = (float)now_x + cos(ANG32TORAD(now_ang))*(float)(ORIGIN_TO_ROBOT_FRONT+20.0 + deep*40.0);
-			float y = (float)now_y + sin(ANG32TORAD(now_ang))*(float)(ORIGIN_TO_ROBOT_FRONT+20.0 + deep*40.0);
+		printf("ERROR: robot footprint doesn't fit in FOOTPRINT_WINDOW\n");
+		return;
+	}
+	fp[ix] |= 1UL<<(31-iy);
+}
 
-			// Shift the result to the right or left:
-			int32_t angle = now_ang + (uint32_t)( ((stop_reason==STOP_REASON_OBSTACLE_FRONT_RIGHT)?90:-90) *ANG_1_DEG);
+static void gen_footprints()
+{
+	int robot_xs = main_robot_xs;
+	int robot_ys = main_robot_ys;
 
-			x += cos(ANG32TORAD(angle))*(float)ASSUMED_ITEM_POS_FROM_MIDDLE_START;
-			y += sin(ANG32TORAD(angle))*(float)ASSUMED_ITEM_POS_FROM_MIDDLE_START;
+	memset(footprints, 0, sizeof(footprints));
 
-			for(int i = 0; i < ASSUMED_ITEM_NUM_STEPS; i++)
+	for(int a = 0; a < FOOTPRINT_HEADINGS; a++)
+	{
+		float ang = ((float)a*2.0*M_PI)/(float)FOOTPRINT_HEADINGS;
+		for(int sx = 0; sx < FOOTPRINT_SUBPOS; sx++)
+		{
+			for(int sy = 0; sy < FOOTPRINT_SUBPOS; sy++)
 			{
-				x += cos(ANG32TORAD(angle))*(float)ASSUMED_ITEM_STEP_SIZE;
-				y += sin(ANG32TORAD(angle))*(float)ASSUMED_ITEM_STEP_SIZE;
+				// Robot position in the middle of the sub-position range
+				float sub_x = (float)((2*sx+1)*MAP_UNIT_W)/(float)(2*FOOTPRINT_SUBPOS);
+				float sub_y = (float)((2*sy+1)*MAP_UNIT_W)/(float)(2*FOOTPRINT_SUBPOS);
 
-				page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-				load_9pages(&world, idx_x, idx_y);
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_INVISIBLE_WALL;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest |= UNIT_INVISIBLE_WALL;
-				w->changed[idx_x][idx_y] = 1;
+				// The robot rectangle, sampled on a 20 mm grid, 10 mm in from the sides
+				for(int stripe = 1; stripe < robot_xs/20 - 1; stripe++)
+				{
+					for(int i = 0; i < robot_ys/20 - 1; i++)
+					{
+						footprint_point(footprints[FOOTPRINT_CLEAR][a][sx][sy], ang, sub_x, sub_y,
+							ORIGIN_TO_ROBOT_FRONT-stripe*20, (float)robot_ys/-2.0+10.0+(float)(i+1)*20.0);
+					}
+				}
+
+				// Assumed obstacles of wheel slip stops: the right side ones are shifted by +90 degrees.
+				for(int side = -1; side <= 1; side += 2)
+				{
+					for(int deep = 0; deep < 3; deep++)
+					{
+						for(int i = 0; i < ASSUMED_ITEM_NUM_STEPS; i++)
+						{
+							footprint_point(footprints[(side>0)?FOOTPRINT_FRONT_RIGHT:FOOTPRINT_FRONT_LEFT][a][sx][sy], ang, sub_x, sub_y,
+								ORIGIN_TO_ROBOT_FRONT+20.0 + deep*40.0, side*(float)(ASSUMED_ITEM_POS_FROM_MIDDLE_START + (i+1)*ASSUMED_ITEM_STEP_SIZE));
+						}
+					}
+
+					for(int i = 0; i < 3; i++)
+					{
+						footprint_point(footprints[(side>0)?FOOTPRINT_BACK_RIGHT:FOOTPRINT_BACK_LEFT][a][sx][sy], ang, sub_x, sub_y,
+							-ARSE_OBSTACLE_BACK_LOCATION, side*((float)main_robot_ys/2.0 + (float)((i+1)*ASSUMED_ITEM_STEP_SIZE)));
+					}
+				}
 			}
 		}
 	}
 
-	else if(stop_reason == STOP_REASON_OBSTACLE_BACK_LEFT || stop_reason == STOP_REASON_OBSTACLE_BACK_RIGHT)
-	{
-		printf("Mapping BACK (ARSE) obstacle due to wheel slip.\n");
-		float x = (float)now_x + cos(ANG32TORAD(now_ang))*(float)-(float)ARSE_OBSTACLE_BACK_LOCATION;
-		float y = (float)now_y + sin(ANG32TORAD(now_ang))*(float)-(float)ARSE_OBSTACLE_BACK_LOCATION;
+	footprints_generated = 1;
+}
+
+/*
+	Finds the footprint of the given kind for the robot pose. Writes the absolute unit coords of the window corner,
+	and makes sure the pages under the window are in memory.
+*/
+static uint32_t* footprint_at(world_t* w, int kind, int32_t ang, int x, int y, int* ux0, int* uy0)
+{
+	if(!footprints_generated)
+		gen_footprints();
 
-		// Shift the result to the right or left:
-		int32_t angle = now_ang + (uint32_t)( ((stop_reason==STOP_REASON_OBSTACLE_BACK_RIGHT)?90:-90) *ANG_1_DEG);
+	int32_t fx = floor_div(x, MAP_UNIT_W), fy = floor_div(y, MAP_UNIT_W);
+	int sx = ((x - fx*MAP_UNIT_W)*FOOTPRINT_SUBPOS)/MAP_UNIT_W;
+	int sy = ((y - fy*MAP_UNIT_W)*FOOTPRINT_SUBPOS)/MAP_UNIT_W;
+	int a = (((uint32_t)ang + (1UL<<23))>>24) & (FOOTPRINT_HEADINGS-1);
 
-		x += cos(ANG32TORAD(angle))*(float)main_robot_ys/2.0;
-		y += sin(ANG32TORAD(angle))*(float)main_robot_ys/2.0;
+	*ux0 = fx + MAP_MIDDLE_UNIT - FOOTPRINT_WINDOW/2;
+	*uy0 = fy + MAP_MIDDLE_UNIT - FOOTPRINT_WINDOW/2;
 
-		for(int i = 0; i < 3; i++)
+	// The window is smaller than a page: its corners cover all the pages under it.
+	for(int cx = 0; cx <= 1; cx++)
+	{
+		for(int cy = 0; cy <= 1; cy++)
 		{
-			x += cos(ANG32TORAD(angle))*(float)ASSUMED_ITEM_STEP_SIZE;
-			y += sin(ANG32TORAD(angle))*(float)ASSUMED_ITEM_STEP_SIZE;
+			int px = (*ux0 + cx*(FOOTPRINT_WINDOW-1))/MAP_PAGE_W;
+			int py = (*uy0 + cy*(FOOTPRINT_WINDOW-1))/MAP_PAGE_W;
+			if(!w->pages[px][py])
+				load_1page(w, px, py);
+		}
+	}
 
-			page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-			load_9pages(&world, idx_x, idx_y);
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_INVISIBLE_WALL;
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest |= UNIT_INVISIBLE_WALL;
-			w->changed[idx_x][idx_y] = 1;
+	return footprints[kind][a][sx][sy];
+}
+
+static void map_footprint_obstacle(world_t* w, int kind, int32_t ang, int x, int y)
+{
+	int ux0, uy0;
+	uint32_t* fp = footprint_at(w, kind, ang, x, y, &ux0, &uy0);
+
+	for(int ix = 0; ix < FOOTPRINT_WINDOW; ix++)
+	{
+		uint32_t bits = fp[ix];
+		int ux = ux0 + ix;
+		while(bits)
+		{
+			int iy = __builtin_clz(bits);
+			bits &= ~(1UL<<(31-iy));
+			int uy = uy0 + iy;
+
+			int px = ux/MAP_PAGE_W, py = uy/MAP_PAGE_W;
+			map_unit_ref_t u = MAP_UNIT(w->pages[px][py], ux%MAP_PAGE_W, uy%MAP_PAGE_W);
+			MU(u, result) |= UNIT_INVISIBLE_WALL;
+			MU(u, latest) |= UNIT_INVISIBLE_WALL;
+			w->changed[px][py] = 1;
 		}
 	}
 
+	map_units_changed(w, ux0, uy0, ux0+FOOTPRINT_WINDOW-1, uy0+FOOTPRINT_WINDOW-1);
+}
+
+void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, int stop_reason, int vect_valid, float vect_ang_rad)
+{
+	if(stop_reason == STOP_REASON_OBSTACLE_FRONT_LEFT || stop_reason == STOP_REASON_OBSTACLE_FRONT_RIGHT)
+	{
+		printf("Mapping FRONT obstacle due to wheel slip.\n");
+		map_footprint_obstacle(w, (stop_reason==STOP_REASON_OBSTACLE_FRONT_RIGHT)?FOOTPRINT_FRONT_RIGHT:FOOTPRINT_FRONT_LEFT, now_ang, now_x, now_y);
+	}
+
+	else if(stop_reason == STOP_REASON_OBSTACLE_BACK_LEFT || stop_reason == STOP_REASON_OBSTACLE_BACK_RIGHT)
+	{
+		printf("Mapping BACK (ARSE) obstacle due to wheel slip.\n");
+		map_footprint_obstacle(w, (stop_reason==STOP_REASON_OBSTACLE_BACK_RIGHT)?FOOTPRINT_BACK_RIGHT:FOOTPRINT_BACK_LEFT, now_ang, now_x, now_y);
+	}
+
 	else if(stop_reason == STOP_REASON_JERK)
 	{
-/*		printf("Mapping obstacle due to acceleration (ang = %.0f).\n", RADTODEG(vect_ang_rad));
+/*		int idx_x, idx_y, offs_x, offs_y;
+		printf("Mapping obstacle due to acceleration (ang = %.0f).\n", RADTODEG(vect_ang_rad));
 		for(int i=-2; i<=2; i++)
 		{
 			int idx = 32.0*vect_ang_rad/(2.0*M_PI);
@@ -1629,10 +3716,10 @@ void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, i
 
 				page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
 				load_9pages(&world, idx_x, idx_y);
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
-				PLUS_SAT_255(world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_obstacles);
-				PLUS_SAT_255(world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_obstacles);
+				MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), result) |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
+				MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), latest) |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
+				PLUS_SAT_255(MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), num_obstacles));
+				PLUS_SAT_255(MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), num_obstacles));
 				w->changed[idx_x][idx_y] = 1;
 			}
 		} */
@@ -1647,42 +3734,36 @@ void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, i
 
 void clear_within_robot(world_t* w, pos_t pos)
 {
-	int idx_x, idx_y, offs_x, offs_y;
-	int robot_xs = main_robot_xs;
-	int robot_ys = main_robot_ys;
-	for(int stripe = 1; stripe < robot_xs/20 - 1; stripe++)
-	{
-		float x = (float)pos.x + cos(ANG32TORAD(pos.ang))*(float)(ORIGIN_TO_ROBOT_FRONT-stripe*20);
-		float y = (float)pos.y + sin(ANG32TORAD(pos.ang))*(float)(ORIGIN_TO_ROBOT_FRONT-stripe*20);
+	int ux0, uy0;
+	uint32_t* fp = footprint_at(w, FOOTPRINT_CLEAR, pos.ang, pos.x, pos.y, &ux0, &uy0);
+	int changed = 0;
 
-		// Shift the result in robot_y direction
-		int32_t angle = pos.ang + (uint32_t)(90*ANG_1_DEG);
-
-		x += cos(ANG32TORAD(angle))*((float)robot_ys/-2.0+10);
-		y += sin(ANG32TORAD(angle))*((float)robot_ys/-2.0+10);
-
-		for(int i = 0; i < robot_ys/20 - 1; i++)
+	for(int ix = 0; ix < FOOTPRINT_WINDOW; ix++)
+	{
+		uint32_t bits = fp[ix];
+		int ux = ux0 + ix;
+		while(bits)
 		{
-			x += cos(ANG32TORAD(angle))*(float)20.0;
-			y += sin(ANG32TORAD(angle))*(float)20.0;
+			int iy = __builtin_clz(bits);
+			bits &= ~(1UL<<(31-iy));
+			int uy = uy0 + iy;
 
-			page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-			load_1page(&world, idx_x, idx_y);
-			if((world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_WALL) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_ITEM) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_INVISIBLE_WALL) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_3D_WALL) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_DROP) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_ITEM) )
-			{
-				MINUS_SAT_0(world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_obstacles);
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_3d_obstacles = 0;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].result = UNIT_MAPPED;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest = UNIT_MAPPED;
-				w->changed[idx_x][idx_y] = 1;
+			int px = ux/MAP_PAGE_W, py = uy/MAP_PAGE_W, ox = ux%MAP_PAGE_W, oy = uy%MAP_PAGE_W;
+			map_unit_ref_t u = MAP_UNIT(w->pages[px][py], ox, oy);
+			if(MU(u, result) & (UNIT_WALL | UNIT_ITEM | UNIT_INVISIBLE_WALL | UNIT_3D_WALL | UNIT_DROP))
+			{
+				minus_obstacles(w, u, ux, uy);
+				MU(u, num_3d_obstacles) = 0;
+				MU(u, result) = UNIT_MAPPED;
+				MU(u, latest) = UNIT_MAPPED;
+				w->changed[px][py] = 1;
+				changed = 1;
 			}
 		}
 	}
+
+	if(changed)
+		map_units_changed(w, ux0, uy0, ux0+FOOTPRINT_WINDOW-1, uy0+FOOTPRINT_WINDOW-1);
 }
 
 
@@ -1696,7 +3777,8 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 		{
 			//printf("Mapping a sonar item at (%d, %d) z=%d c=%d\n", p_sonars[i].x, p_sonars[i].y, p_sonars[i].z, p_sonars[i].c);
 			page_coords(p_sonars[i].x,p_sonars[i].y, &idx_x, &idx_y, &offs_x, &offs_y);
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_ITEM;
+			MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), result) |= UNIT_ITEM;
+			map_units_changed(w, idx_x*MAP_PAGE_W+offs_x, idx_y*MAP_PAGE_W+offs_y, idx_x*MAP_PAGE_W+offs_x, idx_y*MAP_PAGE_W+offs_y);
 		}
 	}
 
@@ -1745,7 +3827,7 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 					{	
 						page_coords(x+ix,y+iy, &idx_x, &idx_y, &offs_x, &offs_y);
 						load_9pages(&world, idx_x, idx_y);
-						world.pages[idx_x][idx_y]->units[offs_x][offs_y].result &= ~(UNIT_ITEM);
+						MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), result) &= ~(UNIT_ITEM);
 					}
 				}
 
@@ -1771,7 +3853,7 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 			page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
 			load_9pages(&world, idx_x, idx_y);
 
-			if(world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_ITEM)
+			if(MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), result) & UNIT_ITEM)
 			{
 //				printf("Item already mapped\n");
 				goto ALREADY_MAPPED_ITEM;
@@ -1786,7 +3868,7 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 		if(sqdist < sq(1500))
 		{
 			page_coords(p_son->scan[i].x,p_son->scan[i].y, &idx_x, &idx_y, &offs_x, &offs_y);
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_ITEM;
+			MU(MAP_UNIT(world.pages[idx_x][idx_y], offs_x, offs_y), result) |= UNIT_ITEM;
 //			printf("Mapping an item\n");
 			//world.changed[idx_x][idx_y] = 1;
 		}
@@ -1805,32 +3887,16 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 
 int unfamiliarity_score(world_t* w, int x, int y)
 {
-	int n_walls = 0;
-	int n_seen = 0;
-	int n_visited = 1; // to avoid div per zero
-	for(int xx = x - 400; xx <= x + 400; xx += 40)
-	{
-		for(int yy = y - 400; yy <= y + 400; yy += 40)
-		{
-			int px, py, ox, oy;
-			page_coords(xx,yy, &px, &py, &ox, &oy);
-
-			if(w->pages[px][py])
-			{
-				if(w->pages[px][py]->units[ox][oy].result & UNIT_WALL) n_walls++;
-				if(n_walls > 1)
-					return 0;
-				n_seen += w->pages[px][py]->units[ox][oy].num_seen;
-				n_visited += w->pages[px][py]->units[ox][oy].num_visited;
-			}
+	int ux, uy;
+	unit_coords(x, y, &ux, &uy);
 
-		}
-	}
+	map_stats_t st;
+	map_stats_rect(w, ux-10, uy-10, ux+10, uy+10, &st);
 
-	if(n_seen < 5)
+	if(st.walls > 1 || st.seen < 5)
 		return 0;
 
-	return 1000000/n_visited;
+	return 1000000/(st.visited+1); // +1 to avoid div per zero
 }
 
 typedef struct
@@ -1864,6 +3930,16 @@ void add_cant_goto_place(int x, int y)
 	}
 }
 
+static int near_cant_goto_place(int32_t x, int32_t y)
+{
+	for(int i = 0; i < CANT_GOTO_PLACE_LIST_LEN; i++)
+	{
+		if(cant_goto_places[i].enabled && (sq(cant_goto_places[i].x-x)+sq(cant_goto_places[i].y-y)) < sq(500) )
+			return 1;
+	}
+	return 0;
+}
+
 int find_unfamiliar_direction(world_t* w, int *x_out, int *y_out)
 {
 	int biggest = 0;
@@ -2111,9 +4187,19 @@ void autofsm()
 
 			daiju_mode(0);
 
-			int unfam_score = find_unfamiliar_direction_randomly(&world, &desired_x, &desired_y);
+			frontier_goal_t frontier;
+			int unfam_score = 0;
 
-			if(unfam_score)
+			if(find_frontier_goal(&world, cur_x, cur_y, near_cant_goto_place, &frontier))
+			{
+				desired_x = frontier.x;
+				desired_y = frontier.y;
+				same_dir_len = 10;
+				printf("Generated new desired vector abs (%d, %d) mm towards a frontier of %d mm, route %d mm (best of %d), time to follow = %d\n",
+					desired_x, desired_y, frontier.length, frontier.route_len, frontier.n_clusters, same_dir_len);
+				if(tcp_client_sock >= 0) tcp_send_dbgpoint(desired_x, desired_y, 0, 255, 40, 0);
+			}
+			else if((unfam_score = find_unfamiliar_direction_randomly(&world, &desired_x, &desired_y)))
 			{
 				same_dir_len = 10;
 				printf("Generated new desired vector abs (%d, %d) mm based on unfamiliarity score %d, time to follow = %d\n", desired_x, desired_y, unfam_score, same_dir_len);
@@ -2324,7 +4410,7 @@ void add_map_constraint(world_t* w, int32_t x, int32_t y)
 	int px, py, ox, oy;
 	page_coords(x, y, &px, &py, &ox, &oy);
 	load_1page(w, px, py);
-	w->pages[px][py]->units[ox][oy].constraints |= CONSTRAINT_FORBIDDEN;
+	MU(MAP_UNIT(w->pages[px][py], ox, oy), constraints) |= CONSTRAINT_FORBIDDEN;
 	w->changed[px][py] = 1;
 }
 
@@ -2333,6 +4419,6 @@ void remove_map_constraint(world_t* w, int32_t x, int32_t y)
 	int px, py, ox, oy;
 	page_coords(x, y, &px, &py, &ox, &oy);
 	load_1page(w, px, py);
-	w->pages[px][py]->units[ox][oy].constraints &= ~(CONSTRAINT_FORBIDDEN);
+	MU(MAP_UNIT(w->pages[px][py], ox, oy), constraints) &= ~(CONSTRAINT_FORBIDDEN);
 	w->changed[px][py] = 1;
 }
@@ -82,22 +82,75 @@ To satisfy these conditions, map pages are stored/retrieved to/from the disk eve
 
 /*
 Quick map only holds the mapping result byte, and with half*half resolution; 1 map page will be 16Kbytes instead of 0.5Mbytes.
+Two coarser levels (160 mm and 320 mm) are kept on top of it, making a 21.5Kbyte pyramid per page. Every quick map unit is
+the OR of the result bytes it covers, so a bit set at a coarse level means it's set somewhere below.
+
+Quick maps are caches of the map pages: they are recalculated per QMAP_TILE_W*QMAP_TILE_W tile of map units when dirty,
+on the next access through get_qmap_page(). Like the pages, they are only accessed from the mapping thread.
 */
 
 #define QMAP_UNIT_W 80 // in mm
 #define QMAP_PAGE_W 128
 #define QMAP_PAGE_W_MM (QMAP_UNIT_W * QMAP_PAGE_W)
+#define QMAP_LEVELS 3  // 80, 160, 320 mm
+
+#define QMAP_TILE_W 32 // in map units
+#define QMAP_TILES (MAP_PAGE_W/QMAP_TILE_W)
+
+
+/*
+Page layout. By default, a page is a 2D array of map_unit_t. With MAP_PAGE_SOA defined (see the makefile), every field
+is stored in its own MAP_PAGE_W*MAP_PAGE_W byte plane instead, so that the passes reading only one or two fields
+(routing pages, scoremaps, quick maps, statistics) don't pull the whole 8-byte unit through the cache.
+Map files are always in the map_unit_t layout; map_memdisk.c converts.
+
+Code outside the layout uses unit references: MAP_UNIT(page, ox, oy) is a map_unit_ref_t, and MU(u, field) the field
+of the unit, as an lvalue. u+n is the unit n steps forward in y within the same page, in both layouts.
+MU_STRIDE is the distance in bytes between the same field of u and u+1.
+*/
+#ifdef MAP_PAGE_SOA
+
+#define MU_PLANE_result           0
+#define MU_PLANE_latest           1
+#define MU_PLANE_timestamp        2
+#define MU_PLANE_num_visited      3
+#define MU_PLANE_num_seen         4
+#define MU_PLANE_num_obstacles    5
+#define MU_PLANE_constraints      6
+#define MU_PLANE_num_3d_obstacles 7
+#define MU_PLANES                 8
+
+typedef struct
+{
+	uint8_t planes[MU_PLANES][MAP_PAGE_W][MAP_PAGE_W];
+} map_page_t;
+
+typedef uint8_t* map_unit_ref_t;
+#define MAP_UNIT(p, ox, oy) (&(p)->planes[0][ox][oy])
+#define MU(u, field) ((u)[MU_PLANE_##field*MAP_PAGE_W*MAP_PAGE_W])
+#define MU_STRIDE 1
 
+#else
 
 typedef struct
 {
 	map_unit_t units[MAP_PAGE_W][MAP_PAGE_W];
 } map_page_t;
 
+typedef map_unit_t* map_unit_ref_t;
+#define MAP_UNIT(p, ox, oy) (&(p)->units[ox][oy])
+#define MU(u, field) ((u)->field)
+#define MU_STRIDE ((int)sizeof(map_unit_t))
+
+#endif
+
 
 typedef struct
 {
 	uint8_t units[QMAP_PAGE_W][QMAP_PAGE_W];
+	uint8_t units2[QMAP_PAGE_W/2][QMAP_PAGE_W/2];
+	uint8_t units4[QMAP_PAGE_W/4][QMAP_PAGE_W/4];
+	uint8_t dirty[QMAP_TILES][QMAP_TILES];
 } qmap_page_t;
 
 
@@ -112,6 +165,88 @@ typedef union
 } routing_page_t;
 
 
+/*
+	Score pages (for optimization purposes only) cache the localization scoremaps per map page, so that
+	building the scoremap around the robot is mostly copying. The value of a unit depends on num_obstacles
+	of the unit and its neighbors within SCORE_MAX_RADIUS. Dirty flags are kept per SCORE_TILE_W*SCORE_TILE_W
+	tile, one bit per scoremap kind. Stored y-major (score[kind][y][x]), like the scoremap rows.
+
+	SCORE_LFIELD is not a scoremap but the squared distance (in units^2) to the nearest obstacle, for the
+	Gauss-Newton pass2 likelihood field. Distances beyond SCORE_MAX_RADIUS are stored as LFIELD_D2_FAR.
+*/
+
+#define SCORE_SMALL_STEPS 0
+#define SCORE_LARGE_STEPS 1
+#define SCORE_LFIELD      2
+#define SCORE_N_KINDS     3
+#define SCORE_MAX_RADIUS  5
+
+#define LFIELD_D2_FAR (SCORE_MAX_RADIUS*SCORE_MAX_RADIUS+1)
+
+#define SCORE_TILE_W 32
+#define SCORE_TILES (MAP_PAGE_W/SCORE_TILE_W)
+
+// num_obstacles values at and above this all give the maximum score, so changes there don't invalidate anything.
+#define SCORE_SATURATION_OBSTACLES 32
+
+typedef struct
+{
+	int8_t score[SCORE_N_KINDS][MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t dirty[SCORE_TILES][SCORE_TILES];
+} score_page_t;
+
+
+/*
+	Statistics pages (for optimization purposes only) hold summed-area tables of a map page, at the
+	resolution of STATS_CELL_W*STATS_CELL_W cells of units: element [x][y] is the sum over cells [0..x][0..y].
+	map_stats_rect() takes the whole cells from the tables, and counts the units of the partially covered
+	edge cells directly, so the results stay exact. At unit resolution, the tables would take 1 MB per page;
+	per cell, they take 64 KB. Rebuilt as a whole when dirty, on the next map_stats_rect() touching the page.
+*/
+
+#define STATS_CELL_W 4
+#define STATS_CELLS (MAP_PAGE_W/STATS_CELL_W)
+
+typedef struct
+{
+	uint32_t visited[STATS_CELLS][STATS_CELLS]; // num_visited
+	uint32_t seen[STATS_CELLS][STATS_CELLS];    // num_seen
+	uint32_t walls[STATS_CELLS][STATS_CELLS];   // Units with UNIT_WALL
+	uint32_t items[STATS_CELLS][STATS_CELLS];   // Units with UNIT_ITEM
+	int dirty;
+} stats_page_t;
+
+typedef struct
+{
+	uint32_t visited;
+	uint32_t seen;
+	uint32_t walls;
+	uint32_t items;
+} map_stats_t;
+
+
+/*
+	Frontier pages (for optimization purposes only) summarize a map page for exploration, one byte per
+	FRONTIER_CELL_W*FRONTIER_CELL_W cell of units. Recalculated per FRONTIER_TILE_W*FRONTIER_TILE_W tile
+	when dirty; see frontier.h.
+*/
+
+#define FRONTIER_CELL_W 4
+#define FRONTIER_CELLS (MAP_PAGE_W/FRONTIER_CELL_W)
+#define FRONTIER_TILE_W 32
+#define FRONTIER_TILES (MAP_PAGE_W/FRONTIER_TILE_W)
+
+#define FRONTIER_CELL_KNOWN    (1<<0) // Some unit of the cell is mapped
+#define FRONTIER_CELL_BLOCKED  (1<<1) // Some unit of the cell is an obstacle
+#define FRONTIER_CELL_FRONTIER (1<<2) // Some mapped free unit of the cell is next to an unmapped one
+
+typedef struct
+{
+	uint8_t cell[FRONTIER_CELLS][FRONTIER_CELLS]; // [x][y], like the units
+	uint8_t dirty[FRONTIER_TILES][FRONTIER_TILES];
+} frontier_page_t;
+
+
 /*
 world_t is one continuously mappable entity. There can be several worlds, but the worlds cannot overlap;
 in case they would, they should be combined.
@@ -139,6 +274,9 @@ typedef struct
 	uint8_t changed[MAP_W][MAP_W];
 	qmap_page_t* qpages[MAP_W][MAP_W];
 	routing_page_t* rpages[MAP_W][MAP_W];
+	score_page_t* spages[MAP_W][MAP_W];
+	frontier_page_t* fpages[MAP_W][MAP_W];
+	stats_page_t* stpages[MAP_W][MAP_W];
 } world_t;
 
 void page_coords(int mm_x, int mm_y, int* pageidx_x, int* pageidx_y, int* pageoffs_x, int* pageoffs_y);
@@ -146,8 +284,120 @@ void unit_coords(int mm_x, int mm_y, int* unit_x, int* unit_y);
 void mm_from_unit_coords(int unit_x, int unit_y, int* mm_x, int* mm_y);
 void page_coords_from_unit_coords(int unit_x, int unit_y, int* pageidx_x, int* pageidx_y, int* pageoffs_x, int* pageoffs_y);
 
+/*
+	Map view: a window of units, plus halo units on every side, addressed with plain (x, y) coordinates relative
+	to the window corner; the halo is at negative x, y and at x >= w, y >= h. Built once per window from the page
+	pointers, so the kernels walking over page borders do one small table lookup per access instead of
+	page_coords() arithmetic. Pages not in memory read as all-zero units from map_view_empty_page; writing kernels
+	must check n_missing == 0 first.
+*/
+#define MAP_VIEW_MAX_W 520       // Window width plus halos, in units
+#define MAP_VIEW_MAX_PAGE_ROWS 4 // Enough for MAP_VIEW_MAX_W-high windows at any alignment
+
+typedef struct
+{
+	int unit_x0, unit_y0; // Absolute unit coords of the window corner (halo excluded)
+	int w, h, halo;
+	int y_offs;           // unit_y0 - first unit of the page row the top halo starts in
+	int n_missing;        // Number of page columns in the window not in memory
+	map_unit_ref_t cols[MAP_VIEW_MAX_W][MAP_VIEW_MAX_PAGE_ROWS]; // [x+halo][page row]: start of the column within the page
+} map_view_t;
+
+extern map_page_t map_view_empty_page;
+
+#define MAP_VIEW_COL(v, x, y) ((v)->cols[(x)+(v)->halo][(unsigned)((y)+(v)->y_offs)/MAP_PAGE_W])
+#define MAP_VIEW_UNIT(v, x, y) (MAP_VIEW_COL(v, x, y) + (unsigned)((y)+(v)->y_offs)%MAP_PAGE_W)
+#define MAP_VIEW_LOADED(v, x, y) (MAP_VIEW_COL(v, x, y) != MAP_UNIT(&map_view_empty_page, 0, 0))
+
+// Returns 0 on success, -1 if the window doesn't fit in map_view_t.
+int map_view_init(world_t* w, map_view_t* v, int unit_x0, int unit_y0, int wid, int hei, int halo);
+
+// Marks the cached scoremap tiles depending on the given unit rectangle (absolute unit coords, inclusive) dirty.
+void invalidate_scoremaps(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1);
+
+/*
+	Call after changing the result bytes or the seen / visited counters of the given unit rectangle (absolute
+	unit coords, inclusive). Marks the cached data depending on them dirty: frontier pages, statistics pages
+	and quick maps. (Scoremaps depend on num_obstacles only, and are invalidated where it changes.)
+*/
+void map_units_changed(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1);
+
+// Marks the statistics pages overlapping the given unit rectangle (absolute unit coords, inclusive) dirty.
+void invalidate_map_stats(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1);
+
+// Marks the quick map tiles overlapping the given unit rectangle (absolute unit coords, inclusive) dirty.
+void invalidate_qmaps(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1);
+
+// Returns the up-to-date quick map pyramid of a page in memory, or NULL if the page isn't in memory.
+qmap_page_t* get_qmap_page(world_t* w, int pagex, int pagey);
+
+// Quick map unit (qx, qy) of the given level (0 = QMAP_UNIT_W), within the page.
+uint8_t qmap_unit(qmap_page_t* q, int level, int qx, int qy);
+
+/*
+	Renders xs*ys quick map units of the given level, starting at absolute unit coords (unit_x0, unit_y0), to out
+	(out[y*xs+x]). Areas not in memory render as 0. For whole-area views: one byte per 80..320 mm.
+*/
+void qmap_render(world_t* w, int level, int unit_x0, int unit_y0, int xs, int ys, uint8_t* out);
+
+/*
+	Sums num_visited and num_seen, and counts wall and item units, over the given unit rectangle (absolute
+	unit coords, inclusive). Per map page the rectangle touches, the whole cells inside it take four lookups
+	per table, and the units of the partially covered edge cells (strips at most STATS_CELL_W-1 units wide)
+	are counted one by one. A dirty page has its tables rebuilt first. Pages not in memory count as empty.
+*/
+void map_stats_rect(world_t* w, int unit_x0, int unit_y0, int unit_x1, int unit_y1, map_stats_t* out);
+
+
+/*
+	Mapping rate governor. Picks batch sizes and the normal localization search range from a table of
+	levels (0 = cheapest), based on the measured mapping duty cycle and whether localization succeeds.
+	The counters are for checking its decisions afterwards; they are never reset.
+*/
+
+#define GOV_STAGE_PREFILTER 0
+#define GOV_STAGE_SCOREMAP  1
+#define GOV_STAGE_PASS1     2
+#define GOV_STAGE_PASS2     3
+#define GOV_STAGE_MAPPING   4
+#define GOV_STAGE_3DTOF     5
+#define GOV_N_STAGES        6
+
+typedef struct
+{
+	int level;
+	int lidar_batch;   // Significant lidar scans per map_lidars() call
+	int a_range;       // Normal localization search range, in degrees
+	int xy_range;      // in mm
+	int tof_batch;     // 3D TOF frames per map_3dtof() call while moving
+
+	int n_lidar_batches;
+	int n_accepted;    // Localization score good enough to apply the full correction
+	int n_rejected;
+	int n_cheaper;     // Level decreases
+	int n_wider;       // Level increases
+	int n_over_budget; // Decisions made with the duty cycle over the target
+
+	float duty;        // Filtered share of wall time spent in mapping
+	float stage_ms[GOV_N_STAGES]; // Filtered time per call
+} map_governor_t;
+
+extern map_governor_t map_governor;
+
+// Returns 1 if the significant lidar scan is worth mapping, 0 if it's redundant with the map and recent keyframes.
+int lidar_is_keyframe(world_t* w, lidar_scan_t* lid);
+
+// Kept keyframes can be far apart, so a batch of them could span a meter or more of odometry. A batch is mapped
+// early instead, when the next scan is further than this (mm) from the first one in the batch.
+#define LIDAR_BATCH_MAX_SPAN 400
 
 int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int* dx, int* dy);
+extern int map_search_threads; // Number of threads used in the map_lidars angle search, 1 = no extra threads.
+
+#define PASS2_REFINE_GRID         0  // pass2 is a grid search on the scoremap
+#define PASS2_REFINE_GAUSS_NEWTON 1  // pass2 refines the pass1 pose on a likelihood field
+extern int map_pass2_refine;
+extern int map_pass1_keypoints; // 1 = pass1 only uses corner points and a sparse subsample of the rest
 void map_next_with_larger_search_area();
 
 void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars);
@@ -0,0 +1,938 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Keyframe pose graph, optimized with Gauss-Newton on a background thread.
+
+	Only the latest PG_WINDOW keyframes are optimized; older ones are fixed, which bounds the solver cost
+	and anchors the graph to the map. Keyframes are numbered in time order, and almost all edges connect
+	nearby keyframes, so the normal equations are stored as a skyline (variable band) matrix: the Cholesky
+	factor of such a matrix has no fill-in outside the skyline, so a plain in-place factorization is sparse.
+
+	Poses are in mm and radians, angles in the trigonometric direction, like the robot coordinates.
+
+	Loop closures: every PG_LOOP_INTERVAL keyframes, the newest keyframe is matched against the stored scan of the
+	nearest keyframe at least PG_LOOP_MIN_GAP keyframes older, with a correlative search (exhaustive over a coarse
+	window, then a fine one) on a blurred grid of the old scan. The edge gets the spread of the well scoring fine
+	candidates as its covariance. The graph only has isotropic position weights, so the larger axis of the
+	covariance is used: a match along a featureless corridor gets little weight.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "datatypes.h"
+#include "arena.h"
+#include "pose_graph.h"
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238
+#endif
+
+extern double subsec_timestamp();
+
+#define PG_MAX_NODES 2048
+#define PG_MAX_EDGES (3*PG_MAX_NODES)
+#define PG_WINDOW 100            // Optimized keyframes; older ones are fixed.
+#define PG_MAX_ITERS 5
+
+#define PG_MIN_MATCH_SCORE 100   // Below this, map_lidars() doesn't trust the match either.
+#define PG_LOOP_MIN_GAP 30       // in keyframes
+#define PG_LOOP_INTERVAL 5       // in keyframes
+#define PG_LOOP_DIST 1000        // in mm
+
+#define PG_SCAN_POINTS 256       // Lidar points stored per keyframe
+#define PG_SCAN_CELL 100         // in mm: stored points are thinned to one per cell of this size
+#define PG_SCAN_RANGE 8000       // in mm, around the keyframe pose
+#define PG_SCAN_MIN_POINTS 60    // Fewer stored points than this, and the keyframe isn't used for loops
+#define PG_SCAN_CELLS (2*PG_SCAN_RANGE/PG_SCAN_CELL)
+
+#define PG_GRID_UNIT 20          // in mm: the grid the old scan is drawn to
+#define PG_GRID_SIGMA 40.0       // in mm: blur of the drawn points
+#define PG_GRID_JOIN 250         // in mm: consecutive stored points closer than this are drawn as a line
+#define PG_GRID_KERNEL_R 6       // in grid units, about 3 sigma
+
+#define PG_LOOP_WIN_XY 400       // in mm: coarse search window, +- around the current estimate
+#define PG_LOOP_STEP_XY 40
+#define PG_LOOP_WIN_ANG 4.0      // in deg
+#define PG_LOOP_STEP_ANG 1.0
+#define PG_LOOP_FINE_XY 60       // Fine search window around the coarse result
+#define PG_LOOP_FINE_STEP_XY 10
+#define PG_LOOP_FINE_ANG 1.5
+#define PG_LOOP_FINE_STEP_ANG 0.25
+#define PG_LOOP_MIN_RESPONSE 0.45   // Average grid value (0..1) over the new points needed for a match
+#define PG_LOOP_COV_BAND 0.05       // Fine candidates within this much of the best response make the covariance
+#define PG_LOOP_MIN_SIGMA_XY 20.0   // in mm
+#define PG_LOOP_MIN_SIGMA_T 0.5     // in deg
+#define PG_LOOP_MAX_SIGMA_XY 50.0   // Less certain matches are dropped.
+#define PG_LOOP_MAX_SIGMA_T 1.5
+
+#ifndef MAP_POSE_GRAPH
+#define MAP_POSE_GRAPH POSE_GRAPH_OFF
+#endif
+
+int map_pose_graph = MAP_POSE_GRAPH;
+
+typedef struct
+{
+	double x;
+	double y;
+	double t;
+} pg_pose_t;
+
+typedef struct
+{
+	int16_t x;
+	int16_t y;
+} pg_point_t;
+
+typedef struct
+{
+	pg_pose_t raw;      // Robot's own pose
+	pg_pose_t sent_at;  // Sum of corrections sent to the robot before this keyframe
+	pg_pose_t matched;  // Pose given by the map matching
+	int has_match;
+	pg_pose_t est;      // Optimized pose
+	int n_scan;
+	pg_point_t scan[PG_SCAN_POINTS]; // Lidar points in the frame of the keyframe, mm, in scan order
+} pg_node_t;
+
+#define PG_MAP -1   // Edge from the map frame origin: z is the pose of j in the map.
+
+typedef struct
+{
+	int i;           // Keyframe or PG_MAP
+	int j;
+	pg_pose_t z;     // Pose of j in the frame of i
+	double inf_xy;   // Information (1/variance) of the position, mm^-2
+	double inf_t;    // Information of the angle, rad^-2
+} pg_edge_t;
+
+static pg_node_t nodes[PG_MAX_NODES];
+static pg_edge_t edges[PG_MAX_EDGES];
+static int n_nodes, n_edges;
+static int last_loop_node;    // Newest keyframe a loop closure was tried for
+static pg_pose_t sent_total;  // Sum of all corrections sent to the robot
+static int generation;        // Incremented on reset, so that a running optimization can't write into a new graph.
+static int pending;           // Keyframes added since the optimization was started
+static int result_node = -1;  // Keyframe of a finished, not yet consumed optimization
+static int busy;              // The thread is working on a copy of the graph
+
+static pthread_mutex_t pg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pg_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pg_idle_cond = PTHREAD_COND_INITIALIZER;
+static int thread_started;
+
+static double wrap_ang(double a)
+{
+	while(a > M_PI) a -= 2.0*M_PI;
+	while(a < -M_PI) a += 2.0*M_PI;
+	return a;
+}
+
+static double ang_to_rad(int32_t a)
+{
+	return (double)a * (M_PI/2147483648.0);
+}
+
+static int32_t rad_to_ang(double r)
+{
+	return (int32_t)(wrap_ang(r) * (2147483648.0/M_PI));
+}
+
+// Pose of b in the frame of a
+static pg_pose_t pose_rel(pg_pose_t a, pg_pose_t b)
+{
+	double c = cos(a.t), s = sin(a.t);
+	double dx = b.x - a.x, dy = b.y - a.y;
+	pg_pose_t r = {c*dx + s*dy, -s*dx + c*dy, wrap_ang(b.t - a.t)};
+	return r;
+}
+
+// Pose r, given in the frame of a, in the world frame
+static pg_pose_t pose_compose(pg_pose_t a, pg_pose_t r)
+{
+	double c = cos(a.t), s = sin(a.t);
+	pg_pose_t p = {a.x + c*r.x - s*r.y, a.y + s*r.x + c*r.y, wrap_ang(a.t + r.t)};
+	return p;
+}
+
+// Corrections sent with correct_robot_pos() just add to the coordinates.
+static pg_pose_t pose_shift(pg_pose_t p, pg_pose_t by)
+{
+	pg_pose_t r = {p.x + by.x, p.y + by.y, wrap_ang(p.t + by.t)};
+	return r;
+}
+
+static pg_pose_t pose_diff(pg_pose_t a, pg_pose_t b)
+{
+	pg_pose_t r = {a.x - b.x, a.y - b.y, wrap_ang(a.t - b.t)};
+	return r;
+}
+
+static void add_edge(int i, int j, pg_pose_t z, double sigma_xy, double sigma_t)
+{
+	if(n_edges >= PG_MAX_EDGES)
+		return;
+
+	pg_edge_t* e = &edges[n_edges++];
+	e->i = i;
+	e->j = j;
+	e->z = z;
+	e->inf_xy = 1.0/(sigma_xy*sigma_xy);
+	e->inf_t = 1.0/(sigma_t*sigma_t);
+}
+
+static void reset_locked()
+{
+	n_nodes = 0;
+	n_edges = 0;
+	last_loop_node = 0;
+	pending = 0;
+	result_node = -1;
+	generation++;
+}
+
+void pose_graph_reset()
+{
+	pthread_mutex_lock(&pg_mutex);
+	reset_locked();
+	pthread_mutex_unlock(&pg_mutex);
+}
+
+void pose_graph_robot_corrected(int32_t da, int32_t dx, int32_t dy)
+{
+	pthread_mutex_lock(&pg_mutex);
+	sent_total.x += dx;
+	sent_total.y += dy;
+	sent_total.t = wrap_ang(sent_total.t - ang_to_rad(da));
+	pthread_mutex_unlock(&pg_mutex);
+}
+
+/*
+	Normal equations as a skyline matrix: row r holds columns first[r]..r, at env[off[r]].
+*/
+typedef struct
+{
+	int n;
+	int* first;
+	int* off;
+	double* env;
+	double* b;
+} skyline_t;
+
+static double* sky_at(skyline_t* h, int r, int c)
+{
+	return &h->env[h->off[r] + c - h->first[r]];
+}
+
+// Adds M (3x3) to the block of variable rows vr, columns vc; vr >= vc. On the diagonal, only the lower half is stored.
+static void sky_add_block(skyline_t* h, int vr, int vc, double m[3][3])
+{
+	for(int a=0; a<3; a++)
+	{
+		for(int b=0; b<3; b++)
+		{
+			int r = 3*vr+a, c = 3*vc+b;
+			if(r >= c)
+				*sky_at(h, r, c) += m[a][b];
+		}
+	}
+}
+
+// In-place Cholesky factorization H = L L^T, then solves H x = -b into b. Returns -1 if H isn't positive definite.
+static int sky_solve(skyline_t* h)
+{
+	int n = h->n;
+	for(int r=0; r<n; r++)
+	{
+		for(int c=h->first[r]; c<=r; c++)
+		{
+			double s = *sky_at(h, r, c);
+			int k0 = (h->first[r] > h->first[c]) ? h->first[r] : h->first[c];
+			for(int k=k0; k<c; k++)
+				s -= *sky_at(h, r, k) * *sky_at(h, c, k);
+
+			if(c == r)
+			{
+				if(s <= 0.0)
+					return -1;
+				*sky_at(h, r, r) = sqrt(s);
+			}
+			else
+				*sky_at(h, r, c) = s / *sky_at(h, c, c);
+		}
+	}
+
+	// L y = -b
+	for(int r=0; r<n; r++)
+	{
+		double s = -h->b[r];
+		for(int k=h->first[r]; k<r; k++)
+			s -= *sky_at(h, r, k) * h->b[k];
+		h->b[r] = s / *sky_at(h, r, r);
+	}
+
+	// L^T x = y, column-oriented since L is stored by rows
+	for(int r=n-1; r>=0; r--)
+	{
+		h->b[r] /= *sky_at(h, r, r);
+		for(int k=h->first[r]; k<r; k++)
+			h->b[k] -= *sky_at(h, r, k) * h->b[r];
+	}
+
+	return 0;
+}
+
+/*
+	Edge error e = Rz^T (rel_xy(pi, pj) - z_xy), e_t = rel_t - z_t, and its Jacobians wrt pi (ja) and pj (jb).
+*/
+static void edge_linearize(pg_edge_t* e, pg_pose_t pi, pg_pose_t pj, double err[3], double ja[3][3], double jb[3][3])
+{
+	double ci = cos(pi.t), si = sin(pi.t);
+	double cz = cos(e->z.t), sz = sin(e->z.t);
+	double dx = pj.x - pi.x, dy = pj.y - pi.y;
+
+	double hx = ci*dx + si*dy;
+	double hy = -si*dx + ci*dy;
+
+	err[0] = cz*(hx - e->z.x) + sz*(hy - e->z.y);
+	err[1] = -sz*(hx - e->z.x) + cz*(hy - e->z.y);
+	err[2] = wrap_ang(pj.t - pi.t - e->z.t);
+
+	// d(hx, hy) / d(xi, yi, ti)
+	double dh[2][3] = {{-ci, -si, -si*dx + ci*dy}, {si, -ci, -ci*dx - si*dy}};
+	for(int c=0; c<3; c++)
+	{
+		ja[0][c] = cz*dh[0][c] + sz*dh[1][c];
+		ja[1][c] = -sz*dh[0][c] + cz*dh[1][c];
+	}
+	ja[2][0] = 0.0; ja[2][1] = 0.0; ja[2][2] = -1.0;
+
+	// d(hx, hy) / d(xj, yj) is -1 times that of (xi, yi)
+	jb[0][0] = -ja[0][0]; jb[0][1] = -ja[0][1]; jb[0][2] = 0.0;
+	jb[1][0] = -ja[1][0]; jb[1][1] = -ja[1][1]; jb[1][2] = 0.0;
+	jb[2][0] = 0.0;       jb[2][1] = 0.0;       jb[2][2] = 1.0;
+}
+
+// m = ja^T diag(inf) jb
+static void jt_inf_j(double ja[3][3], double jb[3][3], double inf[3], double m[3][3])
+{
+	for(int a=0; a<3; a++)
+	{
+		for(int b=0; b<3; b++)
+		{
+			m[a][b] = 0.0;
+			for(int k=0; k<3; k++)
+				m[a][b] += ja[k][a]*inf[k]*jb[k][b];
+		}
+	}
+}
+
+/*
+	One Gauss-Newton step over keyframes first_var..n-1. Returns the largest position step in mm,
+	or -1.0 if the system couldn't be solved.
+*/
+static double optimize_step(pg_pose_t* est, int n, int first_var, pg_edge_t* edg, int n_edg)
+{
+	arena_t* arena = thread_arena();
+	int n_var = n - first_var;
+
+	skyline_t h;
+	h.n = 3*n_var;
+	h.first = arena_alloc(arena, h.n*sizeof(int));
+	h.off = arena_alloc(arena, (h.n+1)*sizeof(int));
+	h.b = arena_calloc(arena, h.n, sizeof(double));
+	if(!h.first || !h.off || !h.b)
+		return -1.0;
+
+	for(int r=0; r<h.n; r++)
+		h.first[r] = 3*(r/3);
+
+	for(int k=0; k<n_edg; k++)
+	{
+		if(edg[k].i == PG_MAP)
+			continue;
+		int vi = edg[k].i - first_var, vj = edg[k].j - first_var;
+		if(vi < 0 || vj < 0)
+			continue;
+		int lo = (vi < vj) ? vi : vj, hi = (vi < vj) ? vj : vi;
+		for(int a=0; a<3; a++)
+			if(h.first[3*hi+a] > 3*lo) h.first[3*hi+a] = 3*lo;
+	}
+
+	h.off[0] = 0;
+	for(int r=0; r<h.n; r++)
+		h.off[r+1] = h.off[r] + r - h.first[r] + 1;
+
+	h.env = arena_calloc(arena, h.off[h.n], sizeof(double));
+	if(!h.env)
+		return -1.0;
+
+	for(int k=0; k<n_edg; k++)
+	{
+		pg_edge_t* e = &edg[k];
+		int vi = (e->i == PG_MAP) ? -1 : (e->i - first_var);
+		int vj = e->j - first_var;
+		if(vi < 0 && vj < 0)
+			continue;
+
+		double err[3], ja[3][3], jb[3][3], m[3][3];
+		double inf[3] = {e->inf_xy, e->inf_xy, e->inf_t};
+		pg_pose_t origin = {0.0, 0.0, 0.0};
+		edge_linearize(e, (e->i == PG_MAP) ? origin : est[e->i], est[e->j], err, ja, jb);
+
+		if(vi >= 0)
+		{
+			jt_inf_j(ja, ja, inf, m);
+			sky_add_block(&h, vi, vi, m);
+			for(int a=0; a<3; a++)
+				for(int k2=0; k2<3; k2++)
+					h.b[3*vi+a] += ja[k2][a]*inf[k2]*err[k2];
+		}
+		if(vj >= 0)
+		{
+			jt_inf_j(jb, jb, inf, m);
+			sky_add_block(&h, vj, vj, m);
+			for(int a=0; a<3; a++)
+				for(int k2=0; k2<3; k2++)
+					h.b[3*vj+a] += jb[k2][a]*inf[k2]*err[k2];
+		}
+		if(vi >= 0 && vj >= 0)
+		{
+			if(vi > vj)
+			{
+				jt_inf_j(ja, jb, inf, m);
+				sky_add_block(&h, vi, vj, m);
+			}
+			else
+			{
+				jt_inf_j(jb, ja, inf, m);
+				sky_add_block(&h, vj, vi, m);
+			}
+		}
+	}
+
+	// A little damping keeps the system solvable even if a keyframe somehow lost its edges.
+	for(int r=0; r<h.n; r++)
+		*sky_at(&h, r, r) += 1e-9;
+
+	if(sky_solve(&h) < 0)
+		return -1.0;
+
+	double max_step = 0.0;
+	for(int v=0; v<n_var; v++)
+	{
+		pg_pose_t* p = &est[first_var+v];
+		p->x += h.b[3*v+0];
+		p->y += h.b[3*v+1];
+		p->t = wrap_ang(p->t + h.b[3*v+2]);
+		double step = fabs(h.b[3*v+0]) + fabs(h.b[3*v+1]);
+		if(step > max_step) max_step = step;
+	}
+	return max_step;
+}
+
+/*
+	Loop closure matching: the scan of the old keyframe is drawn to a grid, blurred, and the new scan is moved
+	over it. The score of a pose is the sum of the grid values at the moved points.
+*/
+
+#define PG_KERNEL_W (2*PG_GRID_KERNEL_R+1)
+
+typedef struct
+{
+	int w, h;        // in grid units
+	double x0, y0;   // Cell (0,0) center in the frame of the old keyframe, mm
+	uint8_t* val;    // y-major, 0..255
+} pg_grid_t;
+
+static void grid_stamp(pg_grid_t* g, const uint8_t* kernel, double x, double y)
+{
+	int cx = floor((x - g->x0)/PG_GRID_UNIT + 0.5);
+	int cy = floor((y - g->y0)/PG_GRID_UNIT + 0.5);
+	for(int ky = 0; ky < PG_KERNEL_W; ky++)
+	{
+		uint8_t* row = &g->val[(cy+ky-PG_GRID_KERNEL_R)*g->w + cx-PG_GRID_KERNEL_R];
+		for(int kx = 0; kx < PG_KERNEL_W; kx++)
+			if(kernel[ky*PG_KERNEL_W+kx] > row[kx]) row[kx] = kernel[ky*PG_KERNEL_W+kx];
+	}
+}
+
+static int draw_scan_grid(pg_grid_t* g, const pg_point_t* pts, int n)
+{
+	static uint8_t kernel[PG_KERNEL_W*PG_KERNEL_W];
+	if(!kernel[PG_GRID_KERNEL_R*PG_KERNEL_W+PG_GRID_KERNEL_R])
+	{
+		for(int ky = 0; ky < PG_KERNEL_W; ky++)
+		{
+			for(int kx = 0; kx < PG_KERNEL_W; kx++)
+			{
+				double d2 = (double)((kx-PG_GRID_KERNEL_R)*(kx-PG_GRID_KERNEL_R) + (ky-PG_GRID_KERNEL_R)*(ky-PG_GRID_KERNEL_R))*PG_GRID_UNIT*PG_GRID_UNIT;
+				kernel[ky*PG_KERNEL_W+kx] = 255.0*exp(-d2/(2.0*PG_GRID_SIGMA*PG_GRID_SIGMA)) + 0.5;
+			}
+		}
+	}
+
+	int min_x = pts[0].x, max_x = pts[0].x, min_y = pts[0].y, max_y = pts[0].y;
+	for(int i=1; i<n; i++)
+	{
+		if(pts[i].x < min_x) min_x = pts[i].x;
+		if(pts[i].x > max_x) max_x = pts[i].x;
+		if(pts[i].y < min_y) min_y = pts[i].y;
+		if(pts[i].y > max_y) max_y = pts[i].y;
+	}
+
+	g->x0 = min_x - (PG_GRID_KERNEL_R+1)*PG_GRID_UNIT;
+	g->y0 = min_y - (PG_GRID_KERNEL_R+1)*PG_GRID_UNIT;
+	g->w = (max_x - min_x)/PG_GRID_UNIT + 2*(PG_GRID_KERNEL_R+2);
+	g->h = (max_y - min_y)/PG_GRID_UNIT + 2*(PG_GRID_KERNEL_R+2);
+	g->val = arena_calloc(thread_arena(), g->w*g->h, 1);
+	if(!g->val)
+		return -1;
+
+	for(int i=0; i<n; i++)
+	{
+		grid_stamp(g, kernel, pts[i].x, pts[i].y);
+
+		// Walls are sampled sparsely; fill in between neighboring points.
+		if(i > 0)
+		{
+			double dx = pts[i].x - pts[i-1].x, dy = pts[i].y - pts[i-1].y;
+			double len = sqrt(dx*dx + dy*dy);
+			if(len <= PG_GRID_JOIN)
+			{
+				int steps = len/PG_GRID_UNIT;
+				for(int k=1; k<steps; k++)
+					grid_stamp(g, kernel, pts[i-1].x + dx*k/steps, pts[i-1].y + dy*k/steps);
+			}
+		}
+	}
+	return 0;
+}
+
+// Scores of the new points moved by angle t (rad) and all n_xy*n_xy offsets from (x_start, y_start) on, to sums[ix*n_xy+iy].
+static void match_angle(pg_grid_t* g, const pg_point_t* pts, int n, double t,
+	double x_start, double y_start, double step, int n_xy, int32_t* sums)
+{
+	double c = cos(t), s = sin(t);
+	memset(sums, 0, n_xy*n_xy*sizeof(int32_t));
+	for(int i=0; i<n; i++)
+	{
+		double gx = (c*pts[i].x - s*pts[i].y + x_start - g->x0)/PG_GRID_UNIT + 0.5;
+		double gy = (s*pts[i].x + c*pts[i].y + y_start - g->y0)/PG_GRID_UNIT + 0.5;
+		double gstep = step/PG_GRID_UNIT;
+		for(int ix=0; ix<n_xy; ix++)
+		{
+			int cx = floor(gx + ix*gstep);
+			if(cx < 0 || cx >= g->w)
+				continue;
+			for(int iy=0; iy<n_xy; iy++)
+			{
+				int cy = floor(gy + iy*gstep);
+				if(cy < 0 || cy >= g->h)
+					continue;
+				sums[ix*n_xy+iy] += g->val[cy*g->w+cx];
+			}
+		}
+	}
+}
+
+/*
+	Matches the scan of a new keyframe to the scan of an old one. guess is the pose of the new keyframe in the
+	frame of the old one, from the current estimates. On success, returns 1 with the pose in z and its
+	uncertainty in sigma_xy (mm), sigma_t (rad).
+*/
+static int loop_match(const pg_point_t* old_pts, int n_old, const pg_point_t* new_pts, int n_new, pg_pose_t guess,
+	pg_pose_t* z, double* sigma_xy, double* sigma_t, double* response)
+{
+	pg_grid_t g;
+	if(draw_scan_grid(&g, old_pts, n_old) < 0)
+		return 0;
+
+	const double deg = M_PI/180.0;
+
+	// Coarse search over the whole window
+	int n_xy = 2*(PG_LOOP_WIN_XY/PG_LOOP_STEP_XY) + 1;
+	int n_t = 2*(int)(PG_LOOP_WIN_ANG/PG_LOOP_STEP_ANG + 0.5) + 1;
+	int32_t* sums = arena_alloc(thread_arena(), n_xy*n_xy*sizeof(int32_t));
+	if(!sums)
+		return 0;
+
+	int32_t best = -1;
+	int best_it = 0, best_ix = 0, best_iy = 0;
+	for(int it=0; it<n_t; it++)
+	{
+		match_angle(&g, new_pts, n_new, guess.t + (it - n_t/2)*PG_LOOP_STEP_ANG*deg,
+			guess.x - PG_LOOP_WIN_XY, guess.y - PG_LOOP_WIN_XY, PG_LOOP_STEP_XY, n_xy, sums);
+		for(int i=0; i<n_xy*n_xy; i++)
+		{
+			if(sums[i] > best)
+			{
+				best = sums[i];
+				best_it = it; best_ix = i/n_xy; best_iy = i%n_xy;
+			}
+		}
+	}
+
+	// The true pose is likely outside the window.
+	if(best_it == 0 || best_it == n_t-1 || best_ix == 0 || best_ix == n_xy-1 || best_iy == 0 || best_iy == n_xy-1)
+		return 0;
+
+	pg_pose_t coarse = {guess.x + (best_ix - n_xy/2)*PG_LOOP_STEP_XY, guess.y + (best_iy - n_xy/2)*PG_LOOP_STEP_XY,
+		guess.t + (best_it - n_t/2)*PG_LOOP_STEP_ANG*deg};
+
+	// Fine search around the coarse result; all scores are kept for the covariance.
+	int n_fxy = 2*(PG_LOOP_FINE_XY/PG_LOOP_FINE_STEP_XY) + 1;
+	int n_ft = 2*(int)(PG_LOOP_FINE_ANG/PG_LOOP_FINE_STEP_ANG + 0.5) + 1;
+	int32_t* fsums = arena_alloc(thread_arena(), n_ft*n_fxy*n_fxy*sizeof(int32_t));
+	if(!fsums)
+		return 0;
+
+	best = -1;
+	for(int it=0; it<n_ft; it++)
+	{
+		int32_t* sp = &fsums[it*n_fxy*n_fxy];
+		match_angle(&g, new_pts, n_new, coarse.t + (it - n_ft/2)*PG_LOOP_FINE_STEP_ANG*deg,
+			coarse.x - PG_LOOP_FINE_XY, coarse.y - PG_LOOP_FINE_XY, PG_LOOP_FINE_STEP_XY, n_fxy, sp);
+		for(int i=0; i<n_fxy*n_fxy; i++)
+		{
+			if(sp[i] > best)
+			{
+				best = sp[i];
+				best_it = it; best_ix = i/n_fxy; best_iy = i%n_fxy;
+			}
+		}
+	}
+
+	*response = (double)best/(255.0*(double)n_new);
+	if(*response < PG_LOOP_MIN_RESPONSE)
+		return 0;
+
+	// Covariance: spread of the candidates scoring nearly as well as the best one, weighted by the score.
+	int32_t band = best - PG_LOOP_COV_BAND*255.0*(double)n_new;
+	double sw = 0.0, sxx = 0.0, syy = 0.0, sxy = 0.0, stt = 0.0;
+	for(int it=0; it<n_ft; it++)
+	{
+		for(int ix=0; ix<n_fxy; ix++)
+		{
+			for(int iy=0; iy<n_fxy; iy++)
+			{
+				int32_t v = fsums[(it*n_fxy + ix)*n_fxy + iy];
+				if(v < band)
+					continue;
+
+				// The well scoring region doesn't fit in the window: too uncertain.
+				if(it == 0 || it == n_ft-1 || ix == 0 || ix == n_fxy-1 || iy == 0 || iy == n_fxy-1)
+					return 0;
+
+				double dx = (ix - best_ix)*PG_LOOP_FINE_STEP_XY, dy = (iy - best_iy)*PG_LOOP_FINE_STEP_XY;
+				double dt = (it - best_it)*PG_LOOP_FINE_STEP_ANG*deg;
+				sw += v;
+				sxx += v*dx*dx; syy += v*dy*dy; sxy += v*dx*dy; stt += v*dt*dt;
+			}
+		}
+	}
+	sxx /= sw; syy /= sw; sxy /= sw; stt /= sw;
+
+	// Larger eigenvalue of the position covariance
+	double var_xy = 0.5*(sxx + syy) + sqrt(0.25*(sxx - syy)*(sxx - syy) + sxy*sxy);
+	*sigma_xy = sqrt(var_xy);
+	*sigma_t = sqrt(stt);
+	if(*sigma_xy < PG_LOOP_MIN_SIGMA_XY) *sigma_xy = PG_LOOP_MIN_SIGMA_XY;
+	if(*sigma_t < PG_LOOP_MIN_SIGMA_T*deg) *sigma_t = PG_LOOP_MIN_SIGMA_T*deg;
+	if(*sigma_xy > PG_LOOP_MAX_SIGMA_XY || *sigma_t > PG_LOOP_MAX_SIGMA_T*deg)
+		return 0;
+
+	z->x = coarse.x + (best_ix - n_fxy/2)*PG_LOOP_FINE_STEP_XY;
+	z->y = coarse.y + (best_iy - n_fxy/2)*PG_LOOP_FINE_STEP_XY;
+	z->t = wrap_ang(coarse.t + (best_it - n_ft/2)*PG_LOOP_FINE_STEP_ANG*deg);
+	return 1;
+}
+
+static void* optimizer_thread(void* arg)
+{
+	static pg_pose_t est[PG_MAX_NODES];
+	static pg_edge_t edg[PG_MAX_EDGES];
+	static pg_point_t old_scan[PG_SCAN_POINTS], new_scan[PG_SCAN_POINTS];
+
+	while(1)
+	{
+		pthread_mutex_lock(&pg_mutex);
+		busy = 0;
+		pthread_cond_broadcast(&pg_idle_cond);
+		while(!pending)
+			pthread_cond_wait(&pg_cond, &pg_mutex);
+
+		pending = 0;
+		busy = 1;
+		int n = n_nodes;
+		int n_edg = n_edges;
+		int gen = generation;
+		for(int i=0; i<n; i++)
+			est[i] = nodes[i].est;
+		memcpy(edg, edges, n_edg*sizeof(pg_edge_t));
+
+		// Loop closure candidate for the newest keyframe: the nearest one old enough, by the current estimates.
+		int loop_i = -1, loop_k = n-1, n_old = 0, n_new = 0;
+		pg_pose_t guess = {0.0, 0.0, 0.0};
+		if(n > 0 && loop_k - last_loop_node >= PG_LOOP_INTERVAL && nodes[loop_k].n_scan >= PG_SCAN_MIN_POINTS)
+		{
+			pg_pose_t pk = nodes[loop_k].has_match ? nodes[loop_k].matched : nodes[loop_k].est;
+			double best_d2 = (double)PG_LOOP_DIST*(double)PG_LOOP_DIST;
+			for(int i=0; i < loop_k - PG_LOOP_MIN_GAP; i++)
+			{
+				if(nodes[i].n_scan < PG_SCAN_MIN_POINTS)
+					continue;
+				double dx = nodes[i].est.x - pk.x, dy = nodes[i].est.y - pk.y;
+				if(dx*dx + dy*dy < best_d2)
+				{
+					best_d2 = dx*dx + dy*dy;
+					loop_i = i;
+				}
+			}
+
+			if(loop_i >= 0)
+			{
+				n_old = nodes[loop_i].n_scan;
+				n_new = nodes[loop_k].n_scan;
+				memcpy(old_scan, nodes[loop_i].scan, n_old*sizeof(pg_point_t));
+				memcpy(new_scan, nodes[loop_k].scan, n_new*sizeof(pg_point_t));
+				guess = pose_rel(nodes[loop_i].est, pk);
+				last_loop_node = loop_k;
+			}
+		}
+		pthread_mutex_unlock(&pg_mutex);
+
+		double start = subsec_timestamp();
+		arena_reset(thread_arena());
+
+		if(loop_i >= 0)
+		{
+			pg_pose_t z;
+			double sigma_xy, sigma_t, response;
+			if(loop_match(old_scan, n_old, new_scan, n_new, guess, &z, &sigma_xy, &sigma_t, &response))
+			{
+				printf("Info: pose graph: loop closure %d -> %d, x=%.0fmm y=%.0fmm a=%.1fdeg (%.0fmm %.1fdeg off the estimate), sigma %.0fmm %.2fdeg, response %.2f\n",
+					loop_i, loop_k, z.x, z.y, z.t*180.0/M_PI, sqrt((z.x-guess.x)*(z.x-guess.x) + (z.y-guess.y)*(z.y-guess.y)),
+					wrap_ang(z.t-guess.t)*180.0/M_PI, sigma_xy, sigma_t*180.0/M_PI, response);
+
+				pthread_mutex_lock(&pg_mutex);
+				if(gen == generation && n_edges < PG_MAX_EDGES)
+				{
+					add_edge(loop_i, loop_k, z, sigma_xy, sigma_t);
+					edg[n_edg++] = edges[n_edges-1];
+				}
+				pthread_mutex_unlock(&pg_mutex);
+			}
+		}
+
+		// Keyframe 0 is the anchor.
+		int first_var = (n > PG_WINDOW+1) ? (n - PG_WINDOW) : 1;
+		if(n - first_var < 1)
+			continue;
+
+		pg_pose_t before = est[n-1];
+
+		int iters = 0;
+		double step = 0.0;
+		while(iters < PG_MAX_ITERS)
+		{
+			step = optimize_step(est, n, first_var, edg, n_edg);
+			iters++;
+			if(step < 0.1)
+				break;
+		}
+
+		if(step < 0.0)
+		{
+			printf("WARN: pose graph optimization failed (%d keyframes, %d edges)\n", n, n_edg);
+			continue;
+		}
+
+		pthread_mutex_lock(&pg_mutex);
+		if(gen == generation)
+		{
+			for(int i=first_var; i<n; i++)
+				nodes[i].est = est[i];
+
+			// Keyframes added during the optimization move along with the last optimized one.
+			for(int i=n; i<n_nodes; i++)
+				nodes[i].est = pose_compose(est[n-1], pose_rel(before, nodes[i].est));
+
+			result_node = n-1;
+		}
+		pthread_mutex_unlock(&pg_mutex);
+
+		printf("Info: pose graph: %d keyframes (%d optimized), %d edges, %d iterations, %.1f ms\n",
+			n, n-first_var, n_edg, iters, (subsec_timestamp()-start)*1000.0);
+	}
+
+	return NULL;
+}
+
+// Stores the batch points in the frame of the keyframe, thinned to about one per PG_SCAN_CELL, at most PG_SCAN_POINTS.
+static void store_keyframe_scan(pg_node_t* nd, int n_lidars, lidar_scan_t** lidar_list)
+{
+	static uint8_t used[PG_SCAN_CELLS][PG_SCAN_CELLS];
+
+	double c = cos(nd->raw.t), s = sin(nd->raw.t);
+	int n_thinned = 0;
+	nd->n_scan = 0;
+
+	// First count the thinned points, then store evenly spread PG_SCAN_POINTS of them.
+	for(int pass = 0; pass < 2; pass++)
+	{
+		memset(used, 0, sizeof(used));
+		int j = 0;
+		for(int l=0; l<n_lidars; l++)
+		{
+			lidar_scan_t* lid = lidar_list[l];
+			for(int p=0; p<lid->n_points; p++)
+			{
+				if(!lid->scan[p].valid)
+					continue;
+
+				double dx = lid->scan[p].x - nd->raw.x, dy = lid->scan[p].y - nd->raw.y;
+				double lx = c*dx + s*dy, ly = -s*dx + c*dy;
+				if(fabs(lx) >= PG_SCAN_RANGE || fabs(ly) >= PG_SCAN_RANGE)
+					continue;
+
+				int cx = (lx + PG_SCAN_RANGE)/PG_SCAN_CELL, cy = (ly + PG_SCAN_RANGE)/PG_SCAN_CELL;
+				if(used[cx][cy])
+					continue;
+				used[cx][cy] = 1;
+
+				if(pass == 1 && ((int64_t)(j+1)*PG_SCAN_POINTS)/n_thinned > ((int64_t)j*PG_SCAN_POINTS)/n_thinned)
+				{
+					nd->scan[nd->n_scan].x = lx;
+					nd->scan[nd->n_scan].y = ly;
+					nd->n_scan++;
+				}
+				j++;
+			}
+		}
+		n_thinned = j;
+		if(n_thinned == 0)
+			break;
+	}
+}
+
+void pose_graph_add_keyframe(pos_t raw, int32_t corr_da, int32_t corr_dx, int32_t corr_dy, int score,
+	int n_lidars, lidar_scan_t** lidar_list)
+{
+	pthread_mutex_lock(&pg_mutex);
+
+	if(!thread_started)
+	{
+		pthread_t thread;
+		int ret;
+		if( (ret = pthread_create(&thread, NULL, optimizer_thread, NULL)) != 0)
+		{
+			printf("ERROR: pose graph thread creation failed, ret = %d\n", ret);
+			pthread_mutex_unlock(&pg_mutex);
+			return;
+		}
+		pthread_detach(thread);
+		thread_started = 1;
+	}
+
+	if(n_nodes >= PG_MAX_NODES || n_edges >= PG_MAX_EDGES-3)
+	{
+		printf("Info: pose graph full, starting over\n");
+		reset_locked();
+	}
+
+	int k = n_nodes;
+	pg_node_t* nd = &nodes[k];
+	nd->raw.x = raw.x;
+	nd->raw.y = raw.y;
+	nd->raw.t = ang_to_rad(raw.ang);
+	nd->sent_at = sent_total;
+	nd->has_match = (score >= PG_MIN_MATCH_SCORE);
+	nd->matched.x = raw.x + corr_dx;
+	nd->matched.y = raw.y + corr_dy;
+	nd->matched.t = wrap_ang(nd->raw.t - ang_to_rad(corr_da));
+	store_keyframe_scan(nd, n_lidars, lidar_list);
+
+	// Weak matches get less weight; a score of 300 is what map_lidars() calls good.
+	double match_w = (nd->has_match) ? (300.0/(double)score) : 1.0;
+	if(match_w < 0.5) match_w = 0.5;
+	if(match_w > 3.0) match_w = 3.0;
+
+	// The map is the absolute reference: a match ties the keyframe to it directly.
+	if(nd->has_match)
+		add_edge(PG_MAP, k, nd->matched, 40.0*match_w, 0.7*M_PI/180.0*match_w);
+
+	if(k == 0)
+	{
+		nd->est = nd->has_match ? nd->matched : nd->raw;
+	}
+	else
+	{
+		pg_node_t* prev = &nodes[k-1];
+
+		// The robot coordinates were shifted by the corrections sent in between.
+		pg_pose_t prev_shifted = pose_shift(prev->raw, pose_diff(nd->sent_at, prev->sent_at));
+		pg_pose_t odo = pose_rel(prev_shifted, nd->raw);
+		double dist = sqrt(odo.x*odo.x + odo.y*odo.y);
+		add_edge(k-1, k, odo, 20.0 + 0.05*dist, 1.0*M_PI/180.0 + 0.05*fabs(odo.t));
+
+		nd->est = pose_compose(prev->est, odo);
+	}
+
+	n_nodes++;
+	pending = 1;
+	pthread_cond_signal(&pg_cond);
+	pthread_mutex_unlock(&pg_mutex);
+}
+
+int pose_graph_correction(int32_t* da, int32_t* dx, int32_t* dy)
+{
+	pthread_mutex_lock(&pg_mutex);
+	if(result_node < 0)
+	{
+		pthread_mutex_unlock(&pg_mutex);
+		return 0;
+	}
+
+	// Where the robot now thinks the keyframe was, after the corrections sent since.
+	pg_node_t* nd = &nodes[result_node];
+	pg_pose_t belief = pose_shift(nd->raw, pose_diff(sent_total, nd->sent_at));
+
+	*da = rad_to_ang(belief.t - nd->est.t);
+	*dx = nd->est.x - belief.x;
+	*dy = nd->est.y - belief.y;
+	result_node = -1;
+
+	pthread_mutex_unlock(&pg_mutex);
+	return 1;
+}
+
+void pose_graph_sync()
+{
+	pthread_mutex_lock(&pg_mutex);
+	while(thread_started && (pending || busy))
+		pthread_cond_wait(&pg_idle_cond, &pg_mutex);
+	pthread_mutex_unlock(&pg_mutex);
+}
@@ -0,0 +1,66 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+*/
+
+#ifndef POSE_GRAPH_H
+#define POSE_GRAPH_H
+
+#include <stdint.h>
+#include "datatypes.h"
+
+/*
+	Keyframe pose graph. Each localized lidar batch adds a keyframe at the batch midpoint, with a subsample of
+	its lidar points. Keyframes are tied together with odometry edges, to the map with their scan matching
+	results (weighted by the score), and to much older keyframes with loop closure edges, when the stored scans
+	of the two keyframes match each other. The graph is optimized, and loops are matched, on a background thread.
+
+	All corrections are in the form correct_robot_pos() takes: new angle = ang - da, new x = x + dx.
+*/
+
+#define POSE_GRAPH_OFF      0  // No keyframes are collected.
+#define POSE_GRAPH_ESTIMATE 1  // The graph is built and optimized, but only map_lidars() corrects the robot.
+#define POSE_GRAPH_CORRECTS 2  // The optimized pose replaces the map_lidars() correction, when available.
+extern int map_pose_graph;
+
+// Forgets all keyframes. Call when the robot coordinates jump (set_robot_pos(), relocalization).
+void pose_graph_reset();
+
+// Called for every correction sent to the robot, so that odometry between keyframes can be recovered.
+void pose_graph_robot_corrected(int32_t da, int32_t dx, int32_t dy);
+
+/*
+	raw: robot pose at the batch midpoint, as reported by the robot; the lidar points of the batch are
+	stored relative to it.
+	corr_da, corr_dx, corr_dy: full map_lidars() correction for the batch, score its matching score.
+	Corrections with score < PG_MIN_MATCH_SCORE only add an odometry edge.
+*/
+void pose_graph_add_keyframe(pos_t raw, int32_t corr_da, int32_t corr_dx, int32_t corr_dy, int score,
+	int n_lidars, lidar_scan_t** lidar_list);
+
+/*
+	If the background optimization has finished since the last call, writes the correction that moves the
+	robot to the optimized pose, and returns 1. Otherwise returns 0 and leaves the arguments alone.
+*/
+int pose_graph_correction(int32_t* da, int32_t* dx, int32_t* dy);
+
+// Waits until the background thread has processed all keyframes added so far. For replays and tests.
+void pose_graph_sync();
+
+#endif
@@ -459,8 +459,13 @@ static void distances_to_objmap(pulutof_frame_t *in)
 						else if(z < 2050.0)
 							new_val = TOF3D_LOW_CEILING;
 
-						if(new_val > tof3ds[tof3d_wr].objmap[yspot*TOF3D_HMAP_XSPOTS+xspot])
-							tof3ds[tof3d_wr].objmap[yspot*TOF3D_HMAP_XSPOTS+xspot] = new_val;
+						int idx = yspot*TOF3D_HMAP_XSPOTS+xspot;
+						if(new_val > tof3ds[tof3d_wr].objmap[idx])
+						{
+							if(tof3ds[tof3d_wr].objmap[idx] == TOF3D_UNSEEN)
+								tof3ds[tof3d_wr].objmap_cells[tof3ds[tof3d_wr].n_objmap_cells++] = idx;
+							tof3ds[tof3d_wr].objmap[idx] = new_val;
+						}
 					}
 
 				}
@@ -542,6 +547,7 @@ static void process_pulutof_frame(pulutof_frame_t *in)
 //			{hmap_accum[xx][yy] = -9999; hmap_nsamples[xx][yy] = 0; hmap_avgd[xx][yy] = 0;} }
 
 		memset(tof3ds[tof3d_wr].objmap, 0, 1*TOF3D_HMAP_YSPOTS*TOF3D_HMAP_XSPOTS);
+		tof3ds[tof3d_wr].n_objmap_cells = 0;
 		tof3ds[tof3d_wr].n_points = 0;
 	}
 
@@ -604,6 +610,7 @@ void run_3dtof_floor_calibration()
 
 static void process_objmap()
 {
+	tof3ds[tof3d_wr].n_objmap_cells = 0;
 	for(int sx = 0; sx < TOF3D_HMAP_XSPOTS; sx++)
 	{
 		for(int sy = 0; sy < TOF3D_HMAP_YSPOTS; sy++)
@@ -612,6 +619,9 @@ static void process_objmap()
 				tof3ds[tof3d_wr].objmap[sy*TOF3D_HMAP_XSPOTS+sx] = hmap_accum[sx][sy]/20;
 			else
 				tof3ds[tof3d_wr].objmap[sy*TOF3D_HMAP_XSPOTS+sx] = 0;
+
+			if(tof3ds[tof3d_wr].objmap[sy*TOF3D_HMAP_XSPOTS+sx] != TOF3D_UNSEEN)
+				tof3ds[tof3d_wr].objmap_cells[tof3ds[tof3d_wr].n_objmap_cells++] = sy*TOF3D_HMAP_XSPOTS+sx;
 /*
 			if(hmap_nsamples[sx][sy] > 0)
 			{
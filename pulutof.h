@@ -122,6 +122,9 @@ typedef struct
 {
 	pos_t robot_pos;
 	int8_t objmap[TOF3D_HMAP_YSPOTS*TOF3D_HMAP_XSPOTS];
+	// Indices to objmap of the cells that are not TOF3D_UNSEEN, in no particular order. Most of the objmap isn't seen.
+	int n_objmap_cells;
+	uint16_t objmap_cells[TOF3D_HMAP_YSPOTS*TOF3D_HMAP_XSPOTS];
 	uint16_t raw_depth[160*60]; // for development purposes: populated only when enabled, with only 1 sensor at the time
 	uint8_t ampl_images[4][160*60];
 
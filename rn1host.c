@@ -87,6 +87,7 @@
 #include "tcp_comm.h"
 #include "tcp_parser.h"
 #include "routing.h"
+#include "pose_graph.h"
 #include "utlist.h"
 
 #include "pulutof.h"
@@ -178,6 +179,7 @@ void cmd_from_client_to_host(int, thread_struct**);
 void mapping_handling(thread_struct*);	// Starting point of the mapping thread
 void tof_handling(void);
 void lidar_handling(void);
+void qmap_handling(void);
 void route_fsm(thread_struct*);	// Starting point of the navigation thread
 void do_live_obstacle_checking(void);
 void routing_thread(thread_struct*);	// Starting point of the routing thread
@@ -1579,6 +1581,8 @@ void mapping_handling(thread_struct *p_host_t)
 
 		lidar_handling();
 
+		qmap_handling();
+
 		static uint8_t prev_keep_position;
 		if(!state_vect.v.keep_position && prev_keep_position)
 			release_motors();
@@ -1748,7 +1752,7 @@ void tof_handling(void)
 				tofs_to_map[n_tofs_to_map] = p_tof;
 				n_tofs_to_map++;
 
-				if(n_tofs_to_map >= (robot_moving?3:20))
+				if(n_tofs_to_map >= (robot_moving?map_governor.tof_batch:20))
 				{
 					int32_t mid_x, mid_y;
 					map_3dtof(&world, n_tofs_to_map, tofs_to_map, &mid_x, &mid_y);
@@ -1782,6 +1786,50 @@ void tof_handling(void)
 
 
 
+/*
+	Quick map requests come in on the communication thread, but the quick maps are caches of the map pages, which the
+	mapping thread writes, invalidates and unloads: the latest request is queued, and rendered here, between map_lidars()
+	calls.
+*/
+static pthread_mutex_t qmap_req_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects the two below
+static int qmap_req_pending;
+static tcp_cr_qmap_t qmap_req;
+
+static void queue_qmap_request(tcp_cr_qmap_t* req)
+{
+	pthread_mutex_lock(&qmap_req_mutex);
+	if(qmap_req_pending)
+		printf("INFO: Quick map request replaces an unanswered one\n");
+	qmap_req = *req;
+	qmap_req_pending = 1;
+	pthread_mutex_unlock(&qmap_req_mutex);
+}
+
+// Answers the queued quick map request, if any
+void qmap_handling(void)
+{
+	static uint8_t qmap[255*255];
+
+	pthread_mutex_lock(&qmap_req_mutex);
+	int pending = qmap_req_pending;
+	tcp_cr_qmap_t req = qmap_req;
+	qmap_req_pending = 0;
+	pthread_mutex_unlock(&qmap_req_mutex);
+
+	if(!pending || tcp_client_sock < 0)
+		return;
+
+	// Align the corner to the quick map units of the level, so that the reported origin is exact.
+	int ux, uy, x_mm, y_mm;
+	unit_coords(req.x, req.y, &ux, &uy);
+	ux &= ~((2<<req.level)-1);
+	uy &= ~((2<<req.level)-1);
+	mm_from_unit_coords(ux, uy, &x_mm, &y_mm);
+
+	qmap_render(&world, req.level, ux, uy, req.xs, req.ys, qmap);
+	tcp_send_qmap(req.xs, req.ys, x_mm, y_mm, QMAP_UNIT_W<<req.level, qmap);
+}
+
 // Handles lidar mapping
 void lidar_handling(void)
 {
@@ -1892,17 +1940,29 @@ void lidar_handling(void)
 						n_lidars_to_map = 0;
 					}
 				}
-				else
+				else if(state_vect.v.localize_with_big_search_area || lidar_is_keyframe(&world, p_lid))
 				{
-					//printf("Got significant(%d) lidar scan, adding to the mapping queue(%d).\n", p_lid->significant_for_mapping, n_lidars_to_map);
-					lidars_to_map[n_lidars_to_map] = p_lid;
+					// Map the batch early, and start the next one with this scan, if the batch would get too long.
+					int span_exceeded = 0;
+					if(!state_vect.v.localize_with_big_search_area && n_lidars_to_map > 0)
+					{
+						int span_dx = p_lid->robot_pos.x - lidars_to_map[0]->robot_pos.x;
+						int span_dy = p_lid->robot_pos.y - lidars_to_map[0]->robot_pos.y;
+						span_exceeded = sq(span_dx) + sq(span_dy) > sq(LIDAR_BATCH_MAX_SPAN);
+					}
 
-					n_lidars_to_map++;
+					if(!span_exceeded)
+					{
+						//printf("Got significant(%d) lidar scan, adding to the mapping queue(%d).\n", p_lid->significant_for_mapping, n_lidars_to_map);
+						lidars_to_map[n_lidars_to_map] = p_lid;
 
+						n_lidars_to_map++;
+					}
 
-					if((state_vect.v.localize_with_big_search_area && n_lidars_to_map > 11) ||
+					if(span_exceeded ||
+					   (state_vect.v.localize_with_big_search_area && n_lidars_to_map > 11) ||
 					   (!state_vect.v.localize_with_big_search_area &&
-						((good_time_for_lidar_mapping && n_lidars_to_map > 3) || n_lidars_to_map > 4)))
+						((good_time_for_lidar_mapping && n_lidars_to_map >= map_governor.lidar_batch) || n_lidars_to_map > map_governor.lidar_batch)))
 					{
 						if(good_time_for_lidar_mapping) good_time_for_lidar_mapping = 0;
 						int32_t da, dx, dy;
@@ -1910,11 +1970,19 @@ void lidar_handling(void)
 						map_lidars(&world, n_lidars_to_map, lidars_to_map, &da, &dx, &dy);
 						INCR_POS_CORR_ID();
 
+						// When enabled and available, the optimized pose replaces the plain map matching result.
+						if(!state_vect.v.localize_with_big_search_area && map_pose_graph == POSE_GRAPH_CORRECTS &&
+						   pose_graph_correction(&da, &dx, &dy))
+							printf("Pose graph correction a=%.1fdeg, x=%dmm, y=%dmm\n", (float)da/(float)ANG_1_DEG, dx, dy);
+
 						if(state_vect.v.localize_with_big_search_area)
 							correct_robot_pos(da, dx, dy, pos_corr_id);
 						else
 							correct_robot_pos(da/2, dx/2, dy/2, pos_corr_id);
 						n_lidars_to_map = 0;
+
+						if(span_exceeded)
+							lidars_to_map[n_lidars_to_map++] = p_lid;
 					}
 				}
 
@@ -2561,6 +2629,18 @@ void cmd_from_client_to_host(int cmd, thread_struct **pp_host_t)
 #endif
 		flush_3dtof = 2; // Flush two extra scans
 	}
+	else if(cmd == TCP_CR_QMAP_MID)
+	{
+		int level = msg_cr_qmap.level;
+		if(level >= QMAP_LEVELS || msg_cr_qmap.xs < 1 || msg_cr_qmap.ys < 1)
+		{
+			printf("WARN: Illegal quick map request: level=%d, xs=%d, ys=%d\n", level, msg_cr_qmap.xs, msg_cr_qmap.ys);
+			return;
+		}
+
+		// Rendered on the mapping thread, see qmap_handling()
+		queue_qmap_request(&msg_cr_qmap);
+	}
 }
 
 
@@ -49,6 +49,12 @@
 
 #include "mapping.h"
 #include "routing.h"
+#include "arena.h"
+
+// The search hash tables live in the thread's scratch arena with the search units; search() resets it.
+#define uthash_malloc(sz) arena_alloc(thread_arena(), (sz))
+#define uthash_free(ptr,sz)
+
 #include "uthash.h"
 #include "utlist.h"
 
@@ -982,8 +988,10 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 //	printf("Start %d,%d,  end %d,%d  start_ang=%f  start_dir=%d\n", s_x, s_y, e_x, e_y, start_ang, start_dir);
 
 
-	search_unit_t* p_start = (search_unit_t*) malloc(sizeof(search_unit_t));
-	memset(p_start, 0, sizeof(search_unit_t));
+	// All search units are scratch, released at once by the reset on the next search.
+	arena_reset(thread_arena());
+
+	search_unit_t* p_start = (search_unit_t*) arena_calloc(thread_arena(), 1, sizeof(search_unit_t));
 
 	p_start->loc.x = s_x;
 	p_start->loc.y = s_y;
@@ -1066,19 +1074,6 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 			DL_DELETE(*route, tm);
 			free(tm);
 
-			// Free all memory.
-			search_unit_t *p_del, *p_tmp;
-			HASH_ITER(hh, closed_set, p_del, p_tmp)
-			{
-				HASH_DEL(closed_set, p_del);
-				free(p_del);
-			}
-			HASH_ITER(hh, open_set, p_del, p_tmp)
-			{
-				HASH_DEL(open_set, p_del);
-				free(p_del);
-			}
-
 			return 0;
 		}
 
@@ -1093,7 +1088,7 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 			{
 				search_unit_t* found;
 				float new_g;
-				float new_g_from_parent;
+				float new_g_from_parent = 0.0;
 				if(xx == 0 && yy == 0) continue;
 
 				search_unit_t* p_neigh;
@@ -1191,8 +1186,7 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 
 				if(!p_neigh)
 				{
-					p_neigh = (search_unit_t*) malloc(sizeof(search_unit_t));
-					memset(p_neigh, 0, sizeof(search_unit_t));
+					p_neigh = (search_unit_t*) arena_calloc(thread_arena(), 1, sizeof(search_unit_t));
 					p_neigh->loc.x = neigh_loc.x; p_neigh->loc.y = neigh_loc.y;
 					HASH_ADD(hh, open_set, loc,sizeof(route_xy_t), p_neigh);
 
@@ -1228,18 +1222,6 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 		}		
 	}
 
-	search_unit_t *p_del, *p_tmp;
-	HASH_ITER(hh, closed_set, p_del, p_tmp)
-	{
-		HASH_DELETE(hh, closed_set, p_del);
-		free(p_del);
-	}
-	HASH_ITER(hh, open_set, p_del, p_tmp)
-	{
-		HASH_DELETE(hh, open_set, p_del);
-		free(p_del);
-	}
-	
 	//printf("Solution not found, cnt = %d\n", cnt);
 
 	if(cnt < 200)
@@ -1359,91 +1341,40 @@ void gen_routing_page(world_t *w, int xpage, int ypage, int forgiveness)
 	}
 
 	forgiveness = ROUTING_3D_FORGIVENESS;
-	if(forgiveness == 0)
-	{
-		for(int xx=0; xx < MAP_PAGE_W; xx++)
-		{
-			for(int yy=0; yy < MAP_PAGE_W/32; yy++)
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res  = w->pages[xpage][ypage]->units[xx][yy*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage]->units[xx][yy*32+i].constraints;
-#ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (res & UNIT_3D_WALL) || (res & UNIT_ITEM) || (res & UNIT_DROP) || (cons & CONSTRAINT_FORBIDDEN);
-#else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
-#endif
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][yy] = tmp;
-			}
-			if(w->pages[xpage][ypage+1])
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res  = w->pages[xpage][ypage+1]->units[xx][0*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage+1]->units[xx][0*32+i].constraints;
+
+	// Result bits that block the unit. With forgiveness, num_3d_obstacles decides about the 3D things instead.
+	uint8_t blocked_res = UNIT_FREE | UNIT_WALL | UNIT_INVISIBLE_WALL;
+	int max_3d = 255; // num_3d_obstacles never exceeds this
 #ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (res & UNIT_3D_WALL) || (res & UNIT_ITEM) || (res & UNIT_DROP) || (cons & CONSTRAINT_FORBIDDEN);
-#else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
-#endif				
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = tmp;
-			}
-			else
-			{
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = 0xffffffff;
-			}
-		}
-	}
+	if(forgiveness == 0)
+		blocked_res |= UNIT_3D_WALL | UNIT_ITEM | UNIT_DROP;
 	else
+		max_3d = forgiveness;
+#endif
+
+	// The page, and the first word of the page below it. If that page isn't in memory, the view reads it as
+	// empty units; the word is replaced with all obstacles afterwards, keeping the loop free of branches.
+	map_view_t view;
+	map_view_init(w, &view, xpage*MAP_PAGE_W, ypage*MAP_PAGE_W, MAP_PAGE_W, MAP_PAGE_W+32, 0);
+
+	for(int xx=0; xx < MAP_PAGE_W; xx++)
 	{
-		for(int xx=0; xx < MAP_PAGE_W; xx++)
+		uint32_t* out = w->rpages[xpage][ypage]->obst_u32[xx];
+		for(int yy=0; yy < MAP_PAGE_W/32+1; yy++)
 		{
-			for(int yy=0; yy < MAP_PAGE_W/32; yy++)
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res =  w->pages[xpage][ypage]->units[xx][yy*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage]->units[xx][yy*32+i].constraints;
-#ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (w->pages[xpage][ypage]->units[xx][yy*32+i].num_3d_obstacles > forgiveness) || (cons & CONSTRAINT_FORBIDDEN);
-#else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
-#endif
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][yy] = tmp;
-			}
-			if(w->pages[xpage][ypage+1])
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res  = w->pages[xpage][ypage+1]->units[xx][0*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage+1]->units[xx][0*32+i].constraints;
-#ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (w->pages[xpage][ypage+1]->units[xx][0*32+i].num_3d_obstacles > forgiveness) || (cons & CONSTRAINT_FORBIDDEN);
-#else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
-#endif
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = tmp;
-			}
-			else
+			map_unit_ref_t u = MAP_VIEW_UNIT(&view, xx, yy*32);
+			uint32_t tmp = 0;
+			for(int i = 0; i < 32; i++)
 			{
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = 0xffffffff;
+				uint8_t res = MU(u+i, result), cons = MU(u+i, constraints), n_3d = MU(u+i, num_3d_obstacles);
+				tmp<<=1;
+				tmp |= (res & blocked_res) || (cons & CONSTRAINT_FORBIDDEN) || (n_3d > max_3d);
 			}
+			out[yy] = tmp;
 		}
+		if(!MAP_VIEW_LOADED(&view, xx, MAP_PAGE_W))
+			out[MAP_PAGE_W/32] = 0xffffffff;
 	}
-	
 }
 
 void gen_all_routing_pages(world_t *w, int forgiveness)
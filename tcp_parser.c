@@ -125,9 +125,16 @@ tcp_message_t msgmeta_cr_setpos =
 	10, "sii"
 };
 
+tcp_cr_qmap_t msg_cr_qmap;
+tcp_message_t msgmeta_cr_qmap =
+{
+	&msg_cr_qmap,
+	TCP_CR_QMAP_MID,
+	11, "iiBBB"
+};
 
 
-#define NUM_CR_MSGS 11
+#define NUM_CR_MSGS 12
 tcp_message_t* CR_MSGS[NUM_CR_MSGS] =
 {
 	&msgmeta_cr_dest,
@@ -140,7 +147,8 @@ tcp_message_t* CR_MSGS[NUM_CR_MSGS] =
 	&msgmeta_cr_maintenance,
 	&msgmeta_cr_speedlim,
 	&msgmeta_cr_statevect,
-	&msgmeta_cr_setpos
+	&msgmeta_cr_setpos,
+	&msgmeta_cr_qmap
 };
 
 // Robot->Client messages
@@ -425,6 +433,38 @@ void tcp_send_hmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_
 	free(buf);
 }
 
+void tcp_send_qmap(int xs, int ys, int xorig_mm, int yorig_mm, int unit_size_mm, uint8_t *qmap)
+{
+	if(xs < 1 || xs > 255 || ys < 1 || ys > 255 || unit_size_mm < 1 || unit_size_mm > 65535 || !qmap)
+	{
+		printf("ERR: tcp_send_qmap() argument sanity check fail\n");
+		return;
+	}
+
+	int size = 3 + 2+2+4+4+2+xs*ys;
+	uint8_t *buf = malloc(size);
+	if(!buf)
+	{
+		printf("ERROR: Out of memory in tcp_send_qmap\n");
+		return;
+	}
+
+	buf[0] = TCP_RC_QMAP_MID;
+	buf[1] = ((size-3)>>8)&0xff;
+	buf[2] = (size-3)&0xff;
+
+	I16TOBUF(xs, buf, 3);
+	I16TOBUF(ys, buf, 5);
+	I32TOBUF(xorig_mm, buf, 7);
+	I32TOBUF(yorig_mm, buf, 11);
+	I16TOBUF(unit_size_mm, buf, 15);
+
+	memcpy(&buf[17], qmap, xs*ys);
+
+	tcp_send(buf, size);
+	free(buf);
+}
+
 void tcp_send_battery()
 {
 	const int size = 9;
@@ -152,6 +152,23 @@ typedef struct __attribute__ ((packed))
 
 extern tcp_cr_setpos_t msg_cr_setpos;
 
+/*
+QMAP: Request a low-resolution view of the map, answered with TCP_RC_QMAP_MID. Each returned byte is the OR of the
+mapping result bytes (UNIT_* flags) of the map units it covers. Level 0, 1 and 2 give 80, 160 and 320 mm per byte.
+(x, y) is the corner of the area in mm; areas not in memory are returned as 0.
+*/
+#define TCP_CR_QMAP_MID    66
+typedef struct __attribute__ ((packed))
+{
+	int32_t x;
+	int32_t y;
+	uint8_t level;
+	uint8_t xs;
+	uint8_t ys;
+} tcp_cr_qmap_t;
+
+extern tcp_cr_qmap_t msg_cr_qmap;
+
 
 
 #define TCP_RC_POS_MID    130
@@ -231,6 +248,7 @@ extern tcp_rc_route_status_t    msg_rc_route_status;
 
 #define TCP_RC_STATEVECT_MID        145
 #define TCP_RC_LOCALIZATION_RESULT_MID 146
+#define TCP_RC_QMAP_MID             147
 
 
 int tcp_parser(int sock);
@@ -251,6 +269,7 @@ void tcp_send_robot_info();
 void tcp_send_picture(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, uint8_t *pict);
 void tcp_send_statevect();
 void tcp_send_localization_result(int32_t da, int32_t dx, int32_t dy, uint8_t success_code, int32_t score);
+void tcp_send_qmap(int xs, int ys, int xorig_mm, int yorig_mm, int unit_size_mm, uint8_t *qmap);
 
 
 #endif
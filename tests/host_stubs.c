@@ -0,0 +1,80 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Stand-ins for the rn1host.c, hwdata.c and tcp_*.c symbols that the mapping modules link against,
+	so that the tests can run map_lidars() and friends without the robot. No robot, no client.
+
+	The clock is simulated: subsec_timestamp() returns sim_time, which the test advances. That keeps the
+	mapping governor decisions independent of the speed of the machine running the test; busy time is
+	injected with sim_time_per_call instead.
+
+*/
+
+#include <stdint.h>
+
+#include "../datatypes.h"
+#include "../mapping.h"
+#include "../hwdata.h"
+#include "../tcp_parser.h"
+
+double sim_time;
+double sim_time_per_call; // Added to sim_time by every subsec_timestamp() call: simulates a slow machine.
+
+double subsec_timestamp()
+{
+	double ret = sim_time;
+	sim_time += sim_time_per_call;
+	return ret;
+}
+
+state_vect_t state_vect =
+{
+	.v = {
+	.loca_2d = 1,
+	.mapping_2d = 1,
+	.command_source = USER_IN_COMMAND,
+	.localize_with_big_search_area = 0
+	}
+};
+
+int map_significance_mode = MAP_SEMISIGNIFICANT_IMGS | MAP_SIGNIFICANT_IMGS;
+uint32_t robot_id = 0x7e57c0de;
+int tcp_client_sock = -1;
+int max_speedlim = 400;
+int route_finished_or_notfound;
+int compass_round_active;
+int32_t cur_ang, cur_x, cur_y, cur_compass_ang;
+xymove_t cur_xymove;
+
+lidar_scan_t lidars[LIDAR_RING_BUF_LEN];
+lidar_scan_t significant_lidars[SIGNIFICANT_LIDAR_RING_BUF_LEN];
+lidar_scan_t* lidars_to_map_at_routing_start[4]; // NUM_LATEST_LIDARS_FOR_ROUTING_START in rn1host.c
+
+void send_info(info_state_t state) {}
+void stop_movement() {}
+void daiju_mode(int on) {}
+void do_compass_round() {}
+void set_hw_obstacle_avoidance_margin(int mm) {}
+void set_robot_pos(int32_t na, int32_t nx, int32_t ny) {}
+void move_to(int32_t x, int32_t y, int8_t backmode, int id, int speedlimit, int accurate_turn) {}
+int run_search(int32_t dest_x, int32_t dest_y, int dont_map_lidars, int no_tight) { return -1; }
+
+void tcp_send_dbgpoint(int x, int y, uint8_t r, uint8_t g, uint8_t b, int persistence) {}
+void tcp_send_statevect() {}
+void tcp_send_localization_result(int32_t da, int32_t dx, int32_t dy, uint8_t success_code, int32_t score) {}
@@ -0,0 +1,148 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Mapping rate governor replay: the simulated robot of sim_office.c drives through the office in three
+	phases, and the governor level must follow:
+
+	1) Clean scans, no busy time: localization keeps succeeding, so the level must go down (cheaper).
+	2) Random scans (mapping off, so that they don't end up in the map): localization fails, so the level
+	   must go up (wider search), and the batches must not get smaller.
+	3) Clean scans again, but every subsec_timestamp() call takes simulated time, so the mapping duty cycle
+	   is over the target: the level must go down to the cheapest, and never up while over the budget.
+
+	Run with "make test".
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../datatypes.h"
+#include "../mapping.h"
+#include "../hwdata.h"
+#include "sim_office.h"
+
+extern double sim_time_per_call;
+
+#define PHASE_BATCHES 40
+/*
+	Simulated time taken by every subsec_timestamp() call in the busy phase. The map_lidars() stages are timed
+	by pairs of calls, and about 40 % of the calls fall inside the timed stages, so the duty cycle settles
+	around 0.37: over the 0.30 target whatever the value, once it's large compared to the scan interval.
+*/
+#define BUSY_PER_CALL 1.0 // s
+
+static sim_batcher_t batcher;
+static int fails;
+
+static void check(int ok, const char* what)
+{
+	fprintf(stderr, "%s: %s\n", ok ? "Info" : "FAIL", what);
+	if(!ok)
+		fails++;
+}
+
+// Drives until n batches have been mapped, around the route as many times as needed.
+// Returns the highest and the lowest level seen after each batch, and whether the level went up while over budget.
+static void drive(int n, int* level_min, int* level_max, int* wider_over_budget)
+{
+	*level_min = *level_max = map_governor.level;
+	*wider_over_budget = 0;
+	while(n > 0)
+	{
+		int prev_level = map_governor.level;
+		int prev_over = map_governor.n_over_budget;
+		int ret = sim_step(&batcher, NULL);
+		if(ret == 0)
+		{
+			route_idx = 1;
+			continue;
+		}
+		if(ret != 2)
+			continue;
+
+		n--;
+		if(map_governor.level < *level_min) *level_min = map_governor.level;
+		if(map_governor.level > *level_max) *level_max = map_governor.level;
+		if(map_governor.n_over_budget > prev_over && map_governor.level > prev_level)
+			*wider_over_budget = 1;
+	}
+}
+
+static void print_counters(const char* phase, int level_min, int level_max)
+{
+	fprintf(stderr, "%-14s level %d (%d..%d), batches %d, accepted %d, rejected %d, cheaper %d, wider %d, over budget %d, duty %.2f\n",
+		phase, map_governor.level, level_min, level_max, map_governor.n_lidar_batches, map_governor.n_accepted,
+		map_governor.n_rejected, map_governor.n_cheaper, map_governor.n_wider, map_governor.n_over_budget, map_governor.duty);
+}
+
+int main()
+{
+	// The mapping modules are chatty; only the governor is interesting here.
+	if(!freopen("/dev/null", "w", stdout))
+		return 1;
+
+	sim_init(1);
+	int level_min, level_max, wider_over_budget;
+	map_governor_t before;
+
+	int default_level = map_governor.level;
+	drive(PHASE_BATCHES, &level_min, &level_max, &wider_over_budget);
+	print_counters("clean", level_min, level_max);
+	check(map_governor.n_cheaper > 0 && level_min < default_level, "clean scans make the governor cheaper");
+	check(map_governor.n_over_budget == 0, "no busy time, never over budget");
+
+	before = map_governor;
+	state_vect.v.mapping_2d = 0;
+	sim_scan_random = 1;
+	drive(PHASE_BATCHES, &level_min, &level_max, &wider_over_budget);
+	sim_scan_random = 0;
+	print_counters("failing", level_min, level_max);
+	int top_level = map_governor.level;
+	check(map_governor.n_rejected - before.n_rejected >= PHASE_BATCHES/2, "random scans are rejected");
+	check(map_governor.n_wider > before.n_wider && map_governor.level > before.level, "failure streak widens the search");
+	check(map_governor.n_cheaper == before.n_cheaper, "never cheaper while failing");
+	check(map_governor.lidar_batch >= 4, "widening doesn't shrink the batches");
+
+	// The odometry drifted while lost: the operator puts the robot back where it is.
+	belief = truth;
+	state_vect.v.mapping_2d = 1;
+
+	before = map_governor;
+	sim_time_per_call = BUSY_PER_CALL;
+	drive(PHASE_BATCHES, &level_min, &level_max, &wider_over_budget);
+	sim_time_per_call = 0.0;
+	print_counters("busy", level_min, level_max);
+	check(map_governor.n_over_budget > before.n_over_budget, "injected busy time goes over budget");
+	check(map_governor.level < top_level && level_min == 0, "over budget steps down to the cheapest level");
+	check(!wider_over_budget, "never wider while over budget");
+
+	if(fails)
+	{
+		fprintf(stderr, "replay_governor: %d checks failed\n", fails);
+		return 1;
+	}
+	fprintf(stderr, "replay_governor: OK\n");
+	return 0;
+}
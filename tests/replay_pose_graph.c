@@ -0,0 +1,173 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Closed-loop localization replay: a simulated robot drives laps through the simulated office of
+	sim_office.c, with biased, noisy odometry and a simulated lidar. The map is built from scratch.
+
+	Each pose graph mode is replayed in its own process (the mapping modules keep static state), and
+	the position error against the ground truth and the CPU time used are reported for each.
+
+	Usage: replay_pose_graph [laps] [seed]   (run by "make test" with the defaults)
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../datatypes.h"
+#include "../mapping.h"
+#include "../hwdata.h"
+#include "../map_memdisk.h"
+#include "../pose_graph.h"
+#include "sim_office.h"
+
+/*
+	One replay
+*/
+
+typedef struct
+{
+	int n_steps;
+	int n_batches;
+	double err_sum2;
+	double err_max;
+	double err_final;
+	double ang_err_max;
+	double cpu_s;
+	double map_lidars_s;
+} replay_result_t;
+
+static double process_cpu_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void replay(int laps, uint64_t seed, replay_result_t* res)
+{
+	memset(res, 0, sizeof(*res));
+	sim_init(seed);
+
+	double cpu_start = process_cpu_now();
+
+	sim_batcher_t batcher;
+	memset(&batcher, 0, sizeof(batcher));
+
+	for(int lap = 0; lap < laps; lap++)
+	{
+		route_idx = 1;
+		int ret;
+		while( (ret = sim_step(&batcher, &res->map_lidars_s)) != 0)
+		{
+			double ex = belief.x - truth.x, ey = belief.y - truth.y;
+			double err = sqrt(ex*ex + ey*ey);
+			double ang_err = fabs(wrap_rad(belief.t - truth.t))*180.0/M_PI;
+			res->n_steps++;
+			res->err_sum2 += err*err;
+			if(err > res->err_max) res->err_max = err;
+			if(ang_err > res->ang_err_max) res->ang_err_max = ang_err;
+			res->err_final = err;
+			if(ret == 2)
+				res->n_batches++;
+		}
+	}
+
+	res->cpu_s = process_cpu_now() - cpu_start;
+}
+
+static int run_mode(int mode, int laps, uint64_t seed, replay_result_t* res)
+{
+	fflush(stdout);
+	int fd[2];
+	if(pipe(fd) < 0)
+		return -1;
+
+	pid_t pid = fork();
+	if(pid < 0)
+		return -1;
+
+	if(pid == 0)
+	{
+		close(fd[0]);
+		// The mapping modules are chatty; only the summary is interesting here.
+		if(!freopen("/dev/null", "w", stdout))
+			_exit(1);
+		map_pose_graph = mode;
+		replay(laps, seed, res);
+		if(write(fd[1], res, sizeof(*res)) != sizeof(*res))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fd[1]);
+	int ok = read(fd[0], res, sizeof(*res)) == sizeof(*res);
+	close(fd[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return (ok && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+	int laps = (argc > 1) ? atoi(argv[1]) : 3;
+	uint64_t seed = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1;
+	if(laps < 1 || seed == 0)
+	{
+		printf("Usage: replay_pose_graph [laps] [random seed, nonzero]\n");
+		return 1;
+	}
+
+	static const char* mode_names[] = {"off", "estimate only", "corrects the robot"};
+	replay_result_t res[3];
+
+	printf("Replay: %d laps, seed %llu, odometry scale error %.1f%%, heading drift %.2f deg/m\n", laps, (unsigned long long)seed, ODO_SCALE_ERR*100.0, ODO_ANG_DRIFT*180.0/M_PI);
+	printf("%-20s %8s %8s %8s %9s %8s %10s %11s\n", "pose graph", "batches", "rms mm", "max mm", "final mm", "max deg", "cpu s", "map_lidars s");
+	for(int m = 0; m < 3; m++)
+	{
+		if(run_mode(m, laps, seed, &res[m]) < 0)
+		{
+			printf("FAIL: replay with pose graph %s crashed\n", mode_names[m]);
+			return 1;
+		}
+		printf("%-20s %8d %8.1f %8.1f %9.1f %8.2f %10.2f %11.2f\n", mode_names[m], res[m].n_batches,
+			sqrt(res[m].err_sum2/res[m].n_steps), res[m].err_max, res[m].err_final, res[m].ang_err_max,
+			res[m].cpu_s, res[m].map_lidars_s);
+	}
+
+	// Only gross failures fail the test: the robot must stay localized in every mode.
+	for(int m = 0; m < 3; m++)
+	{
+		if(res[m].err_max > 1000.0)
+		{
+			printf("FAIL: pose graph %s: position error reached %.0f mm\n", mode_names[m], res[m].err_max);
+			return 1;
+		}
+	}
+	printf("replay_pose_graph: OK\n");
+	return 0;
+}
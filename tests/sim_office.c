@@ -0,0 +1,311 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Simulated office for the replay tests; see sim_office.h.
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../datatypes.h"
+#include "../mapping.h"
+#include "../hwdata.h"
+#include "../map_memdisk.h"
+#include "../pose_graph.h"
+#include "sim_office.h"
+
+#define sq(x) ((x)*(x))
+
+extern double sim_time;
+extern world_t world;
+
+#define SIM_SPEED 400.0       // mm/s
+#define SIM_TURN_RATE 60.0    // deg/s
+#define LIDAR_N_POINTS 360
+#define LIDAR_RANGE 6000.0    // mm
+#define LIDAR_NOISE 8.0       // mm, standard deviation
+
+// Odometry errors: wheel scale error, heading drift per meter driven, and noise.
+#define ODO_TURN_SCALE_ERR 0.015
+#define ODO_NOISE_XY 2.0                 // mm per step
+#define ODO_NOISE_ANG (0.05*M_PI/180.0)  // rad per step
+
+/*
+	Simulated world
+*/
+
+typedef struct
+{
+	double x0, y0, x1, y1;
+} seg_t;
+
+#define MAX_SEGS 256
+static seg_t segs[MAX_SEGS];
+static int n_segs;
+
+static void add_wall(double x0, double y0, double x1, double y1)
+{
+	segs[n_segs++] = (seg_t){x0, y0, x1, y1};
+}
+
+static void add_box(double x0, double y0, double x1, double y1)
+{
+	add_wall(x0, y0, x1, y0);
+	add_wall(x1, y0, x1, y1);
+	add_wall(x1, y1, x0, y1);
+	add_wall(x0, y1, x0, y0);
+}
+
+// 20 m x 14 m: a big room on the left, two rooms and a corridor on the right, connected with doors.
+static void build_world()
+{
+	n_segs = 0;
+	add_box(0, 0, 20000, 14000);
+
+	add_wall(8000, 0, 8000, 5000);      // Door at y = 5000..6500
+	add_wall(8000, 6500, 8000, 14000);
+	add_wall(8000, 7000, 13000, 7000);  // Door at x = 13000..14500
+	add_wall(14500, 7000, 20000, 7000);
+	add_wall(14000, 0, 14000, 3000);    // Door at y = 3000..4500
+	add_wall(14000, 4500, 14000, 7000);
+
+	// Pillars, shelves and other furniture, so that long walls aren't the only thing to match to.
+	add_box(3800, 3800, 4200, 4200);
+	add_box(3800, 9800, 4200, 10200);
+	add_box(1000, 11500, 2500, 12000);
+	add_box(5500, 12500, 7500, 13000);
+	add_box(6800, 1000, 7300, 2800);
+	add_box(10000, 1500, 11500, 2000);
+	add_box(16500, 10500, 17500, 11500);
+	add_box(10000, 9500, 10600, 12500);
+	add_box(18500, 1000, 19500, 1600);
+	add_box(15500, 5500, 16200, 6200);
+	add_wall(11000, 13000, 12500, 12300);
+	add_wall(2500, 6000, 3200, 7200);
+}
+
+static double raycast(double px, double py, double c, double s)
+{
+	double best = 1e9;
+	for(int i = 0; i < n_segs; i++)
+	{
+		double ex = segs[i].x1 - segs[i].x0, ey = segs[i].y1 - segs[i].y0;
+		double den = c*ey - s*ex;
+		if(fabs(den) < 1e-12)
+			continue;
+		double wx = segs[i].x0 - px, wy = segs[i].y0 - py;
+		double t = (wx*ey - wy*ex)/den;   // Along the ray
+		double u = (wx*s - wy*c)/den;     // Along the segment
+		if(t > 0.0 && u >= 0.0 && u <= 1.0 && t < best)
+			best = t;
+	}
+	return best;
+}
+
+/*
+	Deterministic random numbers, independent of the C library.
+*/
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static double rng_uniform()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (double)(rng_state >> 11) / 9007199254740992.0;
+}
+
+double rng_gauss()
+{
+	double u1 = rng_uniform(), u2 = rng_uniform();
+	if(u1 < 1e-300) u1 = 1e-300;
+	return sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+}
+
+/*
+	Simulated robot
+*/
+
+int sim_scan_random;
+
+static const double route[][2] =
+{
+	{2000, 2000}, {5500, 2500}, {6000, 5750}, {10500, 5750}, {11500, 3750}, {17000, 3750}, {17000, 5200},
+	{13750, 5200}, {13750, 9500}, {17500, 9000}, {17000, 12500}, {11500, 11500}, {9500, 9000}, {10500, 5750},
+	{6000, 5750}, {5000, 11000}, {1800, 9000}, {2000, 2000}
+};
+#define ROUTE_LEN ((int)(sizeof(route)/sizeof(route[0])))
+
+sim_pose_t truth, belief;
+int route_idx;
+
+double wrap_rad(double a)
+{
+	while(a > M_PI) a -= 2.0*M_PI;
+	while(a < -M_PI) a += 2.0*M_PI;
+	return a;
+}
+
+int sim_move()
+{
+	if(route_idx >= ROUTE_LEN)
+		return 0;
+
+	double dx = route[route_idx][0] - truth.x, dy = route[route_idx][1] - truth.y;
+	double dist = sqrt(dx*dx + dy*dy);
+	if(dist < 50.0)
+	{
+		route_idx++;
+		return route_idx < ROUTE_LEN;
+	}
+
+	double turn = wrap_rad(atan2(dy, dx) - truth.t);
+	double max_turn = SIM_TURN_RATE*M_PI/180.0*SIM_DT;
+	double fwd = 0.0;
+	if(turn > max_turn) turn = max_turn;
+	else if(turn < -max_turn) turn = -max_turn;
+	else
+	{
+		fwd = SIM_SPEED*SIM_DT;
+		if(fwd > dist) fwd = dist;
+	}
+
+	truth.t = wrap_rad(truth.t + turn);
+	truth.x += fwd*cos(truth.t);
+	truth.y += fwd*sin(truth.t);
+
+	// The robot integrates its own, erroneous, idea of the same movement.
+	double o_fwd = fwd*(1.0 + ODO_SCALE_ERR) + ODO_NOISE_XY*rng_gauss()*(fwd > 0.0);
+	double o_turn = turn*(1.0 + ODO_TURN_SCALE_ERR) + ODO_ANG_DRIFT*fwd/1000.0 + ODO_NOISE_ANG*rng_gauss();
+	belief.t = wrap_rad(belief.t + o_turn);
+	belief.x += o_fwd*cos(belief.t);
+	belief.y += o_fwd*sin(belief.t);
+	return 1;
+}
+
+static int32_t rad_to_ang32(double r)
+{
+	return (int32_t)(int64_t)llround(wrap_rad(r)*(2147483648.0/M_PI));
+}
+
+void sim_scan(lidar_scan_t* lid, int id)
+{
+	memset(lid, 0, sizeof(*lid));
+	lid->id = id;
+	lid->significant_for_mapping = MAP_SIGNIFICANT_IMGS;
+	lid->robot_pos.ang = rad_to_ang32(belief.t);
+	lid->robot_pos.x = lround(belief.x);
+	lid->robot_pos.y = lround(belief.y);
+	lid->n_points = LIDAR_N_POINTS;
+
+	for(int i = 0; i < LIDAR_N_POINTS; i++)
+	{
+		double a = 2.0*M_PI*i/LIDAR_N_POINTS;
+		double r = sim_scan_random ? (100.0 + (LIDAR_RANGE-100.0)*rng_uniform()) :
+			raycast(truth.x, truth.y, cos(truth.t + a), sin(truth.t + a));
+		if(r > LIDAR_RANGE || r < 100.0)
+			continue;
+		r += LIDAR_NOISE*rng_gauss();
+		lid->scan[i].valid = 1;
+		lid->scan[i].x = lround(belief.x + r*cos(belief.t + a));
+		lid->scan[i].y = lround(belief.y + r*sin(belief.t + a));
+	}
+}
+
+void sim_correct(int32_t da, int32_t dx, int32_t dy)
+{
+	pose_graph_robot_corrected(da, dx, dy);
+	belief.t = wrap_rad(belief.t - (double)da*(M_PI/2147483648.0));
+	belief.x += dx;
+	belief.y += dy;
+}
+
+void sim_init(uint64_t seed)
+{
+	build_world();
+	rng_state = 0x9e3779b97f4a7c15ULL*seed;
+	truth = (sim_pose_t){route[0][0], route[0][1], 0.0};
+	belief = truth;
+	route_idx = 1;
+}
+
+static double thread_cpu_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int sim_step(sim_batcher_t* b, double* map_lidars_s)
+{
+	if(!sim_move())
+		return 0;
+
+	sim_time += SIM_DT;
+	lidar_scan_t* lid = &significant_lidars[b->n_scans%SIGNIFICANT_LIDAR_RING_BUF_LEN];
+	sim_scan(lid, b->n_scans);
+	b->n_scans++;
+
+	// Same significance limits as parse_uart_msg()
+	int32_t da = lid->robot_pos.ang - b->prev_sig.ang;
+	int32_t dx = lid->robot_pos.x - b->prev_sig.x, dy = lid->robot_pos.y - b->prev_sig.y;
+	if(b->have_prev_sig && !(da < -15*ANG_1_DEG || da > 15*ANG_1_DEG || sq(dx)+sq(dy) > sq(50)))
+		return 1;
+	b->prev_sig = lid->robot_pos;
+	b->have_prev_sig = 1;
+
+	int idx_x, idx_y, offs_x, offs_y;
+	page_coords(lid->robot_pos.x, lid->robot_pos.y, &idx_x, &idx_y, &offs_x, &offs_y);
+	load_25pages(&world, idx_x, idx_y);
+
+	// The rest as in lidar_handling()
+	if(!lidar_is_keyframe(&world, lid))
+		return 1;
+
+	int span_exceeded = b->n_lidars_to_map > 0 &&
+		sq(lid->robot_pos.x - b->lidars_to_map[0]->robot_pos.x) + sq(lid->robot_pos.y - b->lidars_to_map[0]->robot_pos.y) > sq(LIDAR_BATCH_MAX_SPAN);
+	if(!span_exceeded)
+		b->lidars_to_map[b->n_lidars_to_map++] = lid;
+
+	if(!span_exceeded && b->n_lidars_to_map <= map_governor.lidar_batch)
+		return 1;
+
+	int32_t c_da, c_dx, c_dy;
+	double t0 = thread_cpu_now();
+	map_lidars(&world, b->n_lidars_to_map, b->lidars_to_map, &c_da, &c_dx, &c_dy);
+	if(map_lidars_s)
+		*map_lidars_s += thread_cpu_now() - t0;
+
+	pose_graph_sync();
+	if(map_pose_graph == POSE_GRAPH_CORRECTS && pose_graph_correction(&c_da, &c_dx, &c_dy))
+		printf("Pose graph correction a=%.1fdeg, x=%dmm, y=%dmm\n", (float)c_da/(float)ANG_1_DEG, c_dx, c_dy);
+
+	sim_correct(c_da/2, c_dx/2, c_dy/2);
+	b->n_lidars_to_map = 0;
+	if(span_exceeded)
+		b->lidars_to_map[b->n_lidars_to_map++] = lid;
+	return 2;
+}
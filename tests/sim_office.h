@@ -0,0 +1,81 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Simulated office for the replay tests: walls, a simulated lidar, and a robot driving a fixed route with
+	biased, noisy odometry. The scans go through the same keyframe selection, batching and map_lidars()
+	calls as in lidar_handling() in rn1host.c, and the corrections are fed back to the simulated odometry
+	like correct_robot_pos() does.
+
+*/
+
+#ifndef SIM_OFFICE_H
+#define SIM_OFFICE_H
+
+#include <stdint.h>
+#include "../datatypes.h"
+
+#define SIM_DT 0.2            // s between lidar scans
+#define ODO_SCALE_ERR 0.010
+#define ODO_ANG_DRIFT (0.6*M_PI/180.0)   // rad/m
+
+typedef struct
+{
+	double x, y, t; // mm, mm, rad
+} sim_pose_t;
+
+extern sim_pose_t truth;  // Where the robot is
+extern sim_pose_t belief; // Where its odometry says it is
+extern int route_idx;     // Next waypoint; sim_move() returns 0 after the last one.
+
+// Builds the walls, and puts the robot at the start of the route, with the given random seed (nonzero).
+void sim_init(uint64_t seed);
+
+double wrap_rad(double a);
+double rng_gauss();
+
+// One SIM_DT step towards the next waypoint: turn in place first, then drive. Returns 0 after the last one.
+int sim_move();
+
+// Measures the true surroundings, but reports them from the pose the robot believes in, like the robot does.
+void sim_scan(lidar_scan_t* lid, int id);
+
+// While set, sim_scan() returns random points, which don't match anything: localization fails on demand.
+extern int sim_scan_random;
+
+// correct_robot_pos(): new angle = ang - da, new x = x + dx
+void sim_correct(int32_t da, int32_t dx, int32_t dy);
+
+// The lidar_handling() state between calls
+typedef struct
+{
+	int n_scans;
+	int n_lidars_to_map;
+	lidar_scan_t* lidars_to_map[20];
+	pos_t prev_sig;
+	int have_prev_sig;
+} sim_batcher_t;
+
+/*
+	Moves the robot one step, scans, and maps a batch when lidar_handling() would. Returns 0 at the end of
+	the route, 2 if a batch was given to map_lidars(), otherwise 1. map_lidars_s gets the thread CPU time
+	spent in map_lidars() added to it (can be NULL).
+*/
+int sim_step(sim_batcher_t* b, double* map_lidars_s);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Golden test of the map_seen_counters kernels against the per-unit MERGE_SEEN update that
+	do_mapping used to do. map_counters.c is included directly to reach the static kernels.
+	Run with "make test".
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../map_counters.c"
+
+#define N_UNITS 1000 // Not a multiple of 16, so the vector kernels also run their scalar tails.
+#define N_ROUNDS 2000
+
+typedef struct
+{
+	uint8_t result;
+	uint8_t num_seen;
+	uint8_t num_obstacles;
+	uint8_t pad; // Like map_unit_t, the fields of consecutive units are not adjacent.
+} aos_unit_t;
+
+// Straight from the old do_mapping MERGE_SEEN branch, with int arithmetic and no saturating tricks.
+static void golden(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles, uint8_t op, uint8_t* obst_changed)
+{
+	*obst_changed = 0;
+	if(!op)
+		return;
+
+	*result |= UNIT_MAPPED;
+	PLUS_SAT_255(*num_seen);
+
+	int old_val = *num_obstacles;
+	MINUS_SAT_0(*num_obstacles);
+	int new_val = *num_obstacles;
+	if(new_val != old_val && (new_val < SCORE_SATURATION_OBSTACLES || old_val < SCORE_SATURATION_OBSTACLES))
+		*obst_changed = 1;
+
+	if(((op & MERGE_SEEN_SURE) && ((int)*num_seen > (2*(int)*num_obstacles + 3)))
+	   || ((op & MERGE_FEW_NEIGH) && ((int)*num_seen > (5*(int)*num_obstacles + 10))))
+	{
+		*result &= ~(UNIT_WALL);
+	}
+}
+
+// Counter values around the saturation points and the wall vanishing limits, or anything.
+static uint8_t edge_value()
+{
+	static const uint8_t edges[] = {0, 1, 2, 3, 4, 5, 10, 11, 12, 13, 31, 32, 33, 34, 48, 49, 50, 51, 124, 125, 126, 127, 128,
+		247, 248, 249, 250, 251, 252, 253, 254, 255};
+	if(rand()%4 == 0)
+		return rand()%256;
+	return edges[rand()%sizeof(edges)];
+}
+
+typedef int (*kernel_func_t)(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles,
+	const uint8_t* ops, uint8_t* obst_changed, int n);
+
+static int scalar_stride1(uint8_t* result, uint8_t* num_seen, uint8_t* num_obstacles,
+	const uint8_t* ops, uint8_t* obst_changed, int n)
+{
+	return seen_counters_scalar(result, num_seen, num_obstacles, 1, ops, obst_changed, n);
+}
+
+static int fails;
+
+static void check(const char* name, int round, int i, const char* field, int got, int expected)
+{
+	if(got == expected)
+		return;
+	if(fails < 10)
+		printf("FAIL: %s kernel, round %d, unit %d: %s = %d, expected %d\n", name, round, i, field, got, expected);
+	fails++;
+}
+
+int main()
+{
+	kernel_func_t kernels[4];
+	const char* names[4];
+	int n_kernels = 0;
+	kernels[n_kernels] = scalar_stride1; names[n_kernels++] = "scalar";
+#ifdef COUNTERS_HAVE_SSE2
+	kernels[n_kernels] = seen_counters_sse2; names[n_kernels++] = "SSE2";
+#endif
+#ifdef COUNTERS_HAVE_NEON
+	kernels[n_kernels] = seen_counters_neon; names[n_kernels++] = "NEON";
+#endif
+
+	static uint8_t in_result[N_UNITS], in_seen[N_UNITS], in_obst[N_UNITS], ops[N_UNITS];
+	static uint8_t ref_result[N_UNITS], ref_seen[N_UNITS], ref_obst[N_UNITS], ref_changed[N_UNITS];
+	static uint8_t result[N_UNITS], seen[N_UNITS], obst[N_UNITS], changed[N_UNITS];
+	static aos_unit_t aos[N_UNITS];
+
+	srand(4321);
+	for(int round = 0; round < N_ROUNDS; round++)
+	{
+		// Some rounds mostly idle, to hit the all-idle skip of the vector kernels.
+		int idle_pct = (round%3 == 0) ? 97 : 30;
+		int ref_cnt = 0;
+		for(int i = 0; i < N_UNITS; i++)
+		{
+			in_result[i] = rand()%256;
+			in_seen[i] = edge_value();
+			in_obst[i] = edge_value();
+			ops[i] = (rand()%100 < idle_pct) ? 0 : (MERGE_SEEN | (rand()%4)*MERGE_SEEN_SURE);
+
+			ref_result[i] = in_result[i]; ref_seen[i] = in_seen[i]; ref_obst[i] = in_obst[i];
+			golden(&ref_result[i], &ref_seen[i], &ref_obst[i], ops[i], &ref_changed[i]);
+			if(ops[i])
+				ref_cnt++;
+		}
+
+		for(int k = 0; k < n_kernels; k++)
+		{
+			memcpy(result, in_result, N_UNITS); memcpy(seen, in_seen, N_UNITS); memcpy(obst, in_obst, N_UNITS);
+			memset(changed, 0xaa, N_UNITS);
+			int cnt = kernels[k](result, seen, obst, ops, changed, N_UNITS);
+			check(names[k], round, -1, "count", cnt, ref_cnt);
+			for(int i = 0; i < N_UNITS; i++)
+			{
+				check(names[k], round, i, "result", result[i], ref_result[i]);
+				check(names[k], round, i, "num_seen", seen[i], ref_seen[i]);
+				check(names[k], round, i, "num_obstacles", obst[i], ref_obst[i]);
+				check(names[k], round, i, "obst_changed", !!changed[i], ref_changed[i]);
+			}
+		}
+
+		// The public entry point with a map_unit_t-like stride: the scalar path.
+		memset(aos, 0x55, sizeof(aos));
+		for(int i = 0; i < N_UNITS; i++)
+		{
+			aos[i].result = in_result[i]; aos[i].num_seen = in_seen[i]; aos[i].num_obstacles = in_obst[i];
+		}
+		memset(changed, 0xaa, N_UNITS);
+		int cnt = map_seen_counters(&aos[0].result, &aos[0].num_seen, &aos[0].num_obstacles, sizeof(aos_unit_t), ops, changed, N_UNITS);
+		check("strided", round, -1, "count", cnt, ref_cnt);
+		for(int i = 0; i < N_UNITS; i++)
+		{
+			check("strided", round, i, "result", aos[i].result, ref_result[i]);
+			check("strided", round, i, "num_seen", aos[i].num_seen, ref_seen[i]);
+			check("strided", round, i, "num_obstacles", aos[i].num_obstacles, ref_obst[i]);
+			check("strided", round, i, "obst_changed", !!changed[i], ref_changed[i]);
+			check("strided", round, i, "pad", aos[i].pad, 0x55);
+		}
+	}
+
+	for(int k = 0; k < n_kernels; k++)
+		printf("Info: tested %s counter kernel\n", names[k]);
+	printf("Info: tested strided counter path\n");
+
+	if(fails)
+	{
+		printf("test_counters: %d mismatches\n", fails);
+		return 1;
+	}
+	printf("test_counters: OK\n");
+	return 0;
+}
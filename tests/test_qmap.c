@@ -0,0 +1,133 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Consistency test of the quick map pyramid: random writes to the map units, each followed by
+	map_units_changed() like the mapping code does, interleaved with qmap_render() of random areas and levels.
+	Every rendered byte must equal the OR of the result bytes of the map units it covers, i.e. no tile may be
+	left stale. Run with "make test".
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mapping.h"
+
+#define N_WRITES 200000
+#define RENDER_EVERY 50
+#define RENDER_MAX_W 64
+
+extern world_t world;
+
+// The pages x0..x0+1, y0..y0+1 are allocated; their neighbours aren't, and must render as 0.
+#define PAGE0 (MAP_MIDDLE_PAGE-1)
+
+static uint8_t brute_qmap(world_t* w, int level, int ux, int uy)
+{
+	int n = 2<<level;
+	ux &= ~(n-1);
+	uy &= ~(n-1);
+	uint8_t ret = 0;
+	for(int x = ux; x < ux+n; x++)
+	{
+		for(int y = uy; y < uy+n; y++)
+		{
+			map_page_t* p = w->pages[x/MAP_PAGE_W][y/MAP_PAGE_W];
+			if(p)
+				ret |= MU(MAP_UNIT(p, x%MAP_PAGE_W, y%MAP_PAGE_W), result);
+		}
+	}
+	return ret;
+}
+
+int main()
+{
+	world_t* w = &world;
+	srand(1234);
+
+	for(int px = PAGE0; px < PAGE0+2; px++)
+	{
+		for(int py = PAGE0; py < PAGE0+2; py++)
+		{
+			w->pages[px][py] = calloc(1, sizeof(map_page_t));
+			if(!w->pages[px][py])
+			{
+				printf("ERROR: Out of memory\n");
+				return 1;
+			}
+		}
+	}
+
+	static uint8_t out[RENDER_MAX_W*RENDER_MAX_W];
+	int fails = 0, renders = 0;
+	for(int i = 0; i < N_WRITES && fails < 10; i++)
+	{
+		// Sparse single bits, so that a stale coarse unit doesn't hide behind a neighbour that has the same bits.
+		int ux = PAGE0*MAP_PAGE_W + rand()%(2*MAP_PAGE_W);
+		int uy = PAGE0*MAP_PAGE_W + rand()%(2*MAP_PAGE_W);
+		map_page_t* p = w->pages[ux/MAP_PAGE_W][uy/MAP_PAGE_W];
+		MU(MAP_UNIT(p, ux%MAP_PAGE_W, uy%MAP_PAGE_W), result) = (rand()%4) ? 0 : (1<<(rand()%8));
+		map_units_changed(w, ux, uy, ux, uy);
+
+		if(i%RENDER_EVERY)
+			continue;
+
+		// Around the write, or anywhere including the unallocated neighbour pages.
+		int level = rand()%QMAP_LEVELS;
+		int xs = 1 + rand()%RENDER_MAX_W, ys = 1 + rand()%RENDER_MAX_W;
+		int x0, y0;
+		if(rand()%2)
+		{
+			x0 = ux - (rand()%(xs<<(level+1)));
+			y0 = uy - (rand()%(ys<<(level+1)));
+		}
+		else
+		{
+			x0 = (PAGE0-1)*MAP_PAGE_W + rand()%(4*MAP_PAGE_W);
+			y0 = (PAGE0-1)*MAP_PAGE_W + rand()%(4*MAP_PAGE_W);
+		}
+
+		qmap_render(w, level, x0, y0, xs, ys, out);
+		renders++;
+
+		for(int y = 0; y < ys; y++)
+		{
+			for(int x = 0; x < xs; x++)
+			{
+				uint8_t expected = brute_qmap(w, level, x0 + (x<<(level+1)), y0 + (y<<(level+1)));
+				if(out[y*xs+x] != expected && fails++ < 10)
+				{
+					printf("FAIL: write %d, level %d, unit (%d,%d): got 0x%02x, expected 0x%02x\n",
+						i, level, x0 + (x<<(level+1)), y0 + (y<<(level+1)), out[y*xs+x], expected);
+				}
+			}
+		}
+	}
+
+	if(fails)
+	{
+		printf("test_qmap: %d mismatches\n", fails);
+		return 1;
+	}
+	printf("Info: %d renders checked\n", renders);
+	printf("test_qmap: OK\n");
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Global relocalization test: the simulated office is mapped by driving one lap, then the robot is carried
+	to places far from where it believes to be, further than the localize_with_big_search_area = 2 search
+	reaches around the pose estimate. The batch scanned there must be matched to the relocalization
+	candidate, and the correction must bring the robot back to the true pose. Run with "make test".
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../datatypes.h"
+#include "../mapping.h"
+#include "../hwdata.h"
+#include "sim_office.h"
+
+extern world_t world;
+
+#define KIDNAP_BATCH 12
+// The map drawn on one lap is itself off by up to 350 mm and 1.5 deg in the far rooms: localizing normally,
+// starting from the true pose, ends up there, too.
+#define MAX_POS_ERR 500.0 // mm
+#define MAX_ANG_ERR 3.0   // deg
+
+// True poses in mapped parts of the office, and where the robot believes to be at the time: 10..16 m away.
+static const struct
+{
+	sim_pose_t truth;
+	sim_pose_t belief;
+} kidnaps[] =
+{
+	{{16000, 9500, 1.0}, {2000, 2000, 0.0}},
+	{{3000, 8000, -2.0}, {17000, 4000, 0.5}},
+	{{11000, 4500, 2.5}, {1500, 11000, -1.0}}
+};
+#define N_KIDNAPS ((int)(sizeof(kidnaps)/sizeof(kidnaps[0])))
+
+int main()
+{
+	sim_init(1);
+
+	sim_batcher_t batcher;
+	memset(&batcher, 0, sizeof(batcher));
+	while(sim_step(&batcher, NULL))
+		;
+
+	// Localization only, anywhere in the map.
+	state_vect.v.mapping_2d = 0;
+
+	int fails = 0;
+	int n_scans = batcher.n_scans;
+	for(int k = 0; k < N_KIDNAPS; k++)
+	{
+		truth = kidnaps[k].truth;
+		belief = kidnaps[k].belief;
+		state_vect.v.localize_with_big_search_area = 2;
+
+		// Turning in place, like the robot does to look around, with perfect odometry.
+		lidar_scan_t* batch[KIDNAP_BATCH];
+		for(int i = 0; i < KIDNAP_BATCH; i++)
+		{
+			batch[i] = &significant_lidars[n_scans%SIGNIFICANT_LIDAR_RING_BUF_LEN];
+			sim_scan(batch[i], n_scans++);
+			truth.t = wrap_rad(truth.t + 0.25);
+			belief.t = wrap_rad(belief.t + 0.25);
+		}
+		truth.t = wrap_rad(truth.t - 0.25);
+		belief.t = wrap_rad(belief.t - 0.25);
+
+		double dist_before = sqrt((belief.x-truth.x)*(belief.x-truth.x) + (belief.y-truth.y)*(belief.y-truth.y));
+
+		int32_t da, dx, dy;
+		map_lidars(&world, KIDNAP_BATCH, batch, &da, &dx, &dy);
+		sim_correct(da, dx, dy);
+
+		double err = sqrt((belief.x-truth.x)*(belief.x-truth.x) + (belief.y-truth.y)*(belief.y-truth.y));
+		double ang_err = fabs(wrap_rad(belief.t - truth.t))*180.0/M_PI;
+		int ok = err < MAX_POS_ERR && ang_err < MAX_ANG_ERR;
+		fprintf(stderr, "%s: kidnap %d: %.0f mm from the estimate, after relocalization %.0f mm, %.1f deg off\n",
+			ok ? "Info" : "FAIL", k, dist_before, err, ang_err);
+		if(!ok)
+			fails++;
+	}
+
+	if(fails)
+	{
+		fprintf(stderr, "test_reloc: %d of %d relocalizations failed\n", fails, N_KIDNAPS);
+		return 1;
+	}
+	fprintf(stderr, "test_reloc: OK\n");
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Bit-exactness test of the scan matching score kernels, in two parts:
+
+	- Random scoremaps and offsets are run through every kernel the running CPU supports, and the
+	  sums are compared against score_accum_scalar.
+	- score_quick_search_xy, with each kernel, is compared against a copy of the original per-point
+	  loop it replaced (golden_quick_search_xy), on random scans and search grids, with and without
+	  the center weighing. mapping.c is included directly to reach the static function.
+
+	Run with "make test".
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mapping.c"
+
+#define SM_W 512
+#define N_ROUNDS 200
+#define N_POINTS 64
+
+#define N_SEARCH_ROUNDS 300
+#define N_SEARCH_LIDARS 3
+
+static int8_t scoremap[SM_W*SM_W + SCOREMAP_PAD];
+
+// The original score_quick_search_xy, before the kernels: sin and cos per point, and the scoremap read in the
+// innermost loop. Only valid for points that stay inside the scoremap, which it doesn't check.
+static int32_t golden_quick_search_xy(int8_t *scoremap, int n_lidars, lidar_scan_t** lidar_list,
+	int32_t rotate_mid_x, int32_t rotate_mid_y,
+	int32_t da, int32_t dx_start, int32_t dx_step, int32_t num_dx, int32_t dy_start, int32_t dy_step, int32_t num_dy,
+	int32_t *best_dx, int32_t *best_dy, int ena_weigh)
+{
+	int n_points = 0;
+	int score[32][32] = {{0}};
+
+	float ang = (float)da/((float)ANG_1_DEG*360.0)*2.0*M_PI;
+
+	for(int l=0; l<n_lidars; l++)
+	{
+		lidar_scan_t* lid = lidar_list[l];
+
+		for(int p=0; p<lid->n_points; p++)
+		{
+			if(!lid->scan[p].valid)
+				continue;
+
+			n_points++;
+
+			int pre_x = lid->scan[p].x - rotate_mid_x;
+			int pre_y = lid->scan[p].y - rotate_mid_y;
+
+			int rotated_x = pre_x*cos(ang) + pre_y*sin(ang);
+			int rotated_y = -1*pre_x*sin(ang) + pre_y*cos(ang);
+
+			for(int ix = 0; ix < num_dx; ix++)
+			{
+				for(int iy = 0; iy < num_dy; iy++)
+				{
+					int x = rotated_x + dx_start+dx_step*ix;
+					int y = rotated_y + dy_start+dy_step*iy;
+
+					x /= MAP_UNIT_W; y /= MAP_UNIT_W;
+					x += TEMP_MAP_MIDDLE; y += TEMP_MAP_MIDDLE;
+
+					score[ix][iy] += scoremap[y*TEMP_MAP_W+x];
+				}
+			}
+		}
+	}
+
+	int best_score = -999999, best_ix = 0, best_iy = 0;
+	int weigh_mid_idx = num_dx/2;
+	for(int ix = 0; ix < num_dx; ix++)
+	{
+		for(int iy = 0; iy < num_dy; iy++)
+		{
+			int sco;
+			if(ena_weigh)
+			{
+				int weigh_dx = num_dx - abs(weigh_mid_idx - ix);
+				int weigh_dy = num_dy - abs(weigh_mid_idx - iy);
+				sco = score[ix][iy]*weigh_dx*weigh_dy;
+			}
+			else
+			{
+				sco = score[ix][iy];
+			}
+
+			if(sco > best_score)
+			{
+				best_score = sco;
+				best_ix = ix;
+				best_iy = iy;
+			}
+		}
+	}
+
+	*best_dx = dx_start+dx_step*best_ix;
+	*best_dy = dy_start+dy_step*best_iy;
+
+	if(n_points < 10) return 0;
+	return (200*best_score)/n_points;
+}
+
+static lidar_scan_t search_lidars[N_SEARCH_LIDARS];
+
+// Returns the number of mismatches.
+static int test_quick_search(score_accum_func_t* funcs, const char** names, int n_funcs)
+{
+	lidar_scan_t* list[N_SEARCH_LIDARS];
+	for(int l = 0; l < N_SEARCH_LIDARS; l++)
+		list[l] = &search_lidars[l];
+
+	int fails = 0;
+	for(int round = 0; round < N_SEARCH_ROUNDS; round++)
+	{
+		// Mapping-like scoremaps: mostly small values, so that the best offsets are not all ties.
+		for(int i = 0; i < SM_W*SM_W + SCOREMAP_PAD; i++)
+			scoremap[i] = (rand()%8) ? (rand()%9 - 4) : (rand()%256 - 128);
+
+		// Points within 7 m of the rotation middle, offsets within 1.6 m: everything stays inside the scoremap.
+		int32_t mid_x = rand()%20001 - 10000, mid_y = rand()%20001 - 10000;
+		for(int l = 0; l < N_SEARCH_LIDARS; l++)
+		{
+			search_lidars[l].n_points = 1 + rand()%MAX_LIDAR_POINTS;
+			for(int p = 0; p < search_lidars[l].n_points; p++)
+			{
+				search_lidars[l].scan[p].valid = rand()%5 != 0;
+				search_lidars[l].scan[p].x = mid_x + rand()%9901 - 4950;
+				search_lidars[l].scan[p].y = mid_y + rand()%9901 - 4950;
+			}
+		}
+
+		// The weighed grids are square and odd, like every weighed search in map_lidars().
+		int ena_weigh = round&1;
+		int num_dx = 1 + rand()%SCORE_MAX_STEPS;
+		if(num_dx == SCORE_MAX_STEPS) num_dx--;
+		int num_dy = num_dx;
+		if(ena_weigh)
+			num_dx = num_dy = num_dx | 1;
+		else
+			num_dy = 1 + rand()%(SCORE_MAX_STEPS-1);
+		int32_t dx_step = 10 + rand()%91, dy_step = 10 + rand()%91;
+		int32_t dx_start = -dx_step*(num_dx/2) + rand()%81 - 40;
+		int32_t dy_start = -dy_step*(num_dy/2) + rand()%81 - 40;
+		int32_t da = (rand()%3601 - 1800)*(ANG_1_DEG/10);
+
+		int32_t ref_dx, ref_dy;
+		int32_t ref = golden_quick_search_xy(scoremap, N_SEARCH_LIDARS, list, mid_x, mid_y, da,
+			dx_start, dx_step, num_dx, dy_start, dy_step, num_dy, &ref_dx, &ref_dy, ena_weigh);
+
+		for(int f = 0; f < n_funcs; f++)
+		{
+			set_score_accum_func(funcs[f]);
+			int32_t got_dx, got_dy;
+			int32_t got = score_quick_search_xy(scoremap, N_SEARCH_LIDARS, list, mid_x, mid_y, da,
+				dx_start, dx_step, num_dx, dy_start, dy_step, num_dy, &got_dx, &got_dy, ena_weigh);
+
+			if(got != ref || got_dx != ref_dx || got_dy != ref_dy)
+			{
+				if(fails < 10)
+					printf("FAIL: score_quick_search_xy with %s kernel, round %d (weigh %d, %dx%d): score %d at (%d,%d), "
+						"original gives %d at (%d,%d)\n", names[f], round, ena_weigh, num_dx, num_dy,
+						got, got_dx, got_dy, ref, ref_dx, ref_dy);
+				fails++;
+			}
+		}
+	}
+	set_score_accum_func(0);
+	return fails;
+}
+
+int main()
+{
+	score_accum_func_t funcs[8];
+	const char* names[8];
+	int n_funcs = get_score_accum_funcs(funcs, names, 8);
+
+	static int32_t ref[SCORE_MAX_STEPS][SCORE_MAX_STEPS];
+	static int32_t score[SCORE_MAX_STEPS][SCORE_MAX_STEPS];
+
+	srand(1234);
+	int fails = 0;
+	for(int round = 0; round < N_ROUNDS; round++)
+	{
+		// Full int8 range, including the extremes, to catch sign extension errors.
+		for(int i = 0; i < SM_W*SM_W + SCOREMAP_PAD; i++)
+			scoremap[i] = (round&1) ? (rand()%256 - 128) : ((rand()&1) ? 127 : -128);
+
+		int num_dx = 1 + rand()%SCORE_MAX_STEPS;
+		int num_dy = 1 + rand()%SCORE_MAX_STEPS;
+
+		// Offsets up to the last byte of the map, which relies on SCOREMAP_PAD for the 4-byte gathers.
+		static int32_t xcol[N_POINTS][SCORE_MAX_STEPS], yrow[N_POINTS][SCORE_MAX_STEPS];
+		for(int p = 0; p < N_POINTS; p++)
+		{
+			for(int i = 0; i < SCORE_MAX_STEPS; i++)
+			{
+				xcol[p][i] = rand()%SM_W;
+				yrow[p][i] = (rand()%SM_W)*SM_W;
+			}
+		}
+		xcol[0][0] = SM_W-1;
+		yrow[0][0] = (SM_W-1)*SM_W;
+
+		memset(ref, 0, sizeof(ref));
+		for(int p = 0; p < N_POINTS; p++)
+			score_accum_scalar(scoremap, xcol[p], num_dx, yrow[p], num_dy, ref);
+
+		for(int f = 0; f < n_funcs; f++)
+		{
+			memset(score, 0, sizeof(score));
+			for(int p = 0; p < N_POINTS; p++)
+				funcs[f](scoremap, xcol[p], num_dx, yrow[p], num_dy, score);
+
+			// Only the num_dx x num_dy corner is defined; vector kernels write garbage past num_dy.
+			for(int ix = 0; ix < num_dx; ix++)
+			{
+				for(int iy = 0; iy < num_dy; iy++)
+				{
+					if(score[ix][iy] != ref[ix][iy])
+					{
+						if(fails < 10)
+							printf("FAIL: %s kernel, round %d: score[%d][%d] = %d, scalar gives %d\n",
+								names[f], round, ix, iy, score[ix][iy], ref[ix][iy]);
+						fails++;
+					}
+				}
+			}
+		}
+	}
+
+	fails += test_quick_search(funcs, names, n_funcs);
+
+	for(int f = 0; f < n_funcs; f++)
+		printf("Info: tested %s score kernel\n", names[f]);
+
+	if(fails)
+	{
+		printf("test_score: %d mismatches\n", fails);
+		return 1;
+	}
+	printf("test_score: OK\n");
+	return 0;
+}